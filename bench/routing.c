@@ -0,0 +1,174 @@
+/**
+ * Route lookup benchmark: compares the radix tree in src/routing.c with the previous
+ * 128-pointer-per-character trie, reproduced below, over route tables of 10, 100 and 1000 paths.
+ *
+ * Build and run from the repository root:
+ * >    cc -O2 -Isrc bench/routing.c $(find src -name '*.c' ! -name test.c) -lpthread -o bench-routing && ./bench-routing
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+#define LOOKUPS 2000000
+
+// <------------------------>
+//     Previous trie router
+// <------------------------>
+
+#define LEGACY_ALPHABET_SIZE 128
+
+typedef struct LegacyNode LegacyNode;
+struct LegacyNode
+{
+    LegacyNode        *children[LEGACY_ALPHABET_SIZE];
+    CTTP_RouteHandler  handler;
+    char              *method;
+};
+
+static size_t legacy_nodes = 0;
+
+static LegacyNode *legacy_new_node()
+{
+    legacy_nodes++;
+    return (LegacyNode *)calloc(1, sizeof(LegacyNode));
+}
+
+static void legacy_free(LegacyNode *node)
+{
+    for (int i = 0; i < LEGACY_ALPHABET_SIZE; i++)
+    {
+        if (node->children[i] != NULL) legacy_free(node->children[i]);
+    }
+    free(node);
+}
+
+static void legacy_add_route(LegacyNode *root, char *m, const char *p, CTTP_RouteHandler h)
+{
+    LegacyNode *node = root;
+    for (int i = 0; p[i] != '\0'; i++)
+    {
+        int c = (unsigned char)p[i] % LEGACY_ALPHABET_SIZE;
+        if (node->children[c] == NULL) node->children[c] = legacy_new_node();
+        node = node->children[c];
+    }
+
+    node->handler = h;
+    node->method = m;
+}
+
+static LegacyNode *legacy_read_route(LegacyNode *root, const char *p, const char *m)
+{
+    LegacyNode *node = root;
+    for (int i = 0; p[i] != '\0'; i++)
+    {
+        int c = (unsigned char)p[i] % LEGACY_ALPHABET_SIZE;
+        if (node->children[c] == NULL) return NULL;
+        node = node->children[c];
+    }
+
+    if (node->handler == NULL || strcmp(node->method, m) != 0) return NULL;
+    return node;
+}
+
+// <------------------------>
+//        Benchmark
+// <------------------------>
+
+static int handler(CTTP_Writer *w, CTTP_Request *r)
+{
+    (void)w;
+    (void)r;
+    return CTTP_ERROR_NIL;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Bytes held by the radix tree rooted at `node`.
+ */
+static size_t radix_size(CTTP_RouteNode *node)
+{
+    size_t size = sizeof(CTTP_RouteNode) + node->plen + 1 + node->nchildren * (sizeof(CTTP_RouteNode *) + 1);
+    for (size_t i = 0; i < node->nchildren; i++)
+    {
+        size += radix_size(node->children[i]);
+    }
+    return size;
+}
+
+/**
+ * Builds `count` REST-like paths sharing prefixes, as real API route tables do.
+ */
+static char **make_paths(size_t count)
+{
+    static const char *resources[] = {"users", "orders", "products", "invoices", "customers", "shipments", "reports", "sessions"};
+    static const char *actions[] = {"", "/items", "/history", "/settings", "/export"};
+
+    char **paths = (char **)malloc(count * sizeof(char *));
+    for (size_t i = 0; i < count; i++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/api/v%zu/%s/%zu%s", i % 3 + 1, resources[i % 8], i / 8, actions[i % 5]);
+        paths[i] = strdup(path);
+    }
+    return paths;
+}
+
+static void run(size_t count)
+{
+    char **paths = make_paths(count);
+
+    CTTP_Server cs;
+    cs.routes = INCTTP_new_route_node();
+    LegacyNode *legacy = legacy_new_node();
+    legacy_nodes = 1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        CTTP_add_route(&cs, "GET", paths[i], handler);
+        legacy_add_route(legacy, "GET", paths[i], handler);
+    }
+
+    size_t found = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++)
+    {
+        CTTP_RouteNode *route;
+        found += CTTP_read_route(&cs, &route, paths[i % count], "GET") == 1;
+    }
+    double radix_ns = (now_ns() - start) / LOOKUPS;
+
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++)
+    {
+        found += legacy_read_route(legacy, paths[i % count], "GET") != NULL;
+    }
+    double legacy_ns = (now_ns() - start) / LOOKUPS;
+
+    if (found != 2 * (size_t)LOOKUPS) fprintf(stderr, "lookup mismatch: %zu\n", found);
+
+    printf("%6zu routes | radix %7.1f ns/op %10zu bytes | trie %7.1f ns/op %10zu bytes\n",
+           count, radix_ns, radix_size(cs.routes), legacy_ns, legacy_nodes * sizeof(LegacyNode));
+
+    INCTTP_free_route_node(cs.routes);
+    legacy_free(legacy);
+    for (size_t i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+}
+
+int main()
+{
+    run(10);
+    run(100);
+    run(1000);
+    return 0;
+}
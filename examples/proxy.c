@@ -0,0 +1,295 @@
+/**
+ * Proxy routes against a stand-in upstream on loopback: a small HTTP/1.1 server answering each path with a different
+ * framing, behind a CTTP server whose proxy routes forward to it. Each case sends one request through the proxy and
+ * checks the answer: pooled connection reuse, `Content-Length`, chunked and close-delimited bodies, an upstream that
+ * never answers (504), one that answers garbage and one that refuses connections (502).
+ *
+ * Build and run from the repository root, with a short upstream timeout for the 504 case:
+ * >    cc -O2 -Isrc -DINCTTP_PROXY_TIMEOUT=1000 examples/proxy.c $(find src -name '*.c' ! -name test.c) -lpthread -o proxy-check && ./proxy-check
+ *
+ * Prints one line per case and exits with 1 if any failed.
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cttp.h"
+
+#define PROXY_PORT    9180
+#define UPSTREAM_PORT 9181
+#define DEAD_PORT     9182
+
+/* Connections the stand-in upstream accepted so far */
+static int accepted;
+
+// <------------------------>
+//     Stand-in upstream
+// <------------------------>
+
+static int send_all(int fd, const char *s, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, s, len, MSG_NOSIGNAL);
+        if (n <= 0) return 0;
+
+        s += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+/**
+ * Serves the requests of upstream connection `arg`, picking the response by path, until the client closes it.
+ */
+static void *serve_upstream(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buf[8192];
+    size_t len = 0;
+
+    while (1)
+    {
+        char *end;
+        while ((end = memmem(buf, len, "\r\n\r\n", 4)) == NULL)
+        {
+            ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+            if (n <= 0) goto done;
+            len += (size_t)n;
+        }
+
+        // Requests through the proxy have no body here, so the head is all there is to consume.
+        char path[64] = "";
+        sscanf(buf, "%*s %63s", path);
+        size_t used = (size_t)(end + 4 - buf);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+
+        char res[512];
+        if (strcmp(path, "/length") == 0)
+        {
+            snprintf(res, sizeof(res), "HTTP/1.1 200 OK\r\nX-Connection: %d\r\nContent-Length: 6\r\n\r\nlength",
+                     __atomic_load_n(&accepted, __ATOMIC_SEQ_CST));
+            if (!send_all(fd, res, strlen(res))) break;
+        }
+        else if (strcmp(path, "/chunked") == 0)
+        {
+            const char *chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                  "3\r\nchu\r\n4;ext=1\r\nnked\r\n0\r\n\r\n";
+            if (!send_all(fd, chunked, strlen(chunked))) break;
+        }
+        else if (strcmp(path, "/close") == 0)
+        {
+            const char *closed = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nclose-delimited";
+            send_all(fd, closed, strlen(closed));
+            break;
+        }
+        else if (strcmp(path, "/silent") == 0)
+        {
+            // Holds the connection without answering, until the proxy gives up.
+            char rest[64];
+            while (recv(fd, rest, sizeof(rest), 0) > 0);
+            break;
+        }
+        else
+        {
+            const char *garbage = "NOT HTTP AT ALL\r\n\r\n";
+            send_all(fd, garbage, strlen(garbage));
+            break;
+        }
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+static int listen_loopback(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        perror("upstream");
+        exit(1);
+    }
+    return fd;
+}
+
+static void *run_upstream(void *arg)
+{
+    int server = (int)(long)arg;
+    while (1)
+    {
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0) continue;
+
+        __atomic_add_fetch(&accepted, 1, __ATOMIC_SEQ_CST);
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_upstream, (void *)(long)fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// <------------------------>
+//          Proxy
+// <------------------------>
+
+static void *run_proxy(void *arg)
+{
+    (void)arg;
+    static const char *const upstreams[] = {"127.0.0.1:9181", NULL};
+    static const char *const dead[] = {"127.0.0.1:9182", NULL};
+
+    CTTP_Server cs = CTTP_new_server(PROXY_PORT);
+    cs.workers = 1; // a single worker, so that its connection pool is the one every request goes through
+    CTTP_add_proxy_route(&cs, "GET", "/*path", upstreams, CTTP_BALANCE_ROUND_ROBIN);
+    CTTP_add_proxy_route(&cs, "GET", "/dead/*path", dead, CTTP_BALANCE_ROUND_ROBIN);
+
+    fprintf(stderr, "proxy: %d\n", CTTP_start_server(&cs));
+    exit(1);
+}
+
+// <------------------------>
+//          Client
+// <------------------------>
+
+typedef struct
+{
+    int    status;
+    int    connection; /* `X-Connection` header, or -1 */
+    char   body[1024];
+    size_t blen;
+}
+Answer;
+
+/**
+ * Decodes the chunked body of `len` bytes at `s` into `a->body`. Returns 0 if it is malformed.
+ */
+static int dechunk(const char *s, size_t len, Answer *a)
+{
+    const char *end = s + len;
+    while (s < end)
+    {
+        char *rest;
+        unsigned long size = strtoul(s, &rest, 16);
+        const char *data = memmem(rest, (size_t)(end - rest), "\r\n", 2);
+        if (rest == s || data == NULL) return 0;
+        if (size == 0) return 1;
+
+        data += 2;
+        if (data + size + 2 > end || a->blen + size > sizeof(a->body)) return 0;
+        memcpy(a->body + a->blen, data, size);
+        a->blen += size;
+        s = data + size + 2;
+    }
+    return 0;
+}
+
+/**
+ * Sends `GET path` through the proxy and reads the whole answer into `a`. Returns 0 if it cannot be read.
+ */
+static int get(const char *path, Answer *a)
+{
+    memset(a, 0, sizeof(Answer));
+    a->connection = -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PROXY_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    char req[256];
+    snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", path);
+    send_all(fd, req, strlen(req));
+
+    static char buf[65536];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) && (n = recv(fd, buf + len, sizeof(buf) - len, 0)) > 0) len += (size_t)n;
+    close(fd);
+
+    char *body = memmem(buf, len, "\r\n\r\n", 4);
+    if (body == NULL || sscanf(buf, "HTTP/1.1 %d", &a->status) != 1) return 0;
+    *body = '\0';
+    body += 4;
+
+    char *header = strcasestr(buf, "\r\nX-Connection: ");
+    if (header != NULL) a->connection = atoi(header + 16);
+
+    size_t blen = len - (size_t)(body - buf);
+    if (strcasestr(buf, "\r\nTransfer-Encoding: chunked") != NULL) return dechunk(body, blen, a);
+    if (blen > sizeof(a->body)) return 0;
+
+    memcpy(a->body, body, blen);
+    a->blen = blen;
+    return 1;
+}
+
+static int failures;
+
+static void check(const char *name, int ok)
+{
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok) failures++;
+}
+
+static int answered(const Answer *a, int status, const char *body)
+{
+    return a->status == status && a->blen == strlen(body) && memcmp(a->body, body, a->blen) == 0;
+}
+
+int main(void)
+{
+    pthread_t upstream, proxy;
+    pthread_create(&upstream, NULL, run_upstream, (void *)(long)listen_loopback(UPSTREAM_PORT));
+    pthread_create(&proxy, NULL, run_proxy, NULL);
+
+    Answer a, b;
+    for (int i = 0; i < 50 && !get("/length", &a); i++) usleep(100000);
+
+    check("content-length body", answered(&a, 200, "length"));
+
+    get("/length", &b);
+    check("pooled connection reused", answered(&b, 200, "length") && b.connection == a.connection);
+
+    get("/chunked", &a);
+    check("chunked body", answered(&a, 200, "chunked"));
+
+    get("/close", &a);
+    check("close-delimited body", answered(&a, 200, "close-delimited"));
+
+    get("/garbage", &a);
+    check("invalid upstream response is 502", a.status == 502);
+
+    get("/dead/anything", &a);
+    check("unreachable upstream is 502", a.status == 502);
+
+    get("/silent", &a);
+    check("silent upstream is 504", a.status == 504);
+
+    get("/length", &a);
+    check("pool usable after failures", answered(&a, 200, "length"));
+
+    return failures > 0 ? 1 : 0;
+}
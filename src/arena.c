@@ -0,0 +1,96 @@
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cttp-internal.h"
+
+/* Every allocation is aligned for any type */
+#define ARENA_ALIGN alignof(max_align_t)
+
+static INCTTP_ArenaChunk *new_chunk(size_t size)
+{
+    INCTTP_ArenaChunk *chunk = (INCTTP_ArenaChunk *)malloc(sizeof(INCTTP_ArenaChunk) + size);
+    if (chunk == NULL) return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+void INCTTP_init_arena(INCTTP_Arena *a)
+{
+    a->head = NULL;
+    a->large = NULL;
+}
+
+void *INCTTP_arena_alloc(INCTTP_Arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    INCTTP_ArenaChunk *chunk = a->head;
+    if (chunk != NULL && chunk->size - chunk->used >= size)
+    {
+        void *ptr = (char *)chunk->data + chunk->used;
+        chunk->used += size;
+        return ptr;
+    }
+
+    // Oversized allocations get a dedicated chunk so they don't waste the rest of the current one.
+    if (size > INCTTP_ARENA_CHUNK_SIZE / 4)
+    {
+        INCTTP_ArenaChunk *large = new_chunk(size);
+        if (large == NULL) return NULL;
+
+        large->used = size;
+        large->next = a->large;
+        a->large = large;
+        return large->data;
+    }
+
+    chunk = new_chunk(INCTTP_ARENA_CHUNK_SIZE);
+    if (chunk == NULL) return NULL;
+
+    chunk->used = size;
+    chunk->next = a->head;
+    a->head = chunk;
+    return chunk->data;
+}
+
+char *INCTTP_arena_strndup(INCTTP_Arena *a, const char *s, size_t len)
+{
+    char *copy = (char *)INCTTP_arena_alloc(a, len + 1);
+    if (copy == NULL) return NULL;
+
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void INCTTP_arena_reset(INCTTP_Arena *a)
+{
+    // Only the oldest chunk is kept. In the common case it is the only one and this is O(1).
+    while (a->head != NULL && a->head->next != NULL)
+    {
+        INCTTP_ArenaChunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+
+    if (a->head != NULL) a->head->used = 0;
+
+    while (a->large != NULL)
+    {
+        INCTTP_ArenaChunk *next = a->large->next;
+        free(a->large);
+        a->large = next;
+    }
+}
+
+void INCTTP_free_arena(INCTTP_Arena *a)
+{
+    INCTTP_arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+/**
+ * States of the chunked decoder, following the grammar of RFC 9112 (section 7.1).
+ */
+enum CHUNK_STATE
+{
+    CHUNK_SIZE_START = 0, /* First hex digit of a chunk size */
+    CHUNK_SIZE,
+    CHUNK_EXT,            /* Chunk extensions, which are ignored */
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,        /* Start of a trailer field line, or of the empty line ending the body */
+    CHUNK_TRAILER_LINE,   /* Trailer fields, which are ignored */
+    CHUNK_TRAILER_LF,
+    CHUNK_END_LF,
+    CHUNK_DONE,
+};
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void INCTTP_init_chunked(INCTTP_Chunked *d)
+{
+    d->state = CHUNK_SIZE_START;
+    d->left = 0;
+}
+
+int INCTTP_decode_chunked(INCTTP_Chunked *d, const char *buf, size_t *pos, size_t end, size_t *off, size_t *n)
+{
+    size_t max = *n;
+    size_t i = *pos;
+    *n = 0;
+
+    // Line endings must be CRLF: accepting a bare LF here but not in a proxy in front is a request smuggling vector.
+    for (; i < end && d->state != CHUNK_DONE; i++)
+    {
+        char ch = buf[i];
+        switch (d->state)
+        {
+        case CHUNK_SIZE_START:
+        case CHUNK_SIZE:
+        {
+            int digit = hex_digit(ch);
+            if (digit >= 0)
+            {
+                if (d->left > ((size_t)-1) >> 4) return CTTP_ERROR_RAW_REQUEST_BODY;
+                d->left = d->left * 16 + (size_t)digit;
+                d->state = CHUNK_SIZE;
+            }
+            else if (d->state == CHUNK_SIZE_START) return CTTP_ERROR_RAW_REQUEST_BODY;
+            else if (ch == ';' || ch == ' ' || ch == '\t') d->state = CHUNK_EXT;
+            else if (ch == '\r') d->state = CHUNK_SIZE_LF;
+            else return CTTP_ERROR_RAW_REQUEST_BODY;
+            break;
+        }
+        case CHUNK_EXT:
+            if (ch == '\r') d->state = CHUNK_SIZE_LF;
+            else if ((ch < ' ' && ch != '\t') || ch == 0x7f) return CTTP_ERROR_RAW_REQUEST_BODY;
+            break;
+        case CHUNK_SIZE_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_REQUEST_BODY;
+            d->state = d->left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        case CHUNK_DATA:
+        {
+            size_t run = end - i;
+            if (run > d->left) run = d->left;
+            if (run > max) run = max;
+
+            d->left -= run;
+            if (d->left == 0) d->state = CHUNK_DATA_CR;
+
+            *off = i;
+            *n = run;
+            *pos = i + run;
+            return INCTTP_PARSE_INCOMPLETE;
+        }
+        case CHUNK_DATA_CR:
+            if (ch != '\r') return CTTP_ERROR_RAW_REQUEST_BODY;
+            d->state = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_REQUEST_BODY;
+            d->state = CHUNK_SIZE_START;
+            break;
+        case CHUNK_TRAILER:
+            d->state = ch == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (ch == '\r') d->state = CHUNK_TRAILER_LF;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_REQUEST_BODY;
+            d->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_END_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_REQUEST_BODY;
+            d->state = CHUNK_DONE;
+            break;
+        }
+    }
+
+    *pos = i;
+    return d->state == CHUNK_DONE ? INCTTP_PARSE_COMPLETE : INCTTP_PARSE_INCOMPLETE;
+}
+
+void INCTTP_init_body_reader(INCTTP_BodyReader *rd, INCTTP_Parser *p, CTTP_Request *r, int fd, char *buf, size_t len,
+                             size_t cap, int timeout)
+{
+    rd->fd = fd;
+    rd->buf = buf;
+    rd->base = p->body_off;
+    rd->pos = p->body_off;
+    rd->len = len;
+    rd->cap = cap;
+    rd->chunked = p->chunked;
+    INCTTP_init_chunked(&rd->chunk);
+    rd->left = p->content_length;
+    rd->done = !p->chunked && p->content_length == 0;
+    rd->timeout = timeout;
+
+    // Clients sending `Expect: 100-continue` wait for the go-ahead before the body (RFC 9110, section 10.1.1).
+    char *expect = CTTP_read_request_header_id(r, CTTP_HEADER_EXPECT);
+    rd->expect = expect != NULL && strcasecmp(expect, "100-continue") == 0 && r->version == CTTP_VERSION_1_1;
+
+    r->reader = rd;
+}
+
+/**
+ * Reads up to `len` bytes of the body from the socket into `b`, waiting up to `rd->timeout` for them.
+ * Returns the number of bytes read, or -1 if an error occurs or the client stops sending.
+ */
+static long receive(INCTTP_BodyReader *rd, char *b, size_t len)
+{
+    if (rd->expect)
+    {
+        static const char CONTINUE[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        rd->expect = 0;
+        if (send(rd->fd, CONTINUE, sizeof(CONTINUE) - 1, MSG_NOSIGNAL) != sizeof(CONTINUE) - 1) return -1;
+    }
+
+    while (1)
+    {
+        ssize_t n = read(rd->fd, b, len);
+        if (n > 0)
+        {
+            if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->bytes_in, (unsigned long long)n);
+            return (long)n;
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+        // Async handlers are suspended meanwhile rather than blocking the worker.
+        if (CTTP_wait_fd(rd->fd, POLLIN, rd->timeout > 0 ? rd->timeout : -1) <= 0) return -1;
+    }
+}
+
+/**
+ * Reads the next bytes of a chunked body into `b`, refilling the buffer when its bytes are consumed.
+ */
+static long read_chunked(INCTTP_BodyReader *rd, char *b, size_t len)
+{
+    while (1)
+    {
+        size_t off, n = len;
+        int decoded = INCTTP_decode_chunked(&rd->chunk, rd->buf, &rd->pos, rd->len, &off, &n);
+        if (decoded < 1) return -1;
+        if (decoded == INCTTP_PARSE_COMPLETE) rd->done = 1;
+
+        if (n > 0)
+        {
+            memcpy(b, rd->buf + off, n);
+            return (long)n;
+        }
+        if (rd->done) return 0;
+
+        // Everything buffered is decoded, so the space after the head is reused for the next bytes.
+        if (rd->cap == rd->base) return -1;
+        rd->pos = rd->len = rd->base;
+
+        long received = receive(rd, rd->buf + rd->base, rd->cap - rd->base);
+        if (received < 0) return -1;
+        rd->len += (size_t)received;
+    }
+}
+
+long CTTP_read_request_body(CTTP_Request *r, char *b, size_t len)
+{
+    INCTTP_BodyReader *rd = r->reader;
+    if (rd == NULL)
+    {
+        size_t n = len < r->body.len ? len : r->body.len;
+        memcpy(b, r->body.ptr, n);
+        r->body.ptr += n;
+        r->body.len -= n;
+        return (long)n;
+    }
+
+    if (rd->done || len == 0) return 0;
+    if (rd->chunked) return read_chunked(rd, b, len);
+
+    if (len > rd->left) len = rd->left;
+
+    // Buffered bytes are served first; the rest goes straight from the socket to `b`, never past the body.
+    long n;
+    if (rd->pos < rd->len)
+    {
+        n = (long)(len < rd->len - rd->pos ? len : rd->len - rd->pos);
+        memcpy(b, rd->buf + rd->pos, (size_t)n);
+        rd->pos += (size_t)n;
+    }
+    else
+    {
+        n = receive(rd, b, len);
+        if (n < 0) return -1;
+    }
+
+    rd->left -= (size_t)n;
+    if (rd->left == 0) rd->done = 1;
+    return n;
+}
+
+int INCTTP_skip_body(INCTTP_BodyReader *rd)
+{
+    if (rd->done) return 1;
+
+    if (!rd->chunked)
+    {
+        if (rd->len - rd->pos < rd->left) return 0;
+
+        rd->pos += rd->left;
+        rd->left = 0;
+        rd->done = 1;
+        return 1;
+    }
+
+    size_t off, n;
+    int decoded;
+    do
+    {
+        n = (size_t)-1;
+        decoded = INCTTP_decode_chunked(&rd->chunk, rd->buf, &rd->pos, rd->len, &off, &n);
+    }
+    while (decoded == INCTTP_PARSE_INCOMPLETE && rd->pos < rd->len);
+
+    rd->done = decoded == INCTTP_PARSE_COMPLETE;
+    return rd->done;
+}
@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp-status.h"
+#include "cttp.h"
+
+/**
+ * A request running the handler of a cached route for a key no entry answers yet. Concurrent requests for the
+ * same key wait for it to end, then look the key up again, so the handler runs once rather than once per request.
+ */
+typedef struct Fill
+{
+    unsigned long long hash;
+    size_t             klen;
+    int                efd;  /* Eventfd written once the fill ends, created by the first waiter. -1 until then */
+    size_t             refs; /* The filling request holds one, and every waiter another */
+    struct Fill       *next;
+    char               key[];
+}
+Fill;
+
+/**
+ * A part of the cache, picked by the hash of the key. Everything in it is guarded by its lock.
+ */
+typedef struct
+{
+    pthread_mutex_t    lock;
+    INCTTP_CacheEntry *buckets[INCTTP_CACHE_BUCKETS];
+    INCTTP_Lru         lru;
+    size_t             bytes;
+    Fill              *fills; /* Fills in progress */
+}
+Shard;
+
+/**
+ * Response cache of a server, shared by its workers. Sharding keeps them from contending for a single lock.
+ */
+struct INCTTP_Cache
+{
+    size_t limit; /* Bytes each shard may hold */
+    Shard  shards[INCTTP_CACHE_SHARDS];
+};
+
+/**
+ * What a cached route keeps in its node's data.
+ */
+typedef struct
+{
+    CTTP_RouteHandler handler;
+    int               ttl; /* Lifetime (ms) of the responses without `max-age` */
+    CTTP_Server      *cs;
+}
+CachedRoute;
+
+/* Statuses whose responses may be stored without being marked as cacheable (RFC 9110, section 15.1) */
+static const int STORABLE[] = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+
+/**
+ * FNV-1a hash of the `len` bytes of `s`.
+ */
+static unsigned long long hash_key(const char *s, size_t len)
+{
+    unsigned long long h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+static int compare_params(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * Builds the key of request `r` in arena `a`: its path, then its query parameters sorted and joined by `&`, so that
+ * their order does not matter. Empty parameters are dropped. Returns `NULL` if an error occurs.
+ */
+static char *cache_key(CTTP_Request *r, INCTTP_Arena *a, size_t *klen)
+{
+    // Parameters are stored back to back in the query, each one NUL-terminated.
+    const char *end = r->query.ptr + r->query.len;
+    size_t n = 0;
+    size_t len = r->uri.len;
+    for (const char *q = r->query.ptr; q < end; q += strlen(q) + 1)
+    {
+        if (*q == '\0') continue;
+        n++;
+        len += strlen(q) + 1;
+    }
+
+    const char **params = NULL;
+    if (n > 0)
+    {
+        params = (const char **)INCTTP_arena_alloc(a, n * sizeof(const char *));
+        if (params == NULL) return NULL;
+
+        n = 0;
+        for (const char *q = r->query.ptr; q < end; q += strlen(q) + 1)
+        {
+            if (*q != '\0') params[n++] = q;
+        }
+        qsort(params, n, sizeof(const char *), compare_params);
+    }
+
+    char *key = (char *)INCTTP_arena_alloc(a, len + 1);
+    if (key == NULL) return NULL;
+
+    char *p = key;
+    memcpy(p, r->uri.ptr, r->uri.len);
+    p += r->uri.len;
+    for (size_t i = 0; i < n; i++)
+    {
+        *p++ = i == 0 ? '?' : '&';
+        size_t plen = strlen(params[i]);
+        memcpy(p, params[i], plen);
+        p += plen;
+    }
+    *p = '\0';
+
+    *klen = len;
+    return key;
+}
+
+/**
+ * Looks for directive `name` in `Cache-Control` value `v`. Returns 1 if it is there, storing in `seconds` (if not
+ * `NULL`) its numeric argument, or -1 if it has none.
+ */
+static int directive(const char *v, const char *name, long long *seconds)
+{
+    size_t len = strlen(name);
+    while (v != NULL && *v != '\0')
+    {
+        while (*v == ' ' || *v == '\t' || *v == ',') v++;
+        const char *start = v;
+        while (*v != '\0' && *v != ',' && *v != '=' && *v != ' ' && *v != '\t') v++;
+        int match = (size_t)(v - start) == len && strncasecmp(start, name, len) == 0;
+
+        long long n = -1;
+        while (*v == ' ' || *v == '\t') v++;
+        if (*v == '=')
+        {
+            v++;
+            const char *d = *v == '"' ? v + 1 : v;
+            for (; *d >= '0' && *d <= '9' && n < 100000000; d++) n = (n < 0 ? 0 : n * 10) + (*d - '0');
+        }
+
+        // Arguments may be quoted strings holding commas, as in `private="Set-Cookie, X-Token"`.
+        int quoted = 0;
+        for (; *v != '\0' && (quoted || *v != ','); v++)
+        {
+            if (*v == '"') quoted = !quoted;
+        }
+
+        if (match)
+        {
+            if (seconds != NULL) *seconds = n;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns 1 if request `r` must be answered by the handler: it carries credentials or asks for a fresh response.
+ */
+static int bypasses(CTTP_Request *r)
+{
+    if (CTTP_read_request_header_id(r, CTTP_HEADER_AUTHORIZATION) != NULL) return 1;
+
+    const char *cc = CTTP_read_request_header_id(r, CTTP_HEADER_CACHE_CONTROL);
+    return directive(cc, "no-cache", NULL) || directive(cc, "no-store", NULL);
+}
+
+/**
+ * Returns how long (ms) the response of writer `w` may be reused, as its `Cache-Control` says or else `ttl`,
+ * or 0 if it must not be stored.
+ */
+static long long lifetime(CTTP_Writer *w, int ttl)
+{
+    if (w->stream != INCTTP_STREAM_NONE || w->file != NULL || w->compressed != NULL) return 0;
+    if (CTTP_read_writer_header(w, "Set-Cookie") != NULL) return 0;
+
+    int code = w->status != NULL ? atoi(w->status) : 200;
+    size_t i = 0;
+    while (i < sizeof(STORABLE) / sizeof(STORABLE[0]) && STORABLE[i] != code) i++;
+    if (i == sizeof(STORABLE) / sizeof(STORABLE[0])) return 0;
+
+    const char *cc = CTTP_read_writer_header(w, "Cache-Control");
+    if (directive(cc, "no-store", NULL) || directive(cc, "no-cache", NULL) || directive(cc, "private", NULL)) return 0;
+
+    // `s-maxage` is meant for shared caches like this one, and overrides `max-age`.
+    long long seconds;
+    if (directive(cc, "s-maxage", &seconds) && seconds >= 0) return seconds * 1000;
+    if (directive(cc, "max-age", &seconds) && seconds >= 0) return seconds * 1000;
+
+    return ttl > 0 ? ttl : 0;
+}
+
+/**
+ * Copies to the arena of writer `w` the header names its `Vary` headers list. Returns their number, or -1 if an
+ * error occurs or the response varies on everything (`*`) or on more than `INCTTP_CACHE_VARY` headers.
+ */
+static int vary_names(CTTP_Writer *w, char **names)
+{
+    int n = 0;
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        if (w->headers[i].id != CTTP_HEADER_VARY) continue;
+
+        const char *v = w->headers[i].val;
+        while (*v != '\0')
+        {
+            while (*v == ' ' || *v == '\t' || *v == ',') v++;
+            const char *start = v;
+            while (*v != '\0' && *v != ',' && *v != ' ' && *v != '\t') v++;
+            if (v == start) continue;
+
+            if (*start == '*' || n == INCTTP_CACHE_VARY) return -1;
+            names[n] = INCTTP_arena_strndup(w->arena, start, (size_t)(v - start));
+            if (names[n++] == NULL) return -1;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Returns 1 if entry `e` answers request `r`, which has the values `e` was stored with for the headers it varies on.
+ */
+static int matches(const INCTTP_CacheEntry *e, CTTP_Request *r)
+{
+    for (size_t i = 0; i < e->nvary; i++)
+    {
+        const char *v = CTTP_read_request_header(r, (char *)e->vary[2 * i]);
+        const char *stored = e->vary[2 * i + 1];
+        if (v == NULL || stored == NULL ? v != stored : strcmp(v, stored) != 0) return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Serializes the response of writer `w` to request `r` into a new entry, whose request has key `key`.
+ * Every header the handler wrote goes to the prefix but `Connection`, which depends on each request.
+ * Returns `NULL` if an error occurs or the response varies in a way the cache does not keep apart.
+ */
+static INCTTP_CacheEntry *new_entry(CTTP_Writer *w, CTTP_Request *r, const char *key, size_t klen)
+{
+    char *names[INCTTP_CACHE_VARY];
+    int nvary = vary_names(w, names);
+    if (nvary < 0 || INCTTP_write_prefix(w) == 0) return NULL;
+
+    size_t slen = strlen(w->status);
+    size_t plen = w->prefix_len;
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        if (w->headers[i].id != CTTP_HEADER_CONNECTION) plen += w->headers[i].klen + 2 + w->headers[i].vlen + 2;
+    }
+
+    const char *values[INCTTP_CACHE_VARY];
+    size_t total = sizeof(INCTTP_CacheEntry) + klen + 1 + slen + 1 + plen + w->bsize;
+    for (int i = 0; i < nvary; i++)
+    {
+        values[i] = CTTP_read_request_header(r, names[i]);
+        total += strlen(names[i]) + 1 + (values[i] != NULL ? strlen(values[i]) + 1 : 0);
+    }
+
+    INCTTP_CacheEntry *e = (INCTTP_CacheEntry *)malloc(total);
+    if (e == NULL) return NULL;
+
+    char *q = e->data;
+    memcpy(q, key, klen + 1);
+    e->key = q;
+    e->klen = klen;
+    q += klen + 1;
+
+    memcpy(q, w->status, slen + 1);
+    e->status = q;
+    q += slen + 1;
+
+    e->prefix = q;
+    e->prefix_len = plen;
+    memcpy(q, w->prefix, w->prefix_len);
+    q += w->prefix_len;
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        CTTP_Header *h = &w->headers[i];
+        if (h->id == CTTP_HEADER_CONNECTION) continue;
+
+        memcpy(q, h->key, h->klen);
+        q += h->klen;
+        *q++ = ':';
+        *q++ = ' ';
+        memcpy(q, h->val, h->vlen);
+        q += h->vlen;
+        *q++ = '\r';
+        *q++ = '\n';
+    }
+
+    e->body = q;
+    e->bsize = w->bsize;
+    if (w->bsize > 0) memcpy(q, w->body, w->bsize);
+    q += w->bsize;
+
+    e->nvary = (size_t)nvary;
+    for (int i = 0; i < nvary; i++)
+    {
+        size_t len = strlen(names[i]) + 1;
+        memcpy(q, names[i], len);
+        e->vary[2 * i] = q;
+        q += len;
+
+        e->vary[2 * i + 1] = NULL;
+        if (values[i] == NULL) continue;
+
+        len = strlen(values[i]) + 1;
+        memcpy(q, values[i], len);
+        e->vary[2 * i + 1] = q;
+        q += len;
+    }
+
+    e->hash = hash_key(key, klen);
+    e->size = total;
+    e->refs = 1;
+    e->hnext = NULL;
+    return e;
+}
+
+void INCTTP_release_cached(INCTTP_CacheEntry *e)
+{
+    // Workers share entries, so their references are counted atomically.
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) free(e);
+}
+
+static INCTTP_CacheEntry **bucket_of(Shard *s, unsigned long long hash)
+{
+    return &s->buckets[(hash / INCTTP_CACHE_SHARDS) % INCTTP_CACHE_BUCKETS];
+}
+
+/**
+ * Removes `e` from shard `s` and drops the cache's reference to it.
+ */
+static void evict(Shard *s, INCTTP_CacheEntry *e)
+{
+    INCTTP_CacheEntry **slot = bucket_of(s, e->hash);
+    while (*slot != e) slot = &(*slot)->hnext;
+    *slot = e->hnext;
+
+    INCTTP_lru_unlink(&s->lru, &e->lru);
+    s->bytes -= e->size;
+    INCTTP_release_cached(e);
+}
+
+/**
+ * Returns the entry of shard `s` answering request `r` with key `key`, evicting the stale ones met on the way,
+ * or `NULL`.
+ */
+static INCTTP_CacheEntry *lookup(Shard *s, unsigned long long hash, const char *key, size_t klen, CTTP_Request *r, long long now)
+{
+    INCTTP_CacheEntry *e = *bucket_of(s, hash);
+    while (e != NULL)
+    {
+        INCTTP_CacheEntry *next = e->hnext;
+        if (e->hash == hash && e->klen == klen && memcmp(e->key, key, klen) == 0)
+        {
+            if (e->expires <= now) evict(s, e);
+            else if (matches(e, r)) return e;
+        }
+        e = next;
+    }
+
+    return NULL;
+}
+
+/**
+ * Stores entry `e`, answering request `r`, in shard `s` of `cache`, replacing the one answering `r` so far and
+ * evicting the least recently used ones to make room. The caller keeps its reference.
+ */
+static void store(INCTTP_Cache *cache, Shard *s, INCTTP_CacheEntry *e, CTTP_Request *r)
+{
+    pthread_mutex_lock(&s->lock);
+
+    INCTTP_CacheEntry *old = *bucket_of(s, e->hash);
+    while (old != NULL)
+    {
+        INCTTP_CacheEntry *next = old->hnext;
+        if (old->hash == e->hash && old->klen == e->klen && memcmp(old->key, e->key, e->klen) == 0 && matches(old, r)) evict(s, old);
+        old = next;
+    }
+
+    while (s->bytes + e->size > cache->limit && s->lru.tail != NULL)
+    {
+        evict(s, INCTTP_OWNER(s->lru.tail, INCTTP_CacheEntry, lru));
+    }
+
+    INCTTP_CacheEntry **slot = bucket_of(s, e->hash);
+    e->hnext = *slot;
+    *slot = e;
+    INCTTP_lru_push(&s->lru, &e->lru);
+    s->bytes += e->size;
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Returns the fill of key `key` in progress in shard `s`, or `NULL`. Called with the shard locked.
+ */
+static Fill *find_fill(Shard *s, unsigned long long hash, const char *key, size_t klen)
+{
+    Fill *f = s->fills;
+    while (f != NULL && (f->hash != hash || f->klen != klen || memcmp(f->key, key, klen) != 0)) f = f->next;
+    return f;
+}
+
+/**
+ * Registers a fill of key `key` in shard `s`, held by the caller. Called with the shard locked.
+ * Returns `NULL` if an error occurs.
+ */
+static Fill *start_fill(Shard *s, unsigned long long hash, const char *key, size_t klen)
+{
+    Fill *f = (Fill *)malloc(sizeof(Fill) + klen);
+    if (f == NULL) return NULL;
+
+    f->hash = hash;
+    f->klen = klen;
+    memcpy(f->key, key, klen);
+    f->efd = -1;
+    f->refs = 1;
+    f->next = s->fills;
+    s->fills = f;
+    return f;
+}
+
+/**
+ * Drops a reference to fill `f`, freeing it once it is no longer used. Called with its shard locked.
+ */
+static void release_fill(Fill *f)
+{
+    if (--f->refs > 0) return;
+
+    if (f->efd >= 0) close(f->efd);
+    free(f);
+}
+
+/**
+ * Ends fill `f` of shard `s`, waking the requests waiting for it.
+ */
+static void end_fill(Shard *s, Fill *f)
+{
+    pthread_mutex_lock(&s->lock);
+
+    Fill **slot = &s->fills;
+    while (*slot != f) slot = &(*slot)->next;
+    *slot = f->next;
+
+    // Waiters never read the counter, so it stays readable for every one of them. Adding to it cannot fail
+    // short of overflowing it, and waiters that would miss the wake-up time out anyway.
+    if (f->efd >= 0)
+    {
+        unsigned long long one = 1;
+        ssize_t n = write(f->efd, &one, sizeof(one));
+        (void)n;
+    }
+    release_fill(f);
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Points writer `w` at entry `e`, whose reference moves to the writer, adding the `Age` it has at time `now`.
+ */
+static int serve_entry(CTTP_Writer *w, INCTTP_CacheEntry *e, long long now)
+{
+    w->status = e->status;
+    w->prefix = e->prefix;
+    w->prefix_len = e->prefix_len;
+    w->body = (char *)e->body;
+    w->bsize = e->bsize;
+    w->hsize = 0;
+    w->cached = e;
+
+    char age[24];
+    snprintf(age, sizeof(age), "%lld", (now - e->stored) / 1000);
+    if (CTTP_write_header(w, "Age", age) == 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    return CTTP_ERROR_NIL;
+}
+
+/**
+ * Handler of cached routes. Answers GET and HEAD requests from the cache when it can, and otherwise runs the
+ * route's handler, storing what it writes to GET requests when the response allows it.
+ */
+static int serve_cached(CTTP_Writer *w, CTTP_Request *r)
+{
+    const CachedRoute *c = (const CachedRoute *)r->route->data;
+    INCTTP_Cache *cache = c->cs->cache;
+
+    if (cache == NULL || (r->method != CTTP_METHOD_GET && r->method != CTTP_METHOD_HEAD) || bypasses(r)) return c->handler(w, r);
+
+    size_t klen;
+    char *key = cache_key(r, w->arena, &klen);
+    if (key == NULL) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    unsigned long long hash = hash_key(key, klen);
+    Shard *s = &cache->shards[hash % INCTTP_CACHE_SHARDS];
+    INCTTP_WorkerMetrics *m = INCTTP_worker_metrics;
+
+    Fill *fill = NULL;
+    for (int waited = 0;; waited = 1)
+    {
+        long long now = INCTTP_now_ns() / 1000000;
+        pthread_mutex_lock(&s->lock);
+
+        INCTTP_CacheEntry *e = lookup(s, hash, key, klen, r, now);
+        if (e != NULL)
+        {
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            INCTTP_lru_unlink(&s->lru, &e->lru);
+            INCTTP_lru_push(&s->lru, &e->lru);
+            pthread_mutex_unlock(&s->lock);
+
+            if (m != NULL) INCTTP_count(&m->cache_hits, 1);
+            return serve_entry(w, e, now);
+        }
+
+        // Requests wait for a fill at most once: a response that is not stored, or stored for other `Vary`
+        // values, would otherwise line them up behind each other. HEAD requests never fill, as their handler may
+        // leave the body out.
+        Fill *f = find_fill(s, hash, key, klen);
+        if (f == NULL || waited)
+        {
+            if (f == NULL && r->method == CTTP_METHOD_GET) fill = start_fill(s, hash, key, klen);
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+
+        // A loop cannot watch a descriptor twice, so every waiter watches a duplicate of its own.
+        if (f->efd < 0) f->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        int fd = f->efd >= 0 ? fcntl(f->efd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (fd < 0)
+        {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        f->refs++;
+        pthread_mutex_unlock(&s->lock);
+
+        CTTP_wait_fd(fd, POLLIN, INCTTP_CACHE_WAIT_TIMEOUT);
+        close(fd);
+
+        pthread_mutex_lock(&s->lock);
+        release_fill(f);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (m != NULL) INCTTP_count(&m->cache_misses, 1);
+    int result = c->handler(w, r);
+
+    // The response is stored as sent to this request, compressed as its `Accept-Encoding` allows, which the
+    // compression adds to `Vary`. Responses that could never fit are not worth compressing here.
+    INCTTP_CacheEntry *e = NULL;
+    long long ttl = result >= 1 && r->method == CTTP_METHOD_GET ? lifetime(w, c->ttl) : 0;
+    if (ttl > 0 && w->bsize < cache->limit && (!c->cs->compress || INCTTP_compress_response(c->cs, w) != 0))
+    {
+        e = new_entry(w, r, key, klen);
+    }
+    if (e != NULL && e->size > cache->limit)
+    {
+        INCTTP_release_cached(e);
+        e = NULL;
+    }
+    if (e != NULL)
+    {
+        e->stored = INCTTP_now_ns() / 1000000;
+        e->expires = e->stored + ttl;
+        store(cache, s, e, r);
+    }
+
+    if (fill != NULL) end_fill(s, fill);
+    return e != NULL ? serve_entry(w, e, e->stored) : result;
+}
+
+int INCTTP_init_cache(CTTP_Server *cs)
+{
+    INCTTP_Cache *cache = (INCTTP_Cache *)calloc(1, sizeof(INCTTP_Cache));
+    if (cache == NULL) return 0;
+
+    cache->limit = cs->cache_size / INCTTP_CACHE_SHARDS;
+    for (size_t i = 0; i < INCTTP_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    }
+
+    cs->cache = cache;
+    return 1;
+}
+
+void INCTTP_free_cache(CTTP_Server *cs)
+{
+    INCTTP_Cache *cache = cs->cache;
+    if (cache == NULL) return;
+
+    for (size_t i = 0; i < INCTTP_CACHE_SHARDS; i++)
+    {
+        Shard *s = &cache->shards[i];
+        while (s->lru.head != NULL) evict(s, INCTTP_OWNER(s->lru.head, INCTTP_CacheEntry, lru));
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    free(cache);
+    cs->cache = NULL;
+}
+
+void CTTP_add_cached_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h, int ttl)
+{
+    CachedRoute *c = (CachedRoute *)malloc(sizeof(CachedRoute));
+    if (c == NULL) return;
+    c->handler = h;
+    c->ttl = ttl;
+    c->cs = cs;
+
+    // Requests waiting for a concurrent miss suspend as the handlers of async routes do.
+    CTTP_RouteNode *node = INCTTP_insert_async_route(cs, m, p, serve_cached);
+    if (node == NULL)
+    {
+        free(c);
+        return;
+    }
+
+    free(node->data);
+    node->data = c;
+    cs->cached = 1;
+}
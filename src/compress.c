@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef CTTP_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef CTTP_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+const char *const INCTTP_ENCODING_NAMES[INCTTP_ENCODING_COUNT] = {"identity", "br", "gzip", "deflate"};
+
+/* Codings compiled in */
+static const unsigned int AVAILABLE_ENCODINGS = 0
+#ifdef CTTP_BROTLI
+    | 1u << INCTTP_ENCODING_BR
+#endif
+#ifdef CTTP_ZLIB
+    | 1u << INCTTP_ENCODING_GZIP | 1u << INCTTP_ENCODING_DEFLATE
+#endif
+    ;
+
+/* Types compressed when `CTTP_Server.compress_types` is `NULL`. Images, audio and archives are compressed already */
+static const char *const DEFAULT_TYPES[] = {
+    "text/*",
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "application/wasm",
+    "image/svg+xml",
+    NULL,
+};
+
+/**
+ * Returns whether media type `type`, possibly followed by parameters, is listed in `types`.
+ */
+static int type_listed(const char *const *types, const char *type)
+{
+    size_t tlen = strcspn(type, ";");
+    while (tlen > 0 && (type[tlen - 1] == ' ' || type[tlen - 1] == '\t')) tlen--;
+
+    for (size_t i = 0; types[i] != NULL; i++)
+    {
+        size_t n = strlen(types[i]);
+        if (n >= 2 && types[i][n - 2] == '/' && types[i][n - 1] == '*')
+        {
+            if (tlen >= n - 1 && strncasecmp(type, types[i], n - 1) == 0) return 1;
+        }
+        else if (n == tlen && strncasecmp(type, types[i], n) == 0) return 1;
+    }
+
+    return 0;
+}
+
+unsigned int INCTTP_compress_encodings(CTTP_Server *cs, const char *type, size_t size)
+{
+    if (!cs->compress || AVAILABLE_ENCODINGS == 0 || type == NULL || size < cs->compress_min_size) return 0;
+
+    return type_listed(cs->compress_types != NULL ? cs->compress_types : DEFAULT_TYPES, type) ? AVAILABLE_ENCODINGS : 0;
+}
+
+int INCTTP_negotiate_encoding(const char *accept, unsigned int available)
+{
+    if (accept == NULL) return INCTTP_ENCODING_IDENTITY;
+
+    // Weights in thousandths, -1 for codings the client did not list.
+    int weights[INCTTP_ENCODING_COUNT] = {-1, -1, -1, -1};
+    int any = -1;
+
+    const char *p = accept;
+    while (*p != '\0')
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+
+        size_t len = 0;
+        while (p[len] != '\0' && p[len] != ',' && p[len] != ';' && p[len] != ' ' && p[len] != '\t') len++;
+        if (len == 0) break;
+
+        const char *coding = p;
+        p += len;
+
+        // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ), read as thousandths.
+        int q = 1000;
+        while (*p != '\0' && *p != ',')
+        {
+            if (*p == ';')
+            {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=')
+                {
+                    p += 2;
+                    q = (*p == '1') ? 1000 : 0;
+                    if (*p == '0' || *p == '1') p++;
+                    if (*p == '.')
+                    {
+                        p++;
+                        for (int scale = 100; scale > 0 && *p >= '0' && *p <= '9'; scale /= 10, p++) q += (*p - '0') * scale;
+                    }
+                    if (q > 1000) q = 1000;
+                }
+                continue;
+            }
+            p++;
+        }
+
+        if (len == 1 && *coding == '*') any = q;
+        else if (len == 2 && strncasecmp(coding, "br", 2) == 0) weights[INCTTP_ENCODING_BR] = q;
+        else if ((len == 4 && strncasecmp(coding, "gzip", 4) == 0) || (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))
+        {
+            weights[INCTTP_ENCODING_GZIP] = q;
+        }
+        else if (len == 7 && strncasecmp(coding, "deflate", 7) == 0) weights[INCTTP_ENCODING_DEFLATE] = q;
+    }
+
+    // Ties go to the earlier coding, which compresses better.
+    int best = INCTTP_ENCODING_IDENTITY;
+    int best_q = 0;
+    for (int enc = INCTTP_ENCODING_IDENTITY + 1; enc < INCTTP_ENCODING_COUNT; enc++)
+    {
+        if (!(available & (1u << enc))) continue;
+
+        int q = weights[enc] >= 0 ? weights[enc] : any >= 0 ? any : 0;
+        if (q > best_q)
+        {
+            best = enc;
+            best_q = q;
+        }
+    }
+
+    return best;
+}
+
+size_t INCTTP_compress_bound(int enc, size_t len)
+{
+    switch (enc)
+    {
+#ifdef CTTP_BROTLI
+    case INCTTP_ENCODING_BR:
+        return BrotliEncoderMaxCompressedSize(len);
+#endif
+#ifdef CTTP_ZLIB
+    case INCTTP_ENCODING_GZIP:
+    case INCTTP_ENCODING_DEFLATE:
+        // The gzip wrapper is 12 bytes longer than the zlib one `compressBound` accounts for.
+        return compressBound((uLong)len) + 12;
+#endif
+    default:
+        return len;
+    }
+}
+
+#ifdef CTTP_ZLIB
+
+/* Deflate streams of this thread, for gzip and deflate, reset between bodies rather than allocated each time */
+static __thread z_stream streams[2];
+static __thread int stream_levels[2];
+
+static size_t zlib_compress(int enc, int level, const char *in, size_t len, char *out)
+{
+    int gzip = enc == INCTTP_ENCODING_GZIP;
+    z_stream *s = &streams[gzip];
+
+    if (stream_levels[gzip] != level)
+    {
+        if (stream_levels[gzip] != 0) deflateEnd(s);
+        stream_levels[gzip] = 0;
+
+        memset(s, 0, sizeof(z_stream));
+        if (deflateInit2(s, level, Z_DEFLATED, gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+        stream_levels[gzip] = level;
+    }
+    else if (deflateReset(s) != Z_OK) return 0;
+
+    s->next_in = (Bytef *)in;
+    s->avail_in = (uInt)len;
+    s->next_out = (Bytef *)out;
+    s->avail_out = (uInt)INCTTP_compress_bound(enc, len);
+
+    return deflate(s, Z_FINISH) == Z_STREAM_END ? (size_t)s->total_out : 0;
+}
+
+#endif
+
+size_t INCTTP_compress(int enc, int level, const char *in, size_t len, char *out)
+{
+    if (level < 1) level = 1;
+    if (level > 9) level = 9;
+
+    switch (enc)
+    {
+#ifdef CTTP_BROTLI
+    case INCTTP_ENCODING_BR:
+    {
+        size_t size = BrotliEncoderMaxCompressedSize(len);
+        int ok = BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, len, (const uint8_t *)in, &size,
+                                       (uint8_t *)out);
+        return ok ? size : 0;
+    }
+#endif
+#ifdef CTTP_ZLIB
+    case INCTTP_ENCODING_GZIP:
+    case INCTTP_ENCODING_DEFLATE:
+        // zlib reads at most 4GB at once.
+        if (len > 0xffffffffu) return 0;
+        return zlib_compress(enc, level, in, len, out);
+#endif
+    default:
+#if !defined(CTTP_ZLIB) && !defined(CTTP_BROTLI)
+        // Without a codec nothing is ever compressed.
+        (void)in;
+        (void)len;
+        (void)out;
+#endif
+        return 0;
+    }
+}
+
+/**
+ * Compressed static files of a worker, indexed by file version and coding and kept in least recently used order.
+ */
+typedef struct
+{
+    INCTTP_Compressed *buckets[INCTTP_COMPRESS_CACHE_BUCKETS];
+    INCTTP_Lru         lru;
+    size_t             bytes;
+}
+CompressCache;
+
+static __thread CompressCache cache;
+
+static size_t bucket_of(ino_t ino, time_t mtime, size_t fsize, int enc)
+{
+    return ((size_t)ino * 31 + (size_t)mtime * 7 + fsize + (size_t)enc) % INCTTP_COMPRESS_CACHE_BUCKETS;
+}
+
+void INCTTP_release_compressed(INCTTP_Compressed *c)
+{
+    if (--c->refs == 0) free(c);
+}
+
+/**
+ * Removes `c` from the cache and drops the cache's reference to it.
+ */
+static void evict(INCTTP_Compressed *c)
+{
+    INCTTP_Compressed **slot = &cache.buckets[bucket_of(c->ino, c->mtime, c->fsize, c->encoding)];
+    while (*slot != c) slot = &(*slot)->hnext;
+    *slot = c->hnext;
+
+    INCTTP_lru_unlink(&cache.lru, &c->lru);
+    cache.bytes -= sizeof(INCTTP_Compressed) + c->size;
+    INCTTP_release_compressed(c);
+}
+
+/**
+ * Returns a reference to file `f` compressed with coding `enc`, compressing and caching it if needed.
+ * Returns `NULL` if an error occurs.
+ */
+static INCTTP_Compressed *compressed_file(INCTTP_File *f, int enc)
+{
+    size_t bucket = bucket_of(f->ino, f->mtime, f->size, enc);
+
+    INCTTP_Compressed *c = cache.buckets[bucket];
+    while (c != NULL && (c->ino != f->ino || c->mtime != f->mtime || c->fsize != f->size || c->encoding != enc)) c = c->hnext;
+
+    if (c != NULL)
+    {
+        INCTTP_lru_unlink(&cache.lru, &c->lru);
+        INCTTP_lru_push(&cache.lru, &c->lru);
+        c->refs++;
+        return c;
+    }
+
+    char *in = (char *)malloc(f->size);
+    c = (INCTTP_Compressed *)malloc(sizeof(INCTTP_Compressed) + INCTTP_compress_bound(enc, f->size));
+    if (in == NULL || c == NULL || pread(f->fd, in, f->size, 0) != (ssize_t)f->size)
+    {
+        free(in);
+        free(c);
+        return NULL;
+    }
+
+    // A file that does not shrink is remembered as such, so it is not compressed again.
+    size_t size = INCTTP_compress(enc, INCTTP_COMPRESS_CACHED_LEVEL, in, f->size, c->data);
+    free(in);
+    if (size >= f->size) size = 0;
+
+    INCTTP_Compressed *fit = (INCTTP_Compressed *)realloc(c, sizeof(INCTTP_Compressed) + size);
+    if (fit != NULL) c = fit;
+
+    c->ino = f->ino;
+    c->mtime = f->mtime;
+    c->fsize = f->size;
+    c->encoding = enc;
+    c->size = size;
+
+    cache.bytes += sizeof(INCTTP_Compressed) + size;
+    while (cache.bytes > INCTTP_COMPRESS_CACHE_BYTES && cache.lru.tail != NULL)
+    {
+        evict(INCTTP_OWNER(cache.lru.tail, INCTTP_Compressed, lru));
+    }
+
+    c->hnext = cache.buckets[bucket];
+    cache.buckets[bucket] = c;
+    INCTTP_lru_push(&cache.lru, &c->lru);
+
+    // One reference for the cache and one for the caller.
+    c->refs = 2;
+    return c;
+}
+
+int INCTTP_compress_response(CTTP_Server *cs, CTTP_Writer *w)
+{
+    // Only bodies framed by a `Content-Length` header of the writer can be swapped for their compressed form.
+    CTTP_Header *length = NULL;
+    const char *type = NULL;
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        switch (w->headers[i].id)
+        {
+        case CTTP_HEADER_CONTENT_LENGTH:
+            length = &w->headers[i];
+            break;
+        case CTTP_HEADER_CONTENT_TYPE:
+            type = w->headers[i].val;
+            break;
+        case CTTP_HEADER_CONTENT_ENCODING:
+            return 1;
+        }
+    }
+
+    size_t size = w->file != NULL ? w->file->size : w->bsize;
+    if (length == NULL || (w->file == NULL && w->body == NULL)) return 1;
+
+    unsigned int available = INCTTP_compress_encodings(cs, type, size);
+    if (available == 0) return 1;
+    if (w->file != NULL && size > INCTTP_COMPRESS_FILE_LIMIT) return 1;
+
+    // The response depends on `Accept-Encoding` from now on, whether it ends up compressed or not.
+    if (CTTP_write_header(w, "Vary", "Accept-Encoding") == 0) return 0;
+
+    int enc = INCTTP_negotiate_encoding(CTTP_read_request_header_id(w->request, CTTP_HEADER_ACCEPT_ENCODING), available);
+    if (enc == INCTTP_ENCODING_IDENTITY) return 1;
+
+    char *body;
+    size_t bsize;
+    if (w->file != NULL)
+    {
+        INCTTP_Compressed *c = compressed_file(w->file, enc);
+        if (c == NULL) return 1;
+        if (c->size == 0)
+        {
+            INCTTP_release_compressed(c);
+            return 1;
+        }
+
+        INCTTP_release_file(w->file);
+        w->file = NULL;
+        w->compressed = c;
+        body = c->data;
+        bsize = c->size;
+    }
+    else
+    {
+        body = (char *)INCTTP_arena_alloc(w->arena, INCTTP_compress_bound(enc, w->bsize));
+        if (body == NULL) return 0;
+
+        bsize = INCTTP_compress(enc, cs->compress_level, w->body, w->bsize, body);
+        if (bsize == 0 || bsize >= w->bsize) return 1;
+    }
+
+    char value[32];
+    int vlen = snprintf(value, sizeof(value), "%zu", bsize);
+    char *copy = INCTTP_arena_strndup(w->arena, value, (size_t)vlen);
+    if (copy == NULL) return 0;
+
+    length->val = copy;
+    length->vlen = (size_t)vlen;
+    w->body = body;
+    w->bsize = bsize;
+
+    return CTTP_write_header(w, "Content-Encoding", (char *)INCTTP_ENCODING_NAMES[enc]);
+}
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+__thread INCTTP_Coroutine *INCTTP_current_coroutine = NULL;
+
+/* Finished coroutines kept by this thread with their stack, to be reused by the next ones */
+static __thread struct
+{
+    INCTTP_Coroutine *head;
+    size_t            count;
+}
+pool;
+
+#if defined(__x86_64__)
+
+/**
+ * Saves the callee-saved registers and the floating-point control words on the current stack, stores the stack
+ * pointer to `*from` and restores the state saved on stack `to`. Only what the ABI requires a call to preserve is
+ * switched, which makes it much cheaper than `swapcontext` and its signal mask system call.
+ */
+void incttp_switch_context(void **from, void *to);
+
+/**
+ * First code run on a new coroutine's stack, `ret`urned to by `incttp_switch_context`, with the coroutine in `%r12`.
+ */
+void incttp_start_coroutine(void);
+
+__asm__(
+    ".text\n"
+    ".globl incttp_switch_context\n"
+    ".hidden incttp_switch_context\n"
+    ".type incttp_switch_context, @function\n"
+    "incttp_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size incttp_switch_context, .-incttp_switch_context\n"
+    ".globl incttp_start_coroutine\n"
+    ".hidden incttp_start_coroutine\n"
+    ".type incttp_start_coroutine, @function\n"
+    "incttp_start_coroutine:\n"
+    "    movq %r12, %rdi\n"
+    "    call incttp_run_coroutine\n"
+    "    ud2\n"
+    ".size incttp_start_coroutine, .-incttp_start_coroutine\n");
+
+#endif
+
+/**
+ * Runs the function of coroutine `co` on its own stack, then hands control back for good.
+ */
+__attribute__((used, visibility("hidden"))) void incttp_run_coroutine(INCTTP_Coroutine *co)
+{
+    co->result = co->fn(co->cs, co->conn);
+    co->done = 1;
+
+#if defined(__x86_64__)
+    incttp_switch_context(&co->sp, co->caller);
+#else
+    swapcontext(&co->context, &co->caller);
+#endif
+}
+
+#if !defined(__x86_64__)
+
+/**
+ * Entry point of `makecontext`, which only passes `int` arguments: the coroutine pointer comes in two halves.
+ */
+static void start_coroutine(unsigned int hi, unsigned int lo)
+{
+    incttp_run_coroutine((INCTTP_Coroutine *)(uintptr_t)(((unsigned long long)hi << 32) | lo));
+}
+
+#endif
+
+/**
+ * Points the saved state of coroutine `co` at the start of its function, on an empty stack.
+ */
+static void prepare_coroutine(INCTTP_Coroutine *co)
+{
+    char *top = (char *)co->stack + co->size;
+
+#if defined(__x86_64__)
+    // Laid out as `incttp_switch_context` leaves a stack: control words, six registers, then the return address.
+    // `%r12` holds the coroutine, and the stack is 16-byte aligned once the return address is popped.
+    uint64_t *sp = (uint64_t *)(((uintptr_t)top & ~(uintptr_t)15) - 80);
+    memset(sp, 0, 80);
+    sp[0] = 0x1F80 | ((uint64_t)0x037F << 32); // Default MXCSR and x87 control word
+    sp[4] = (uint64_t)(uintptr_t)co;
+    sp[7] = (uint64_t)(uintptr_t)incttp_start_coroutine;
+    co->sp = sp;
+#else
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = (char *)co->stack + co->guard;
+    co->context.uc_stack.ss_size = co->size - co->guard;
+    co->context.uc_link = NULL;
+    unsigned long long p = (unsigned long long)(uintptr_t)co;
+    makecontext(&co->context, (void (*)(void))start_coroutine, 2, (unsigned int)(p >> 32), (unsigned int)p);
+#endif
+
+    co->done = 0;
+}
+
+INCTTP_Coroutine *INCTTP_new_coroutine(size_t stack_size, int (*fn)(CTTP_Server *, INCTTP_Connection *),
+                                       CTTP_Server *cs, INCTTP_Connection *c)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (stack_size + page - 1) / page * page + page;
+
+    INCTTP_Coroutine *co = pool.head;
+    if (co != NULL && co->size == size)
+    {
+        pool.head = co->next;
+        pool.count--;
+    }
+    else
+    {
+        co = (INCTTP_Coroutine *)calloc(1, sizeof(INCTTP_Coroutine));
+        if (co == NULL) return NULL;
+
+        // Stacks are only backed by memory as far as they are used. The lowest page is left inaccessible, so that
+        // a handler overflowing its stack faults instead of overwriting whatever lies below.
+        co->stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (co->stack == MAP_FAILED || mprotect(co->stack, page, PROT_NONE) < 0)
+        {
+            if (co->stack != MAP_FAILED) munmap(co->stack, size);
+            free(co);
+            return NULL;
+        }
+        co->size = size;
+        co->guard = page;
+    }
+
+    co->fn = fn;
+    co->cs = cs;
+    co->conn = c;
+    co->fd = -1;
+    co->deadline = -1;
+    co->timer.prev = NULL;
+    co->next = NULL;
+    prepare_coroutine(co);
+    return co;
+}
+
+int INCTTP_resume_coroutine(INCTTP_Coroutine *co, int revents)
+{
+    INCTTP_Coroutine *current = INCTTP_current_coroutine;
+    co->revents = revents;
+    INCTTP_current_coroutine = co;
+
+#if defined(__x86_64__)
+    incttp_switch_context(&co->caller, co->sp);
+#else
+    swapcontext(&co->caller, &co->context);
+#endif
+
+    INCTTP_current_coroutine = current;
+    return co->done;
+}
+
+void INCTTP_free_coroutine(INCTTP_Coroutine *co)
+{
+    if (pool.count < INCTTP_COROUTINE_POOL)
+    {
+        co->next = pool.head;
+        pool.head = co;
+        pool.count++;
+        return;
+    }
+
+    munmap(co->stack, co->size);
+    free(co);
+}
+
+/**
+ * Hands control back to the loop that resumed the calling coroutine `co`, until it is resumed again.
+ */
+static void yield(INCTTP_Coroutine *co)
+{
+#if defined(__x86_64__)
+    incttp_switch_context(&co->sp, co->caller);
+#else
+    swapcontext(&co->context, &co->caller);
+#endif
+}
+
+int CTTP_wait_fd(int fd, int events, int timeout)
+{
+    INCTTP_Coroutine *co = INCTTP_current_coroutine;
+    if (co == NULL)
+    {
+        // Outside an async handler, the thread itself waits.
+        struct pollfd pfd = {.fd = fd, .events = (short)events};
+        int n;
+        while ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+
+        return n <= 0 ? n : pfd.revents;
+    }
+
+    co->fd = fd;
+    co->events = events;
+    co->deadline = timeout >= 0 ? INCTTP_now_ns() / 1000000 + timeout : -1;
+    co->expired = 0;
+    yield(co);
+
+    co->fd = -1;
+    co->deadline = -1;
+    return co->revents;
+}
+
+void CTTP_sleep(int ms)
+{
+    CTTP_wait_fd(-1, 0, ms < 0 ? 0 : ms);
+}
@@ -3,13 +3,687 @@
 
 #include "cttp.h"
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
 
 #define DATE_LEN 30
 
+/* Number of events fetched from epoll per `epoll_wait` call */
+#define INCTTP_EVENT_BATCH 256
+
+/* Submission queue entries of each worker's io_uring. The completion queue holds four times as many */
+#define INCTTP_URING_ENTRIES 1024
+
+/* Receive buffers provided to each worker's io_uring, and their size. The count must be a power of two */
+#define INCTTP_URING_BUFFERS     512
+#define INCTTP_URING_BUFFER_SIZE 4096
+
+/* Initial size of a connection's receive buffer. It grows up to `CTTP_Server.rsize` on demand */
+#define INCTTP_RBUF_INITIAL_SIZE 4096
+
+/* Size of the regular chunks of an arena. Allocations above a quarter of it get a chunk of their own */
+#define INCTTP_ARENA_CHUNK_SIZE 8192
+
+/**
+ * (Internal) A block of memory owned by an arena.
+ */
+typedef struct INCTTP_ArenaChunk INCTTP_ArenaChunk;
+struct INCTTP_ArenaChunk
+{
+    INCTTP_ArenaChunk *next;
+    size_t             size;   /* Usable bytes in `data` */
+    size_t             used;   /* Bytes of `data` already handed out */
+    max_align_t        data[]; /* Typed as `max_align_t` so that the first allocation is suitably aligned */
+};
+
+/**
+ * (Internal) Bump-pointer allocator holding everything a request and its response need.
+ * Memory is never freed piecemeal: the whole arena is reset once the response has been sent.
+ */
+struct INCTTP_Arena
+{
+    INCTTP_ArenaChunk *head;  /* Chunk being bumped, followed by the chunks it replaced */
+    INCTTP_ArenaChunk *large; /* Dedicated chunks for oversized allocations */
+};
+
+/* (Internal) Structure of type `type` that embeds `p` as its member `member` */
+#define INCTTP_OWNER(p, type, member) ((type *)((char *)(p) - offsetof(type, member)))
+
+/**
+ * (Internal) Link of an entry in a least recently used list, embedded in the entry.
+ */
+typedef struct INCTTP_LruLink INCTTP_LruLink;
+struct INCTTP_LruLink
+{
+    INCTTP_LruLink *prev;
+    INCTTP_LruLink *next;
+};
+
+/**
+ * (Internal) Entries of a cache in least recently used order.
+ */
+typedef struct
+{
+    INCTTP_LruLink *head; /* Most recently used */
+    INCTTP_LruLink *tail; /* Least recently used, evicted first */
+}
+INCTTP_Lru;
+
+/* Open files kept by each worker's static file cache, and the number of buckets of its hash table */
+#define INCTTP_FILE_CACHE_SIZE    256
+#define INCTTP_FILE_CACHE_BUCKETS 512
+
+/* Time (ms) during which cached file metadata is trusted before the file is checked again with `stat` */
+#define INCTTP_FILE_CACHE_TTL 1000
+
+/**
+ * (Internal) An open file of the static file cache. Entries are reference counted: the cache holds one
+ * reference and every response sending the file another, so a file evicted while it is being sent stays open
+ * until the last response releases it.
+ */
+struct INCTTP_File
+{
+    int          fd;
+    size_t       size;
+    time_t       mtime;
+    ino_t        ino;
+    const char  *type;               /* `Content-Type` matching the file extension */
+    char         modified[DATE_LEN]; /* `Last-Modified` value */
+    long long    checked;            /* Monotonic time (ms) of the last `stat` */
+    size_t       refs;
+
+    unsigned int hash;
+    char        *path;               /* Path on disk, stored right after the entry */
+    INCTTP_File *hnext;              /* Next entry of the same hash bucket */
+    INCTTP_LruLink lru;              /* Position in the LRU list of the cache */
+};
+
+/**
+ * (Internal) Content codings responses can be compressed with, in order of preference.
+ */
+enum INCTTP_ENCODING
+{
+    INCTTP_ENCODING_IDENTITY = 0,
+    INCTTP_ENCODING_BR,
+    INCTTP_ENCODING_GZIP,
+    INCTTP_ENCODING_DEFLATE,
+    INCTTP_ENCODING_COUNT,
+};
+
+/* Bytes of compressed static files kept by each worker */
+#define INCTTP_COMPRESS_CACHE_BYTES   (16 * 1024 * 1024)
+#define INCTTP_COMPRESS_CACHE_BUCKETS 256
+
+/* Largest static file compressed. Bigger ones are sent as they are, with `sendfile` */
+#define INCTTP_COMPRESS_FILE_LIMIT (8 * 1024 * 1024)
+
+/* Level of the bodies compressed once and reused: static files and constant routes */
+#define INCTTP_COMPRESS_CACHED_LEVEL 9
+
+/**
+ * (Internal) A compressed static file, cached by the worker that compressed it. Entries are reference counted
+ * like `INCTTP_File`, so one evicted while it is being sent stays alive until its last response releases it.
+ */
+struct INCTTP_Compressed
+{
+    size_t             refs;
+    ino_t              ino;      /* Identity of the file version compressed */
+    time_t             mtime;
+    size_t             fsize;
+    int                encoding; /* `INCTTP_ENCODING` of `data` */
+    size_t             size;     /* Bytes of `data`. 0 if the file does not shrink and is sent as is */
+
+    INCTTP_Compressed *hnext;    /* Next entry of the same hash bucket */
+    INCTTP_LruLink     lru;      /* Position in the LRU list of the cache */
+    char               data[];
+};
+
+/* Number of iovecs of a serialized response: status line, header block and body */
+#define INCTTP_RESPONSE_IOVECS 3
+
+/**
+ * (Internal) A serialized response, sent with a single vectored write. The status line and the header block are
+ * allocated from the request's arena, and the body is referenced where the writer stored it, so nothing is copied.
+ */
+typedef struct
+{
+    struct iovec iov[INCTTP_RESPONSE_IOVECS];
+    size_t       first; /* Index of the first iovec not fully sent. Sent bytes are dropped from it */
+    size_t       count; /* Number of iovecs in use */
+    INCTTP_File *file;  /* File sent with `sendfile` after the iovecs, or `NULL`. The response holds a reference */
+    INCTTP_Compressed *compressed; /* Cached entry the body points into, or `NULL`. The response holds a reference */
+    INCTTP_CacheEntry *cached; /* Response cache entry sent, or `NULL`. The response holds a reference */
+    off_t        foff;  /* Offset of the next file byte to send */
+    size_t       fleft; /* File bytes left to send */
+    size_t       route;  /* `CTTP_RouteNode.id` of the route answering, for metrics */
+    int          status; /* Status code of the response, for metrics and the access log */
+    size_t       bytes;  /* Body bytes of the response, for the access log */
+}
+INCTTP_Response;
+
+/* Records each worker's access log ring holds. A power of two */
+#define INCTTP_LOG_RING_SIZE 4096
+
+/* Time (ms) the access log thread sleeps once every ring is drained */
+#define INCTTP_LOG_INTERVAL 10
+
+/* Size of the access log thread's output buffer, written with a single `write` when full */
+#define INCTTP_LOG_BUFFER_SIZE 65536
+
+/* Bytes kept of the request target, and of the `Referer` and `User-Agent` values. Longer ones are truncated */
+#define INCTTP_LOG_TARGET_SIZE 256
+#define INCTTP_LOG_FIELD_SIZE  128
+
+/**
+ * (Internal) A request as the access log records it. Records have a fixed size, so that workers copy them into their
+ * ring without allocating, and are only formatted by the log thread.
+ */
+typedef struct
+{
+    long long      time;                            /* Wall-clock time (ms) at which the response was sent */
+    long long      duration;                        /* Time (us) from the first byte of the request to the response sent */
+    unsigned int   addr;                            /* IPv4 address of the client, in network byte order */
+    int            status;                          /* Status code of the response */
+    size_t         bytes;                           /* Body bytes of the response */
+    int            version;                         /* `CTTP_VERSION` of the request, or -1 if it could not be parsed */
+    unsigned short target_len;
+    unsigned short referer_len;
+    unsigned short agent_len;
+    char           method[16];                      /* NUL-terminated method, truncated */
+    char           target[INCTTP_LOG_TARGET_SIZE];  /* Request target, query string included */
+    char           referer[INCTTP_LOG_FIELD_SIZE];
+    char           agent[INCTTP_LOG_FIELD_SIZE];
+}
+INCTTP_LogRecord;
+
+/**
+ * (Internal) Single-producer, single-consumer ring of access log records: only its worker writes records and `head`,
+ * only the log thread reads them and writes `tail`. Both indices grow forever and are taken modulo the ring size.
+ */
+typedef struct
+{
+    size_t             head;    /* Index of the next record written */
+    unsigned long long dropped; /* Records dropped because the ring was full */
+    size_t             tail __attribute__((aligned(64))); /* Index of the next record formatted, on its own cache line */
+    INCTTP_LogRecord   records[INCTTP_LOG_RING_SIZE];
+}
+INCTTP_LogRing;
+
+/**
+ * (Internal) Access log of a running server: a ring per worker and the thread formatting their records.
+ */
+struct INCTTP_Logger
+{
+    int              fd;
+    int              format; /* `CTTP_LOG_FORMAT` */
+    int              level;  /* `CTTP_Server.log_level` */
+    INCTTP_LogRing **rings;
+    size_t           nrings;
+    pthread_t        thread;
+    int              stop;   /* Set to stop the thread once the rings are drained */
+};
+
+/* (Internal) Access log ring of the worker running on the calling thread, or `NULL` if there is no access log */
+extern __thread INCTTP_LogRing *INCTTP_worker_log;
+
+/**
+ * (Internal) States of a response body. Once its headers are flushed, a response is streamed straight to the socket.
+ */
+enum INCTTP_STREAM
+{
+    INCTTP_STREAM_NONE = 0, /* Nothing sent yet, the response is sent once the handler returns */
+    INCTTP_STREAM_CHUNKED,  /* Headers sent, the body follows as chunks */
+    INCTTP_STREAM_IDENTITY, /* Headers sent, the body follows as is, up to `Content-Length` or the connection closing */
+    INCTTP_STREAM_DISCARD,  /* Headers sent, the response has no body (HEAD, 1xx, 204 and 304 responses) */
+    INCTTP_STREAM_FAILED,   /* Sending failed, the connection must be closed */
+};
+
+/**
+ * (Internal) Results of the request parser that are not errors. Errors are reported with `CTTP_ERROR` values.
+ */
+enum INCTTP_PARSE_RESULT
+{
+    INCTTP_PARSE_COMPLETE   = 1, /* A whole request, including its body, has been parsed */
+    INCTTP_PARSE_INCOMPLETE = 2, /* The input ends before the request does; parse again once more bytes arrive */
+};
+
+/**
+ * (Internal) Location of a header within the buffer being parsed, as offsets from the buffer's start.
+ * Offsets (rather than pointers) keep the parser valid when the buffer is reallocated between calls.
+ */
+typedef struct
+{
+    unsigned int koff;
+    unsigned int klen;
+    unsigned int voff;
+    unsigned int vlen;
+    unsigned int id; /* `CTTP_HEADER_ID` of the key */
+}
+INCTTP_HeaderSpan;
+
+/**
+ * (Internal) Resumable decoder of the chunked transfer coding (RFC 9112, section 7.1).
+ */
+typedef struct
+{
+    int    state;
+    size_t left; /* Data bytes left in the current chunk */
+}
+INCTTP_Chunked;
+
+/**
+ * (Internal) Resumable HTTP/1.x request parser.
+ * Bytes are consumed exactly once: each call resumes at `pos` and stops at the end of the input,
+ * so a request may arrive split across any number of reads.
+ */
+typedef struct
+{
+    int               state;
+    size_t            pos;  /* Offset of the next byte to parse */
+    size_t            mark; /* Offset where the token being parsed starts */
+    size_t            vend; /* Offset just past the last non-whitespace byte of the header value being parsed */
+
+    size_t            start; /* Offset of the request line, after any leading empty lines */
+    size_t            method_len;
+    size_t            uri_off;
+    size_t            uri_len;
+    size_t            path_len; /* Length of the URI before `?` */
+    size_t            version_off;
+    size_t            version_len;
+
+    INCTTP_HeaderSpan headers[CTTP_HEADER_LIMIT];
+    size_t            hcount;
+
+    size_t            body_off;    /* Offset where the body starts, 0 until the head is parsed */
+    size_t            content_length;
+    int               has_content_length;
+    int               chunked;     /* Whether the body uses the chunked transfer coding */
+    INCTTP_Chunked    chunk;       /* Decoder of a chunked body, validating it as it arrives */
+    size_t            body_len;    /* Decoded size of a chunked body so far */
+    int               stream_body; /* Whether the route reads the body itself, so parsing stops after the head */
+}
+INCTTP_Parser;
+
+/**
+ * (Internal) Reader of a body streamed to the handler. It works in the receive buffer of the connection, past the
+ * request head that the request's views point into; once the buffered bytes are consumed it refills from the socket.
+ */
+struct INCTTP_BodyReader
+{
+    int            fd;
+    char          *buf;
+    size_t         base;    /* Offset where the body starts. Refills overwrite the buffer from there */
+    size_t         pos;     /* Offset of the next unread byte */
+    size_t         len;     /* Bytes held by `buf` */
+    size_t         cap;     /* Capacity of `buf` */
+    int            chunked;
+    INCTTP_Chunked chunk;
+    size_t         left;    /* Bytes left of a `Content-Length` body */
+    int            done;    /* Whether the whole body has been read */
+    int            expect;  /* Whether `100 Continue` is owed to the client before reading from the socket */
+    int            timeout; /* Time (ms) a read waits for the client to send, or 0 for no limit */
+};
+
+/**
+ * (Internal) State of a client connection driven by the event loop.
+ */
+enum INCTTP_CONNECTION_STATE
+{
+    INCTTP_CONNECTION_READING,   /* Waiting for a complete request */
+    INCTTP_CONNECTION_WRITING,   /* Flushing the response to the socket */
+    INCTTP_CONNECTION_SUSPENDED, /* Running an async handler, which waits for a descriptor or a timer */
+};
+
+typedef struct INCTTP_Coroutine INCTTP_Coroutine;
+
+/* Levels of a timer wheel, and the bits of the time, in ms, that index the slots of each level. Level `l` holds the
+ * timers due within 64^(l + 1) ms, so the wheel spans about 4.6 hours; later deadlines are placed again once near */
+#define INCTTP_WHEEL_LEVELS 4
+#define INCTTP_WHEEL_BITS   6
+#define INCTTP_WHEEL_SLOTS  (1 << INCTTP_WHEEL_BITS)
+
+/**
+ * (Internal) A timeout, embedded in whatever it times out and linked into a slot of a timer wheel while it is armed.
+ */
+typedef struct INCTTP_Timer INCTTP_Timer;
+struct INCTTP_Timer
+{
+    long long     deadline; /* Monotonic time (ms) at which the timer expires */
+    int           slot;     /* Slot of the wheel holding the timer, or -1 once it has expired */
+    INCTTP_Timer *prev;     /* Neighbours in the slot's circular list. `prev` is `NULL` while the timer is unarmed */
+    INCTTP_Timer *next;
+};
+
+/**
+ * (Internal) A hierarchical timer wheel. Arming and cancelling a timer link and unlink it from the slot of its
+ * deadline; as time advances, the slots of the upper levels are spread over the lower ones and the timers of the
+ * lowest level are moved to `expired`, so that expiring costs the same however many timers are armed.
+ */
+typedef struct
+{
+    long long          now;     /* Time (ms) up to which the wheel has advanced */
+    unsigned long long occupied[INCTTP_WHEEL_LEVELS]; /* Bit `i` of level `l` is set while its slot `i` holds timers */
+    INCTTP_Timer       slots[INCTTP_WHEEL_LEVELS * INCTTP_WHEEL_SLOTS]; /* Heads of the slots' lists */
+    INCTTP_Timer       expired; /* Head of the list of timers past their deadline */
+}
+INCTTP_TimerWheel;
+
+/**
+ * (Internal) Timeouts of a connection, one at a time, according to what the connection is waiting for.
+ */
+enum INCTTP_TIMEOUT
+{
+    INCTTP_TIMEOUT_NONE,   /* Running an async handler, which times its own waits */
+    INCTTP_TIMEOUT_IDLE,   /* Waiting for the next request, `CTTP_Server.keepalive_timeout` */
+    INCTTP_TIMEOUT_HEADER, /* Receiving the head of a request, `CTTP_Server.header_timeout` */
+    INCTTP_TIMEOUT_BODY,   /* Receiving the body of a request, `CTTP_Server.body_timeout` */
+    INCTTP_TIMEOUT_WRITE,  /* Sending a response, `CTTP_Server.write_timeout` */
+};
+
+/**
+ * (Internal) A non-blocking client connection owned by the event loop, driven by either I/O backend.
+ */
+typedef struct INCTTP_Connection INCTTP_Connection;
+struct INCTTP_Connection
+{
+    int    fd;
+    int    state;
+    char  *rbuf;       /* Receive buffer */
+    size_t rlen;       /* Bytes received */
+    size_t rcap;       /* Capacity of `rbuf` */
+    size_t consumed;   /* Bytes of `rbuf` taken by the request being answered */
+    int    keep_alive; /* Whether the connection persists after the current response */
+    int    eof;        /* Whether the peer has stopped sending */
+    size_t requests;   /* Requests answered on this connection */
+
+    INCTTP_Parser   parser;   /* Parser for the request at the start of `rbuf` */
+    INCTTP_Arena    arena;    /* Memory of the request being answered and its response */
+    INCTTP_Response response; /* Response being sent, pointing into `arena` */
+
+    struct sockaddr_in peer;     /* Address of the client */
+    INCTTP_LogRecord   log;      /* Access log record of the request being answered */
+    long long          started;  /* Monotonic time (ns) at which parsing of the current request started, or 0 */
+    long long          parse_ns; /* Time spent parsing the current request */
+    long long          sending;  /* Monotonic time (ns) at which the current response became ready to send */
+
+    INCTTP_Coroutine  *co;       /* Coroutine running the handler of the current request, or `NULL` */
+    int                ops;      /* Operations the io_uring loop has in flight on the connection */
+    int                closing;  /* Whether the io_uring loop frees the connection once `ops` drops to 0 */
+
+    int                timeout;  /* What `timer` times, one of `INCTTP_TIMEOUT` */
+    INCTTP_Timer       timer;    /* Timeout of the connection in the loop's wheel */
+};
+
+/* Stacks kept by each worker for reuse once their coroutine's handler returns */
+#define INCTTP_COROUTINE_POOL 256
+
+/**
+ * (Internal) A coroutine running the handler of an async route on its own stack, so that the handler can wait
+ * for a descriptor or a timer while the loop serves other connections.
+ */
+struct INCTTP_Coroutine
+{
+#if defined(__x86_64__)
+    void       *sp;      /* Stack pointer of the coroutine while it is suspended */
+    void       *caller;  /* Stack pointer of the loop while the coroutine runs */
+#else
+    ucontext_t  context;
+    ucontext_t  caller;
+#endif
+    void       *stack;   /* Mapping of the stack, guard page included */
+    size_t      size;    /* Size of `stack` */
+    size_t      guard;   /* Size of the inaccessible page at the bottom of `stack` */
+
+    int               (*fn)(CTTP_Server *cs, INCTTP_Connection *c);
+    CTTP_Server        *cs;
+    INCTTP_Connection  *conn;
+    int                 result; /* Value returned by `fn` */
+    int                 done;   /* Whether `fn` returned */
+
+    int                 fd;       /* Descriptor waited for, or -1 */
+    int                 events;   /* `poll` events waited for */
+    int                 revents;  /* Outcome of the wait, handed over when the coroutine is resumed */
+    int                 expired;  /* Whether the wait timed out, while the loop cancels its poll */
+    long long           deadline; /* Monotonic time (ms) at which the wait times out, or -1 */
+    INCTTP_Timer        timer;    /* Timeout of the wait in the loop's wheel of waits */
+
+    INCTTP_Coroutine   *next; /* Next coroutine of the pool */
+};
+
+/* (Internal) Coroutine running on the calling thread, or `NULL` */
+extern __thread INCTTP_Coroutine *INCTTP_current_coroutine;
+
+/* Idle connections each worker keeps open to every upstream of a proxy route */
+#define INCTTP_PROXY_IDLE 32
+
+/* Bytes of an upstream response buffered at once. Its status line and headers must fit */
+#define INCTTP_PROXY_BUFFER 16384
+
+/* Time (ms) a proxy route waits for an upstream to accept a connection */
+#define INCTTP_PROXY_CONNECT_TIMEOUT 5000
+
+/* Time (ms) a proxy route waits for an upstream to take the request or send more of its response */
+#ifndef INCTTP_PROXY_TIMEOUT
+#define INCTTP_PROXY_TIMEOUT 30000
+#endif
+
+/* Time (ms) an upstream that could not be connected to is left out of the balancing */
+#define INCTTP_PROXY_FAIL_TIMEOUT 5000
+
+/* Shards of the response cache, each with its own lock, LRU list and share of `CTTP_Server.cache_size`, and the
+ * number of buckets of the hash table of each shard */
+#define INCTTP_CACHE_SHARDS  16
+#define INCTTP_CACHE_BUCKETS 1024
+
+/* Request headers a cached response may vary on. Responses naming more in `Vary` are not stored */
+#define INCTTP_CACHE_VARY 8
+
+/* Time (ms) a request waits for a concurrent request filling the same cache entry before running the handler itself */
+#define INCTTP_CACHE_WAIT_TIMEOUT 10000
+
+/**
+ * (Internal) A response of a cached route, serialized once: status line and headers but `Date`, then the body.
+ * Workers share entries, so their references are counted atomically: the cache holds one and every response
+ * sending the entry another, so an entry evicted while it is being sent stays alive until its last response ends.
+ */
+struct INCTTP_CacheEntry
+{
+    size_t              refs;
+    unsigned long long  hash;
+    const char         *key;     /* Path and sorted query of the requests the entry answers */
+    size_t              klen;
+    const char         *status;
+    const char         *prefix;  /* Status line and headers */
+    size_t              prefix_len;
+    const char         *body;
+    size_t              bsize;
+    const char         *vary[2 * INCTTP_CACHE_VARY]; /* Header names of `Vary` and the request's values, `NULL` if absent */
+    size_t              nvary;
+    long long           stored;  /* Monotonic time (ms) the response was stored */
+    long long           expires; /* Monotonic time (ms) after which the response is stale */
+    size_t              size;    /* Bytes charged to the shard */
+
+    INCTTP_CacheEntry  *hnext;   /* Next entry of the same hash bucket */
+    INCTTP_LruLink      lru;     /* Position in the LRU list of the shard */
+    char                data[];
+};
+
+/**
+ * (Internal) A serving thread. Every worker owns its `SO_REUSEPORT` listening socket and its loop, so workers
+ * share no locks; the server configuration and the route tree are read-only once the server starts.
+ */
+typedef struct
+{
+    CTTP_Server *cs;
+    int          id;
+    int          server_fd; /* Listening socket of this worker */
+    int          cpu;       /* CPU the worker is pinned to, or -1 */
+    pthread_t    thread;
+    int          result;    /* Value returned by the worker loop */
+}
+INCTTP_Worker;
+
+/**
+ * (Internal) Metrics of a single worker. Only the worker writes them, with relaxed atomic stores that need neither a
+ * lock nor a locked instruction, while snapshots read them from any thread.
+ */
+typedef struct
+{
+    unsigned long long requests;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long accepted;
+    unsigned long long closed;
+    unsigned long long accept_errors;
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    CTTP_Histogram     parse;
+    CTTP_Histogram     handler;
+    CTTP_Histogram     send;
+    CTTP_RouteMetrics *routes; /* Indexed by `CTTP_RouteNode.id`, requests matching no route first */
+}
+INCTTP_WorkerMetrics;
+
+/**
+ * (Internal) Metrics of a running server, one block per worker so that workers never write the same cache lines.
+ */
+struct INCTTP_Metrics
+{
+    char                 **paths;    /* Path of each route, indexed by `CTTP_RouteNode.id` */
+    size_t                 nroutes;  /* Number of `paths`, the entry for requests matching no route included */
+    INCTTP_WorkerMetrics **workers;
+    size_t                 nworkers;
+};
+
+/* (Internal) Metrics of the worker running on the calling thread, or `NULL` if metrics are not collected */
+extern __thread INCTTP_WorkerMetrics *INCTTP_worker_metrics;
+
+/**
+ * (Internal function) Initializes arena `a`. No memory is allocated until the first allocation.
+ */
+void INCTTP_init_arena(INCTTP_Arena *a);
+
+/**
+ * (Internal function) Allocates `size` bytes from arena `a`. Returns `NULL` if an error occurs.
+ */
+void *INCTTP_arena_alloc(INCTTP_Arena *a, size_t size);
+
+/**
+ * (Internal function) Copies `len` bytes of `s` to arena `a`, adding a NUL terminator. Returns `NULL` if an error occurs.
+ */
+char *INCTTP_arena_strndup(INCTTP_Arena *a, const char *s, size_t len);
+
+/**
+ * (Internal function) Releases every allocation of arena `a` at once, keeping its first chunk for reuse.
+ */
+void INCTTP_arena_reset(INCTTP_Arena *a);
+
+/**
+ * (Internal function) Releases all memory held by arena `a`.
+ */
+void INCTTP_free_arena(INCTTP_Arena *a);
+
+/**
+ * (Internal function) Initializes writer `w`, whose strings will be allocated from arena `a`.
+ */
+void INCTTP_init_writer(CTTP_Writer *w, INCTTP_Arena *a);
+
+/**
+ * (Internal function) Points the prefix of writer `w` at its status line and `Server` header, serializing them in the
+ * writer's arena unless the status has a precomputed prefix. Writes status 200 if none was. Returns 0 if an error occurs.
+ */
+int INCTTP_write_prefix(CTTP_Writer *w);
+
+/**
+ * (Internal function) Serializes the response of Writer `w` to `res`, allocating the status line and the header
+ * block from the writer's arena. Returns 0 if an error occurs.
+ */
+int INCTTP_write_response(INCTTP_Response *res, CTTP_Writer *w);
+
+/**
+ * (Internal function) Serializes to `res` what is left of the streamed response of Writer `w` once its handler
+ * returned `result`: the last chunk, or nothing if the body cannot be completed. Returns 0 if the connection must be
+ * closed right away.
+ */
+int INCTTP_finish_stream(INCTTP_Response *res, CTTP_Writer *w, int result);
+
+/**
+ * (Internal function) Completes the headers of Writer `w` before they are serialized: drops the body of responses
+ * to HEAD and writes the `Connection` header matching `*w->keep_alive`, which it may clear.
+ */
+void INCTTP_prepare_response(CTTP_Writer *w);
+
+/**
+ * (Internal function) Releases what response `res` holds besides its arena memory, such as its file.
+ */
+void INCTTP_free_response(INCTTP_Response *res);
+
+/**
+ * (Internal) Names of the content codings, indexed by `INCTTP_ENCODING`.
+ */
+extern const char *const INCTTP_ENCODING_NAMES[INCTTP_ENCODING_COUNT];
+
+/**
+ * (Internal function) Returns the bitmask (`1 << INCTTP_ENCODING`) of the codings worth trying on a body of `size`
+ * bytes and type `type` under the settings of server `cs`: 0 if compression is off, unavailable or not worth it.
+ */
+unsigned int INCTTP_compress_encodings(CTTP_Server *cs, const char *type, size_t size);
+
+/**
+ * (Internal function) Picks the coding among `available` (a bitmask of `INCTTP_ENCODING`) that the
+ * `Accept-Encoding` value `accept` prefers, or `INCTTP_ENCODING_IDENTITY`.
+ */
+int INCTTP_negotiate_encoding(const char *accept, unsigned int available);
+
+/**
+ * (Internal function) Returns the largest size `len` bytes may take once compressed with coding `enc`.
+ */
+size_t INCTTP_compress_bound(int enc, size_t len);
+
+/**
+ * (Internal function) Compresses the `len` bytes of `in` with coding `enc` at `level` into `out`, which holds at
+ * least `INCTTP_compress_bound(enc, len)` bytes. Returns the compressed size, or 0 if an error occurs.
+ */
+size_t INCTTP_compress(int enc, int level, const char *in, size_t len, char *out);
+
+/**
+ * (Internal function) Compresses the body or the static file of Writer `w` with the coding its request prefers,
+ * updating its headers to match. Responses that are not eligible are left as they are. Returns 0 if an error occurs.
+ */
+int INCTTP_compress_response(CTTP_Server *cs, CTTP_Writer *w);
+
 /**
- * (Internal function) Writes a valid response to buffer `buf` based on provided Writer `w`.
+ * (Internal function) Drops a reference to compressed file `c`, freeing it once it is no longer used.
  */
-void INCTTP_write_response(char *buf, size_t buf_len, CTTP_Writer *w, CTTP_Server *cs);
+void INCTTP_release_compressed(INCTTP_Compressed *c);
+
+/**
+ * (Internal function) Drops a reference to cached file `f`, closing it once it is no longer used.
+ */
+void INCTTP_release_file(INCTTP_File *f);
+
+/**
+ * (Internal function) Sends as much of response `res` to socket `fd` as it accepts, handling partial writes.
+ * Returns 1 once the response is fully sent, 0 if the socket is full and -1 if an error occurs.
+ */
+int INCTTP_send_response(int fd, INCTTP_Response *res);
+
+/**
+ * (Internal function) Sends response `res` to socket `fd` in full, waiting for the socket to drain whenever its
+ * buffer is full. Returns 0 if an error occurs or the client stops reading for `timeout` ms (never if it is 0).
+ */
+int INCTTP_send_blocking(int fd, INCTTP_Response *res, int timeout);
+
+/**
+ * (Internal function) Drops the first `sent` bytes of the iovecs of response `res`, once they were written.
+ */
+void INCTTP_consume_response(INCTTP_Response *res, size_t sent);
 
 /**
  * (Internal function)
@@ -22,10 +696,313 @@ CTTP_RouteNode* INCTTP_new_route_node();
 void INCTTP_free_route_node(CTTP_RouteNode *root);
 
 /**
- * (Internal function) Parses a raw HTTP request `raw_r` and populates the Request `r`
- * with the parsed data. Returns `n =< 0` if an error arise.
+ * (Internal function) Adds a route as `CTTP_add_route` does. Returns its node, or `NULL` if an error occurs.
  */
-int INCTTP_parse_raw_request(const char *request_str, CTTP_Request *request, CTTP_Server *cs);
+CTTP_RouteNode *INCTTP_insert_route(CTTP_Server *cs, const char *m, const char *p, CTTP_RouteHandler h);
+
+/**
+ * (Internal function) Adds a route as `CTTP_add_async_route` does. Returns its node, or `NULL` if an error occurs.
+ */
+CTTP_RouteNode *INCTTP_insert_async_route(CTTP_Server *cs, const char *m, const char *p, CTTP_RouteHandler h);
+
+/**
+ * (Internal function) Retrieves the route matching request `r`, as `CTTP_read_route` does, and stores the path
+ * parameters it captures in `r`.
+ */
+int INCTTP_route_request(CTTP_Server *cs, CTTP_RouteNode **route, CTTP_Request *r);
+
+/**
+ * (Internal function) Returns whether the handler matching method `method` and path `p` of `len` bytes streams the
+ * request body, having been added with `CTTP_add_stream_route`.
+ */
+int INCTTP_route_streams_body(CTTP_Server *cs, int method, const char *p, size_t len);
+
+/**
+ * (Internal function) Returns whether the handler matching method `method` and path `p` of `len` bytes runs on a
+ * coroutine, having been added with `CTTP_add_async_route`.
+ */
+int INCTTP_route_suspends(CTTP_Server *cs, int method, const char *p, size_t len);
+
+/**
+ * (Internal function) Returns the `CTTP_METHOD` named by the `len` bytes of `m`, or `CTTP_METHOD_OTHER`.
+ */
+int INCTTP_parse_method(const char *m, size_t len);
+
+/* (Internal) Characters allowed in tokens such as methods and header names (RFC 9110, section 5.6.2) */
+extern const unsigned char INCTTP_TOKEN[256];
+
+/**
+ * (Internal function) Returns the offset of the first byte of `buf` between `pos` and `end` that is not a token
+ * character, or `end`. Like the other scanning functions, it runs on AVX2 or SSE4.2 when the CPU supports them.
+ */
+size_t INCTTP_scan_token(const char *buf, size_t pos, size_t end);
+
+/**
+ * (Internal function) Returns the offset of the first control character other than HTAB, such as CR or LF,
+ * of `buf` between `pos` and `end`, or `end`.
+ */
+size_t INCTTP_scan_value(const char *buf, size_t pos, size_t end);
+
+/**
+ * (Internal function) Returns the offset of the first space, `?` or control character of `buf` between `pos`
+ * and `end`, or `end`.
+ */
+size_t INCTTP_scan_uri(const char *buf, size_t pos, size_t end);
+
+/**
+ * (Internal function) Returns the `CTTP_HEADER_ID` of the header key `k` of `len` bytes, ignoring case.
+ */
+int INCTTP_header_id(const char *k, size_t len);
+
+/**
+ * (Internal function) Resets parser `p` to parse a new request from the start of a buffer.
+ */
+void INCTTP_init_parser(INCTTP_Parser *p);
+
+/**
+ * (Internal function) Parses the request at the start of `buf`, which holds `len` bytes, resuming where the
+ * previous call on `p` stopped. Returns `INCTTP_PARSE_COMPLETE` once the whole request (whose size is then
+ * `p->pos`) is available, `INCTTP_PARSE_INCOMPLETE` if more bytes are needed, and `n =< 0` if an error arise.
+ */
+int INCTTP_parse_request(INCTTP_Parser *p, const char *buf, size_t len, CTTP_Server *cs);
+
+/**
+ * (Internal function) Initializes chunked decoder `d`.
+ */
+void INCTTP_init_chunked(INCTTP_Chunked *d);
+
+/**
+ * (Internal function) Decodes the chunked body in `buf` from `*pos` up to `end`, stopping after the next run of at
+ * most `*n` data bytes, whose offset and length are then stored in `*off` and `*n`. `*pos` is advanced past every
+ * byte consumed. Returns `INCTTP_PARSE_COMPLETE` once the last chunk and the trailers are consumed,
+ * `INCTTP_PARSE_INCOMPLETE` if the input ends first or a run of data is found, and `n =< 0` if an error arise.
+ */
+int INCTTP_decode_chunked(INCTTP_Chunked *d, const char *buf, size_t *pos, size_t end, size_t *off, size_t *n);
+
+/**
+ * (Internal function) Sets up `rd` to stream the body of Request `r`, parsed by `p` and received on socket `fd` into
+ * `buf`, which holds `len` bytes out of `cap`, and attaches it to `r`. The buffer's new length and the end of the
+ * body are found in `rd->len` and `rd->pos` once the handler returns. Reads give up after `timeout` ms without
+ * bytes, or never if it is 0.
+ */
+void INCTTP_init_body_reader(INCTTP_BodyReader *rd, INCTTP_Parser *p, CTTP_Request *r, int fd, char *buf, size_t len,
+                             size_t cap, int timeout);
+
+/**
+ * (Internal function) Skips the unread rest of the body streamed by `rd` if it is already buffered, so the connection
+ * can serve a next request. Returns whether the whole body has been consumed.
+ */
+int INCTTP_skip_body(INCTTP_BodyReader *rd);
+
+/**
+ * (Internal function) Populates the Request `r` with views of the request parsed by `p` out of `buf`, allocating
+ * its header table from arena `a`. The views are NUL-terminated in place.
+ * Must only be called after `INCTTP_parse_request` returned `INCTTP_PARSE_COMPLETE`. Returns `n =< 0` if an error arise.
+ */
+int INCTTP_fill_request(INCTTP_Parser *p, char *buf, CTTP_Request *r, INCTTP_Arena *a, CTTP_Server *cs);
+
+/**
+ * (Internal function) Parses the whole raw HTTP request `raw_r` of `len` bytes and populates the Request `r`
+ * with the parsed data, as `INCTTP_fill_request` does. Returns `INCTTP_PARSE_INCOMPLETE` if the request is
+ * truncated and `n =< 0` if an error arise.
+ */
+int INCTTP_parse_raw_request(char *raw_r, size_t len, CTTP_Request *r, INCTTP_Arena *a, CTTP_Server *cs);
+
+/**
+ * (Internal function) Handles the parsed Request `r`, read from socket `fd`, running the matching route handler, and
+ * serializes the response to `res`. The response is built in arena `a`; a streamed one is partly sent to `fd` by its
+ * handler already. Returns 0 if an error occurs.
+ * `keep_alive` tells whether the server allows the connection to persist; on return it tells whether it does.
+ */
+int INCTTP_serve_request(CTTP_Server *cs, int fd, CTTP_Request *r, INCTTP_Arena *a, INCTTP_Response *res, int *keep_alive);
+
+/**
+ * (Internal function) Serializes the default response for error `err` to `res` without running any handler.
+ * The response closes the connection. Returns 0 if an error occurs.
+ */
+int INCTTP_serve_error(int err, INCTTP_Arena *a, INCTTP_Response *res);
+
+/**
+ * (Internal function) Sets `O_NONBLOCK` on `fd`. Returns 0 if an error occurs.
+ */
+int INCTTP_set_nonblocking(int fd);
+
+/**
+ * (Internal function) Runs the edge-triggered epoll event loop for the listening socket of worker `wk`.
+ * Returns only if the event loop cannot be created or fails.
+ */
+int INCTTP_run_event_loop(INCTTP_Worker *wk);
+
+/**
+ * (Internal function) Runs the io_uring event loop for the listening socket of worker `wk`. Returns `CTTP_ERROR_NIL`
+ * without serving anything if the kernel lacks the io_uring features it needs, and otherwise only if the loop fails.
+ */
+int INCTTP_run_uring_loop(INCTTP_Worker *wk);
+
+/**
+ * (Internal function) Allocates a connection for socket `fd`, accepted from `peer`. Returns `NULL` if an error occurs.
+ */
+INCTTP_Connection *INCTTP_new_connection(int fd, const struct sockaddr_in *peer);
+
+/**
+ * (Internal function) Frees connection `c` and everything it holds but its socket, which the loop closes.
+ */
+void INCTTP_free_connection(INCTTP_Connection *c);
+
+/**
+ * (Internal function) Parses the bytes connection `c` received so far. Returns `INCTTP_PARSE_INCOMPLETE` if more are
+ * needed, `INCTTP_PARSE_COMPLETE` once a request is whole and `n =< 0` if it must be rejected.
+ */
+int INCTTP_parse_connection(CTTP_Server *cs, INCTTP_Connection *c);
+
+/**
+ * (Internal function) Answers the request the parser of connection `c` just completed, or rejects the buffered input
+ * with the default response for error `result`, leaving the response to send in `c->response`.
+ * Returns 0 if an error occurs.
+ */
+int INCTTP_serve_connection(CTTP_Server *cs, INCTTP_Connection *c, int result);
+
+/**
+ * (Internal function) Resumes the handler of suspended connection `c` with the outcome `revents` of its wait. Once the
+ * handler returns, the response is left to send as `INCTTP_serve_connection` does. Returns 0 if an error occurs.
+ */
+int INCTTP_resume_connection(INCTTP_Connection *c, int revents);
+
+/**
+ * (Internal function) Records the response of connection `c`, just sent, in the worker's metrics and access log.
+ */
+void INCTTP_complete_response(CTTP_Server *cs, INCTTP_Connection *c);
+
+/**
+ * (Internal function) Drops the answered request from the receive buffer of connection `c`, keeping any pipelined
+ * bytes after it, and readies the connection for the next request.
+ */
+void INCTTP_finish_request(INCTTP_Connection *c);
+
+/**
+ * (Internal function) Arms the timer of connection `c` in `w` for what the connection now waits for. A head must
+ * arrive whole before its deadline, while bodies and responses only have to keep moving: their timer restarts when
+ * `progress` is set, as bytes have been received or sent since the last call.
+ */
+void INCTTP_time_connection(CTTP_Server *cs, INCTTP_TimerWheel *w, INCTTP_Connection *c, int progress);
+
+/**
+ * (Internal function) Returns a coroutine with a stack of `stack_size` bytes that runs `fn(cs, c)` once resumed,
+ * reusing a pooled one when possible. Returns `NULL` if an error occurs.
+ */
+INCTTP_Coroutine *INCTTP_new_coroutine(size_t stack_size, int (*fn)(CTTP_Server *, INCTTP_Connection *),
+                                       CTTP_Server *cs, INCTTP_Connection *c);
+
+/**
+ * (Internal function) Runs coroutine `co` until it waits or returns, handing `revents` to the wait it resumes from.
+ * Returns 1 once its function has returned, 0 if it waits.
+ */
+int INCTTP_resume_coroutine(INCTTP_Coroutine *co, int revents);
+
+/**
+ * (Internal function) Returns coroutine `co`, whose function has returned, to the pool of the calling thread.
+ */
+void INCTTP_free_coroutine(INCTTP_Coroutine *co);
+
+/**
+ * (Internal function) Readies the empty wheel `w`, starting at time `now` (ms).
+ */
+void INCTTP_init_wheel(INCTTP_TimerWheel *w, long long now);
+
+/**
+ * (Internal function) Arms timer `t` of `w` to expire at `deadline` (ms), moving it if it is already armed.
+ */
+void INCTTP_set_timer(INCTTP_TimerWheel *w, INCTTP_Timer *t, long long deadline);
+
+/**
+ * (Internal function) Disarms timer `t` of `w`, if it is armed.
+ */
+void INCTTP_cancel_timer(INCTTP_TimerWheel *w, INCTTP_Timer *t);
+
+/**
+ * (Internal function) Advances `w` to time `now` (ms), moving the timers due by then to its expired ones.
+ */
+void INCTTP_advance_wheel(INCTTP_TimerWheel *w, long long now);
+
+/**
+ * (Internal function) Disarms and returns an expired timer of `w`, or `NULL` if there is none.
+ */
+INCTTP_Timer *INCTTP_pop_expired(INCTTP_TimerWheel *w);
+
+/**
+ * (Internal function) Returns the time (ms) a loop may wait without missing a timer of `w`, `timeout` at most.
+ * A negative `timeout` means no limit.
+ */
+int INCTTP_next_expiry(INCTTP_TimerWheel *w, int timeout);
+
+/**
+ * (Internal function) Numbers the routes of server `cs` and allocates the metrics of its `workers`.
+ * Returns 0 if an error occurs.
+ */
+int INCTTP_init_metrics(CTTP_Server *cs, size_t workers);
+
+/**
+ * (Internal function) Frees the metrics of server `cs`.
+ */
+void INCTTP_free_metrics(CTTP_Server *cs);
+
+/**
+ * (Internal function) Returns the monotonic time in nanoseconds.
+ */
+long long INCTTP_now_ns();
+
+/**
+ * (Internal function) Adds `n` to counter `c`, which only the calling thread writes.
+ */
+void INCTTP_count(unsigned long long *c, unsigned long long n);
+
+/**
+ * (Internal function) Records a latency of `ns` nanoseconds in histogram `h`, which only the calling thread writes.
+ */
+void INCTTP_observe(CTTP_Histogram *h, long long ns);
+
+/**
+ * (Internal function) Records in `m` the request answered by response `res`, just sent. It started at `started`,
+ * took `parse` nanoseconds to parse and was ready to send at `sending`.
+ */
+void INCTTP_record_request(INCTTP_WorkerMetrics *m, const INCTTP_Response *res, long long started, long long parse, long long sending);
+
+/**
+ * (Internal function) Starts the access log of server `cs` for its `workers`. Returns 0 if an error occurs.
+ */
+int INCTTP_start_logger(CTTP_Server *cs, size_t workers);
+
+/**
+ * (Internal function) Stops the access log of server `cs` once every record is written, and frees it.
+ */
+void INCTTP_stop_logger(CTTP_Server *cs);
+
+/**
+ * (Internal function) Allocates the response cache of server `cs`. Returns 0 if an error occurs.
+ */
+int INCTTP_init_cache(CTTP_Server *cs);
+
+/**
+ * (Internal function) Frees the response cache of server `cs`, once no worker uses it anymore.
+ */
+void INCTTP_free_cache(CTTP_Server *cs);
+
+/**
+ * (Internal function) Drops a reference to response cache entry `e`, freeing it once it is no longer used.
+ */
+void INCTTP_release_cached(INCTTP_CacheEntry *e);
+
+/**
+ * (Internal function) Copies to `rec` what the access log needs of Request `r`, received from `peer`. `r` is `NULL`
+ * for requests rejected before they could be parsed.
+ */
+void INCTTP_fill_log_record(INCTTP_LogRecord *rec, const CTTP_Request *r, const struct sockaddr_in *peer);
+
+/**
+ * (Internal function) Completes `rec` with response `res`, just sent for a request that started at `started`, and
+ * hands it to the log thread if `cs->log_level` asks for it. Drops it if the worker's ring is full.
+ */
+void INCTTP_log_request(CTTP_Server *cs, INCTTP_LogRecord *rec, const INCTTP_Response *res, long long started);
 
 /**
  * (Internal function) Writes the current date and time in the format `%a, %d %b %Y %H:%M:%S GMT` to a buffer.
@@ -34,13 +1011,24 @@ int INCTTP_parse_raw_request(const char *request_str, CTTP_Request *request, CTT
 void INCTTP_current_date(char *buf);
 
 /**
- * (Internal function)
+ * (Internal function) Returns the `Date` header line of the current second, `CRLF` included, and stores its length
+ * in `len`. The line is formatted at most once per second per thread and changes when the second does.
  */
-void INCTTP_print_start(struct sockaddr_in client_addr, size_t request_count);
+const char *INCTTP_date_header(size_t *len);
 
 /**
- * (Internal function)
+ * (Internal function) Writes time `t` to a buffer of at least `DATE_LEN` characters, as `INCTTP_current_date` does.
+ */
+void INCTTP_format_date(char *buf, time_t t);
+
+/**
+ * (Internal function) Adds entry `e` to `l` as its most recently used.
+ */
+void INCTTP_lru_push(INCTTP_Lru *l, INCTTP_LruLink *e);
+
+/**
+ * (Internal function) Removes entry `e` from `l`.
  */
-void INCTTP_print_end(struct sockaddr_in client_addr, size_t request_count);
+void INCTTP_lru_unlink(INCTTP_Lru *l, INCTTP_LruLink *e);
 
 #endif
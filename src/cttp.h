@@ -9,6 +9,16 @@
 #define CTTP_MAX_HEADERS_SIZE 8192
 #define CTTP_PARAM_LIMIT      250
 #define CTTP_MAX_PARAMS_SIZE  8192
+#define CTTP_PATH_PARAM_LIMIT 8
+#define CTTP_KEEPALIVE_TIMEOUT  5000
+#define CTTP_KEEPALIVE_REQUESTS 1000
+#define CTTP_HEADER_TIMEOUT     10000
+#define CTTP_BODY_TIMEOUT       30000
+#define CTTP_WRITE_TIMEOUT      30000
+#define CTTP_COMPRESS_LEVEL     6
+#define CTTP_COMPRESS_MIN_SIZE  1024
+#define CTTP_STACK_SIZE         65536
+#define CTTP_CACHE_SIZE         (64 * 1024 * 1024)
 
 enum CTTP_ERROR 
 {
@@ -23,72 +33,221 @@ enum CTTP_ERROR
     CTTP_ERROR_SERVER_LISTEN           = -7, /* Occurs when the server cannot listen */
     CTTP_ERROR_RAW_INITIAL_LINE        = -8, /* Occurs when a raw request doesn't have the initial line according to the HTTP standard */
     CTTP_ERROR_RAW_REQUEST_HEADERS     = -9, /* Occurs when a raw request doesn't have any headers */
+    CTTP_ERROR_SERVER_EVENT_LOOP       = -10, /* Occurs when the server cannot create or wait on its event loop */
+    CTTP_ERROR_URI_TOO_LONG            = -11, /* Occurs when the URI from a raw request is too long */
+    CTTP_ERROR_VERSION_NOT_SUPPORTED   = -12, /* Occurs when a raw request uses an HTTP major version other than 1 */
+    CTTP_ERROR_RAW_REQUEST_BODY        = -13, /* Occurs when the chunked body of a raw request is malformed */
+    CTTP_ERROR_BAD_GATEWAY             = -14, /* Occurs when an upstream cannot be reached or sends an invalid response */
+    CTTP_ERROR_GATEWAY_TIMEOUT         = -15, /* Occurs when an upstream does not answer in time */
 };
  
 // <------------------------>
-//        CTTP_Header
+//        CTTP_Slice
 // <------------------------>
 
+/**
+ * A view of `len` bytes at `ptr`. Slices taken from a request point into the connection's receive buffer
+ * and are only valid while the request is being handled.
+ */
 typedef struct
 {
-    char *key;
-    char *val;
+    const char *ptr;
+    size_t      len;
 }
-CTTP_Header;
+CTTP_Slice;
+
+/**
+ * A path parameter captured by the router: the name it was registered with and the matched path segment.
+ */
+typedef struct
+{
+    const char *name;
+    CTTP_Slice  val;
+}
+CTTP_PathParam;
+
+// <------------------------>
+//        CTTP_Header
+// <------------------------>
+
+/**
+ * Well-known header fields, recognized once when a request is parsed or a header is written.
+ * Any other field is reported as `CTTP_HEADER_OTHER`.
+ */
+enum CTTP_HEADER_ID
+{
+    CTTP_HEADER_OTHER = 0,
+    CTTP_HEADER_ACCEPT,
+    CTTP_HEADER_ACCEPT_ENCODING,
+    CTTP_HEADER_ACCEPT_LANGUAGE,
+    CTTP_HEADER_AUTHORIZATION,
+    CTTP_HEADER_CACHE_CONTROL,
+    CTTP_HEADER_CONNECTION,
+    CTTP_HEADER_CONTENT_ENCODING,
+    CTTP_HEADER_CONTENT_LENGTH,
+    CTTP_HEADER_CONTENT_TYPE,
+    CTTP_HEADER_COOKIE,
+    CTTP_HEADER_EXPECT,
+    CTTP_HEADER_HOST,
+    CTTP_HEADER_IF_MODIFIED_SINCE,
+    CTTP_HEADER_IF_NONE_MATCH,
+    CTTP_HEADER_ORIGIN,
+    CTTP_HEADER_RANGE,
+    CTTP_HEADER_REFERER,
+    CTTP_HEADER_TE,
+    CTTP_HEADER_TRANSFER_ENCODING,
+    CTTP_HEADER_UPGRADE,
+    CTTP_HEADER_USER_AGENT,
+    CTTP_HEADER_VARY,
+    CTTP_HEADER_X_FORWARDED_FOR,
+    CTTP_HEADER_X_REQUEST_ID,
+    CTTP_HEADER_COUNT, /* Number of header IDs, not a header */
+};
 
-// <-------------------------->
-//        CTTP_Parameter
-// <-------------------------->
- 
 typedef struct
 {
-    char *key;
-    char *val;
+    char   *key;
+    char   *val;
+    size_t  klen; /* Length of `key`, excluding the NUL terminator */
+    size_t  vlen; /* Length of `val`, excluding the NUL terminator */
+    int     id;   /* `CTTP_HEADER_ID` of `key` */
 }
-CTTP_Parameter;
+CTTP_Header;
 
 // <------------------------>
 //        CTTP_Request
 // <------------------------>
 
+/**
+ * Request methods known to CTTP. Any other method token is reported as `CTTP_METHOD_OTHER`.
+ */
+enum CTTP_METHOD
+{
+    CTTP_METHOD_OTHER = 0,
+    CTTP_METHOD_GET,
+    CTTP_METHOD_HEAD,
+    CTTP_METHOD_POST,
+    CTTP_METHOD_PUT,
+    CTTP_METHOD_DELETE,
+    CTTP_METHOD_CONNECT,
+    CTTP_METHOD_OPTIONS,
+    CTTP_METHOD_TRACE,
+    CTTP_METHOD_PATCH,
+    CTTP_METHOD_COUNT, /* Number of methods, not a method */
+};
+
+/**
+ * HTTP versions understood by CTTP.
+ */
+enum CTTP_VERSION
+{
+    CTTP_VERSION_1_0 = 0,
+    CTTP_VERSION_1_1 = 1,
+};
+
+/* (Internal) Source of a request body read from the connection while the handler runs */
+typedef struct INCTTP_BodyReader INCTTP_BodyReader;
+
+/**
+ * A parsed request. Every string is a view into the connection's receive buffer: nothing is copied
+ * and the views are only valid while the handler runs. Except for the body, views are NUL-terminated.
+ */
 typedef struct
 {
-    char           method[255]; // TODO: more method handling
-    char           uri[512]; // TODO: larger uri
-    CTTP_Header    headers[CTTP_HEADER_LIMIT];
-    size_t         hsize;
-    CTTP_Parameter params[CTTP_PARAM_LIMIT];
-    size_t         params_count;
-    char           http_version[255];
-    char           body[1024];
-    size_t         bsize;
+    int          method;       /* `CTTP_METHOD` of the request */
+    int          version;      /* `CTTP_VERSION` of the request */
+    CTTP_Slice   method_name;  /* Method token as received */
+    CTTP_Slice   uri;          /* Path of the request target, without the query string */
+    CTTP_Slice   query;        /* Query string without `?`. Its `&` separators are replaced by NUL bytes */
+    CTTP_Header *headers;      /* Request headers, in the order received */
+    size_t       hsize;        /* Number of headers */
+    size_t       params_count; /* Number of query parameters */
+    CTTP_Slice   body;         /* Request body, binary-safe and decoded if chunked. Empty for routes streaming their body */
+
+    CTTP_PathParam path_params[CTTP_PATH_PARAM_LIMIT]; /* Path parameters captured by the matched route */
+    size_t         path_params_count;                  /* Number of path parameters */
+
+    struct CTTP_RouteNode *route; /* Route matched by the request, set before its handler runs */
+
+    CTTP_Header  *known[CTTP_HEADER_COUNT]; /* First header of each `CTTP_HEADER_ID`, or `NULL` */
+    CTTP_Header **others;                   /* (Internal) Hash table of the other headers, by case-insensitive key */
+    size_t        others_size;              /* (Internal) Number of slots of `others`, a power of two */
+
+    INCTTP_BodyReader *reader; /* (Internal) Reader of a streamed body, or `NULL` */
 }
 CTTP_Request;
 
 /**
- * Reads a header with key `k` from request `r`. Returns `NULL` if the header does not exists.
+ * Reads a header with key `k` from request `r`. Keys are case-insensitive, and repeated headers read as the first one.
+ * Returns `NULL` if the header does not exists.
  */
 char *CTTP_read_request_header(CTTP_Request *r, char *k);
 
+/**
+ * Reads the well-known header `id` (a `CTTP_HEADER_ID`) from request `r` in constant time.
+ * Returns `NULL` if the header does not exists.
+ */
+char *CTTP_read_request_header_id(CTTP_Request *r, int id);
+
 /**
  * Reads a parameter with key `k` from request `r`. Returns `NULL` if the parameter does not exists.
+ * A parameter without `=` reads as an empty string.
  */
 char *CTTP_read_request_param(CTTP_Request *r, char *k);
 
+/**
+ * Reads the path parameter named `k` captured by the route of request `r`, such as `id` for `/users/:id`.
+ * The slice points into the request path and is not NUL-terminated. Its `ptr` is `NULL` if the parameter does not exists.
+ */
+CTTP_Slice CTTP_read_request_path_param(CTTP_Request *r, const char *k);
+
+/**
+ * Reads up to `len` bytes of the body of request `r` into `b`. Bodies of routes added with `CTTP_add_stream_route` are
+ * read from the connection as they arrive, waiting for the client when needed; other bodies are taken from `r->body`,
+ * which advances. Returns the number of bytes read, 0 once the whole body has been read, and -1 if an error occurs.
+ */
+long CTTP_read_request_body(CTTP_Request *r, char *b, size_t len);
+
 // <------------------------>
 //        CTTP_Writer
 // <------------------------>
 
+/* (Internal) Per-request allocator backing the writer */
+typedef struct INCTTP_Arena INCTTP_Arena;
+
+/* (Internal) Open file cached by the static file server */
+typedef struct INCTTP_File INCTTP_File;
+
+/* (Internal) Compressed body cached by a worker */
+typedef struct INCTTP_Compressed INCTTP_Compressed;
+
+/* (Internal) Response stored by the response cache */
+typedef struct INCTTP_CacheEntry INCTTP_CacheEntry;
+
 /**
- *
+ * Response under construction. Everything written to it is copied to a per-request arena that is
+ * released at once after the response has been sent, so nothing needs to be freed by handlers.
  */
 typedef struct
 {
-    const char  *status; /* HTTP response status */
-    char        *body; /* Response body content */
-    size_t       bsize; /* Size in bytes of the response body */
-    CTTP_Header  headers[CTTP_HEADER_LIMIT]; /* Array of response headers */
-    size_t       hsize; /* Number of headers set */
+    const char   *status; /* HTTP response status */
+    char         *body; /* Response body content */
+    size_t        bsize; /* Size in bytes of the response body */
+    CTTP_Header   headers[CTTP_HEADER_LIMIT]; /* Array of response headers */
+    size_t        hsize; /* Number of headers set */
+    INCTTP_Arena *arena; /* (Internal) Allocator of the writer's strings */
+    INCTTP_File  *file; /* (Internal) File sent as the body with `sendfile`, set by static routes */
+    INCTTP_Compressed *compressed; /* (Internal) Cached entry `body` points into, or `NULL` */
+    INCTTP_CacheEntry *cached; /* (Internal) Response cache entry `prefix` and `body` point into, or `NULL` */
+    const char   *prefix; /* (Internal) Serialized status line and fixed headers, shared by every response with the same status */
+    size_t        prefix_len; /* (Internal) Length of `prefix` */
+    int           fd; /* (Internal) Socket of the connection, written to directly by streamed responses */
+    int           stream; /* (Internal) `INCTTP_STREAM` state of the response */
+    CTTP_Request *request; /* (Internal) Request being answered */
+    int          *keep_alive; /* (Internal) Whether the connection persists after the response */
+    size_t        streamed; /* (Internal) Body bytes of a streamed response sent so far */
+    long long     declared; /* (Internal) Body length a streamed response declared with `Content-Length`, or -1 if none */
+    int           timeout; /* (Internal) Time (ms) a streamed response waits for the client to read, or 0 for no limit */
 }
 CTTP_Writer;
 
@@ -103,13 +262,31 @@ int CTTP_write_header(CTTP_Writer *w, char *k, char *v);
 int CTTP_write_status(CTTP_Writer *w, const char *STATUS);
 
 /**
- * Writes the body `b` to `w->body` and sets `Content-Length` to `w->bsize` for the provide Writer. 
- * Returns 0 if an error occurs.
+ * Writes the body `b` to `w->body` and sets `Content-Length` to `w->bsize` for the provide Writer, replacing the one
+ * of a body written before. The body is binary-safe: exactly `_blen` bytes are copied. Returns 0 if an error occurs.
  */
 int CTTP_write_body(CTTP_Writer *w, const char *b, size_t _blen);
 
 /**
- * Reads a header with key `k` from writer `w`. Returns `NULL` if the header does not exists.
+ * Sends the status line and headers of Writer `w` right away, along with the body written so far, and turns the
+ * response into a stream whose body is sent by `CTTP_write_chunk`. Without a `Content-Length` header the body is
+ * sent with `Transfer-Encoding: chunked`, or until the connection closes for HTTP/1.0 clients.
+ * Returns 0 if an error occurs; the connection is then closed once the handler returns.
+ */
+int CTTP_writer_flush(CTTP_Writer *w);
+
+/**
+ * Sends `len` bytes of `b` as the next part of the body of Writer `w`, flushing its headers first if needed.
+ * Waits while the socket buffer is full, so a slow client throttles the handler. Handlers of async routes are
+ * suspended meanwhile; in those of other routes the wait blocks the worker, for up to `CTTP_Server.write_timeout`
+ * each time the client stops reading, so routes streaming to slow clients should be async.
+ * A body framed by a `Content-Length` header takes no byte past that length: such a write fails and closes the
+ * connection, as does returning from the handler before the length is reached. Returns 0 if an error occurs.
+ */
+int CTTP_write_chunk(CTTP_Writer *w, const char *b, size_t len);
+
+/**
+ * Reads a header with key `k` from writer `w`. Keys are case-insensitive. Returns `NULL` if the header does not exists.
  */
 char *CTTP_read_writer_header(CTTP_Writer *w, char *k);
 
@@ -117,9 +294,6 @@ char *CTTP_read_writer_header(CTTP_Writer *w, char *k);
 //        CTTP_Route
 // <---------------------->
 
-/* Set the upper limit for the number of RouteNode children based on ASCII size */
-#define ALPHABET_SIZE 128
-
 /**
  * Type definition for a function handling CTTP routes.
  * The function should return an integer and accept pointers to `CTTP_Writer` and `CTTP_Request`.
@@ -127,21 +301,74 @@ char *CTTP_read_writer_header(CTTP_Writer *w, char *k);
 typedef int (*CTTP_RouteHandler)(CTTP_Writer *w, CTTP_Request *r);
 
 /**
- * Represents a node in a trie, each corresponding to an ASCII character.
+ * Kinds of route nodes. Static nodes match their prefix literally, parameter nodes match one path segment
+ * and catch-all nodes match the rest of the path.
+ */
+enum CTTP_ROUTE_KIND
+{
+    CTTP_ROUTE_STATIC = 0,
+    CTTP_ROUTE_PARAM,
+    CTTP_ROUTE_CATCH_ALL,
+};
+
+/**
+ * Represents a node in a path-compressed radix tree.
+ * Each node is reached through an edge labelled with `prefix`, a run of path bytes shared by every route below it.
  * Nodes can have child nodes and, if they represent the end of a path, an associated HTTP handler.
  */
 typedef struct CTTP_RouteNode CTTP_RouteNode;
 struct CTTP_RouteNode
 {
-    CTTP_RouteNode    *children[ALPHABET_SIZE]; /* Children nodes array, indexed by ASCII codes */
-    CTTP_RouteHandler  handler; /* HTTP handler function for the endpoint, if this node is a terminal/leaf node */
-    char              *method; /* HTTP method associated with the node */
+    int                kind; /* `CTTP_ROUTE_KIND` of the node */
+    char              *prefix; /* Path bytes matched by this node, or the parameter name */
+    size_t             plen; /* Length of `prefix` */
+    char              *indices; /* First byte of each child's prefix, sorted, parallel to `children` */
+    CTTP_RouteNode   **children; /* Children nodes array, in the order of `indices` */
+    size_t             nchildren; /* Number of children */
+    CTTP_RouteNode    *param; /* Child matching a `:name` segment, tried after the static children */
+    CTTP_RouteNode    *catch_all; /* Child matching a trailing `*name` segment, tried last */
+    CTTP_RouteHandler  handlers[CTTP_METHOD_COUNT]; /* Handler of each `CTTP_METHOD` registered for the endpoint */
+    unsigned int       methods; /* Bitmask of the registered methods (`1 << CTTP_METHOD`), 0 if not an endpoint */
+    unsigned int       streams; /* Bitmask of the methods whose handler reads the request body itself */
+    unsigned int       suspends; /* Bitmask of the methods whose handler runs on a coroutine and may wait */
+    char              *allow; /* Value of the `Allow` header of 405 responses, such as `GET, HEAD, POST` */
+    void              *data; /* Allocated data of built-in route types, such as the directory of static routes. Freed with the node */
+    size_t             id; /* Index of the endpoint in the server's metrics, assigned when the server starts. 0 if none */
 };
 
 // <----------------------->
 //        CTTP_Server
 // <----------------------->
 
+/* (Internal) Counters of every worker of a running server */
+typedef struct INCTTP_Metrics INCTTP_Metrics;
+
+/* (Internal) Access log of a running server */
+typedef struct INCTTP_Logger INCTTP_Logger;
+
+/* (Internal) Response cache of a running server */
+typedef struct INCTTP_Cache INCTTP_Cache;
+
+/**
+ * Formats of the access log.
+ */
+enum CTTP_LOG_FORMAT
+{
+    CTTP_LOG_COMMON = 0, /* Common Log Format: `host - - [time] "request line" status bytes` */
+    CTTP_LOG_COMBINED,   /* Common Log Format followed by the quoted `Referer` and `User-Agent` */
+    CTTP_LOG_JSON,       /* One JSON object per line, with the request duration in microseconds */
+};
+
+/**
+ * I/O backends of the event loop.
+ */
+enum CTTP_IO_BACKEND
+{
+    CTTP_IO_AUTO = 0, /* io_uring when the kernel supports it (Linux 5.19 and later), epoll otherwise */
+    CTTP_IO_EPOLL,    /* Edge-triggered epoll with non-blocking `accept`, `read` and `sendmsg` calls */
+    CTTP_IO_URING,    /* io_uring only: workers fail with `CTTP_ERROR_SERVER_EVENT_LOOP` if the kernel lacks it */
+};
+
 /**
  * Represents the core structure of the CTTP server.
  */
@@ -162,20 +389,37 @@ typedef struct
     
     /**
      * Logging verbosity level for server operations.
-     * Determines the amount and detail of logs that will be generated during server operations.
+     * Determines the amount and detail of logs that will be generated during server operations. With `access_log`
+     * set, level 0 logs nothing, level 1 logs the requests answered with a 4xx or 5xx status and level 2 every request.
+     * Default: 1.
      */
     int log_level;
 
     /**
-     * Buffer size limit for request or response body.
-     * Specifies the maximum allowable size of data in the body section of either incoming requests or outgoing responses.
+     * Descriptor the access log is written to, such as `STDOUT_FILENO` or a file opened with `O_APPEND`.
+     * Workers hand their records to a background thread that formats and writes them in batches, so serving never
+     * waits on the log: when a worker outpaces it, records are dropped and counted instead.
+     * Default: -1 (no access log).
+     */
+    int access_log;
+
+    /**
+     * `CTTP_LOG_FORMAT` of the access log.
+     * Default: `CTTP_LOG_COMMON`.
+     */
+    int log_format;
+
+    /**
+     * Size limit for request bodies.
+     * Specifies the maximum allowable size of data in the body section of incoming requests. Response bodies are not
+     * bounded, since they are sent from where the writer stored them.
      * Default: 1MB (1,048,576 bytes).
      */
     size_t bsize;
 
     /**
-     * Header size limit for request or response.
-     * Denotes the maximum allowable length of headers for both incoming requests and outgoing responses.
+     * Header size limit for requests.
+     * Denotes the maximum allowable length of the request line and headers of incoming requests.
      * Default: 8KB (8,192 bytes).
      */
     size_t hsize;
@@ -193,6 +437,135 @@ typedef struct
      * Default: 1.1MB (1,153,433 bytes).
      */
     size_t rsize;
+
+    /**
+     * Serving mode selector.
+     * When set, the server falls back to the blocking accept/read/send loop that serves one connection
+     * at a time. Otherwise connections are multiplexed by a non-blocking, edge-triggered epoll event loop.
+     * Default: 0 (event loop).
+     */
+    int blocking;
+
+    /**
+     * `CTTP_IO_BACKEND` of the event loop, unless `blocking` is set.
+     * The io_uring backend accepts with a single multishot operation, receives into buffers the kernel picks from a
+     * shared ring, links the close of a connection to its last send and submits each batch of operations with the
+     * same system call that waits for their completions.
+     * Default: `CTTP_IO_AUTO`.
+     */
+    int io_backend;
+
+    /**
+     * Number of serving threads.
+     * Each worker binds its own `SO_REUSEPORT` listening socket on `port` and runs its own loop, letting the
+     * kernel spread incoming connections across workers. A value of 0 starts one worker per online CPU.
+     * Default: 1.
+     */
+    int workers;
+
+    /**
+     * CPU affinity toggle.
+     * When set, worker `n` is pinned to the `n`-th CPU available to the process (wrapping around).
+     * Default: 0 (not pinned).
+     */
+    int pin_workers;
+
+    /**
+     * Idle timeout for persistent connections, in milliseconds.
+     * Time a connection may stay open waiting for its next request before being closed.
+     * A value of 0 disables persistent connections, closing every connection after its response.
+     * Default: 5s (5,000 ms).
+     */
+    int keepalive_timeout;
+
+    /**
+     * Maximum number of requests served over a single persistent connection.
+     * The response to the last allowed request carries `Connection: close`. A value of 0 means no limit.
+     * Default: 1000.
+     */
+    size_t keepalive_requests;
+
+    /**
+     * Time a client may take to send the head of a request (request line and headers), in milliseconds.
+     * It runs from the connection, or from the end of the previous response, and is not extended as bytes
+     * arrive, so a client sending its request a few bytes at a time cannot hold the connection.
+     * A value of 0 disables it.
+     * Default: 10s (10,000 ms).
+     */
+    int header_timeout;
+
+    /**
+     * Time a request body may go without receiving any bytes, in milliseconds, bodies read by the handlers of
+     * stream routes included. A value of 0 disables it.
+     * Default: 30s (30,000 ms).
+     */
+    int body_timeout;
+
+    /**
+     * Time a response may go without sending any bytes while the client does not read them, in milliseconds,
+     * streamed responses included. A value of 0 disables it.
+     * Default: 30s (30,000 ms).
+     */
+    int write_timeout;
+
+    /**
+     * Response compression toggle.
+     * When set, bodies written with `CTTP_write_body` and static files are compressed with the best content coding
+     * the request's `Accept-Encoding` allows: `br` when CTTP is built with `CTTP_BROTLI`, `gzip` and `deflate` when
+     * built with `CTTP_ZLIB`. Without either, nothing is compressed. Constant routes are compressed once, when added.
+     * Default: 0 (not compressed).
+     */
+    int compress;
+
+    /**
+     * Compression level of bodies compressed per response, from 1 (fastest) to 9 (smallest).
+     * Static files and constant routes are compressed only once, so they always use the highest level.
+     * Default: 6.
+     */
+    int compress_level;
+
+    /**
+     * Smallest body compressed, in bytes. Smaller bodies would not shrink enough to pay for it.
+     * Default: 1KB (1,024 bytes).
+     */
+    size_t compress_min_size;
+
+    /**
+     * `NULL`-terminated list of the `Content-Type` values to compress, such as `application/json`. An entry ending
+     * in `/` and an asterisk matches every subtype. `NULL` selects text, JSON, JavaScript, XML, SVG and WebAssembly.
+     * Default: `NULL`.
+     */
+    const char *const *compress_types;
+
+    /**
+     * Metrics collection toggle.
+     * When set, every worker counts requests, bytes and connections and records latency histograms, read with
+     * `CTTP_read_metrics` or served by `CTTP_add_metrics_route`. Each worker writes its own counters, so no lock is taken.
+     * Default: 0 (not collected).
+     */
+    int metrics;
+
+    /**
+     * Stack size of the coroutines running the handlers of routes added with `CTTP_add_async_route`.
+     * Stacks are only backed by memory as far as they are used, and a handler overflowing its stack crashes the
+     * server on a guard page rather than corrupting memory.
+     * Default: 64KB (65,536 bytes).
+     */
+    size_t stack_size;
+
+    /**
+     * Bytes of responses kept for the routes added with `CTTP_add_cached_route`, in a cache shared by every worker.
+     * The least recently used responses are evicted to stay under it.
+     * Default: 64MB (67,108,864 bytes).
+     */
+    size_t cache_size;
+
+    int             async; /* (Internal) Whether a route was added with `CTTP_add_async_route` */
+    int             streams; /* (Internal) Whether a route was added with `CTTP_add_stream_route` */
+    INCTTP_Metrics *stats; /* (Internal) Counters of the workers, allocated while the server runs when `metrics` is set */
+    INCTTP_Logger  *logger; /* (Internal) Access log, running while the server does when `access_log` is set */
+    int             cached; /* (Internal) Whether a route was added with `CTTP_add_cached_route` */
+    INCTTP_Cache   *cache; /* (Internal) Response cache, allocated while the server runs when `cached` is set */
 } CTTP_Server;
 
 /**
@@ -204,15 +577,103 @@ CTTP_Server CTTP_new_server(int p);
 
 /**
  * Add a route to server `cs` with method `m`, path `p`, and handler `h`.
- * Multiple methods can be separated with `,`. The handler should be a `CTTP_RouteHandler` function pointer.
+ * Multiple methods can be separated with `,`, as in `GET,POST`; unknown methods are ignored. Registering other
+ * methods for an existing path keeps its handlers for the previous ones. A `GET` handler also answers `HEAD`
+ * requests, unless a `HEAD` handler is registered. The handler should be a `CTTP_RouteHandler` function pointer.
+ * A segment `:name` matches any single path segment and a final segment `*name` matches the rest of the path;
+ * both are captured as path parameters. Static segments take priority over parameters, and parameters over
+ * catch-alls. Parameters at the same position must share the same name, otherwise the route is ignored.
  */
 void CTTP_add_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h);
 
 /**
- * Retrieve a route from server `cs` using path `p` and method `m`.
- * Returns `NULL` if the route isn't found.
+ * Add a route to server `cs` as `CTTP_add_async_route` does, whose handler runs as soon as the request head has
+ * arrived and reads the body itself with `CTTP_read_request_body`. Such bodies never have to fit in memory, so they
+ * are not limited by `bsize` or `rsize`. The handler is suspended while it waits for the client, so a slow upload
+ * does not hold the worker; buffers it keeps on its stack must fit in `CTTP_Server.stack_size`.
+ * A connection whose body is not read entirely is closed after the response.
+ */
+void CTTP_add_stream_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h);
+
+/**
+ * Add a route to server `cs` as `CTTP_add_route` does, whose handler runs on a coroutine of its own. Instead of
+ * blocking the worker, the handler can then wait for a descriptor or a timer with `CTTP_wait_fd` and `CTTP_sleep`,
+ * and the worker serves other connections in the meantime. Streamed bodies and responses wait the same way.
+ * The handler's stack holds `CTTP_Server.stack_size` bytes.
+ */
+void CTTP_add_async_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h);
+
+/**
+ * Waits up to `timeout` ms (forever if negative) for descriptor `fd` to be ready for `poll` events `events`, such as
+ * `POLLIN` or `POLLOUT`. Handlers of async routes are suspended meanwhile; anywhere else the thread blocks.
+ * Returns the `poll` events that occurred, 0 on timeout and -1 if an error occurs.
+ */
+int CTTP_wait_fd(int fd, int events, int timeout);
+
+/**
+ * Waits `ms` milliseconds, suspending the handler of an async route or blocking the thread anywhere else.
+ */
+void CTTP_sleep(int ms);
+
+/**
+ * Add a route to server `cs` as `CTTP_add_async_route` does, whose GET responses are kept in memory and reused for
+ * HEAD and GET requests during their `Cache-Control` `max-age`, or `ttl` milliseconds if they have none. Responses
+ * are told apart by path, query parameters in any order and the request headers their `Vary` names. Responses
+ * marked `no-store`, `no-cache` or `private`, setting cookies or streamed are not stored, and requests carrying
+ * `Authorization` or `Cache-Control: no-cache` skip the cache. Concurrent requests for a response not stored yet
+ * wait for the first one instead of running handler `h` as well.
+ */
+void CTTP_add_cached_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h, int ttl);
+
+/**
+ * How proxy routes spread their requests across upstreams. Each worker balances the requests it serves.
+ */
+enum CTTP_BALANCE
+{
+    CTTP_BALANCE_ROUND_ROBIN = 0,   /* Every upstream in turn */
+    CTTP_BALANCE_LEAST_CONNECTIONS, /* The upstream with the fewest requests in flight from the worker */
+};
+
+/**
+ * Add a route to server `cs` with method `m` and path `p` that forwards its requests to one of the `upstreams`, a
+ * `NULL`-terminated list of `host:port` addresses resolved once, here, picked as `CTTP_BALANCE` `balance` says. E.g.:
+ * >    const char *upstreams[] = {"10.0.0.1:8080", "10.0.0.2:8080", NULL};
+ * >    CTTP_add_proxy_route(&cs, "GET,POST", "/users/:id", upstreams, CTTP_BALANCE_LEAST_CONNECTIONS);
+ * The request target and headers are forwarded as received, except the hop-by-hop ones. Each worker keeps its
+ * connections to the upstreams open for the next requests, and the response is streamed back as it arrives.
+ * Unreachable upstreams are answered with 502 and the ones that do not answer in time with 504. Requests wait on the
+ * upstream as handlers of `CTTP_add_async_route` do, so the worker serves other connections in the meantime.
+ */
+void CTTP_add_proxy_route(CTTP_Server *cs, char *m, char *p, const char *const *upstreams, int balance);
+
+/**
+ * Serve the files of directory `dir` under path prefix `p` of server `cs`, as in `CTTP_add_static_route(cs, "/assets/", "./public")`.
+ * Files are sent with `sendfile` along with their `Content-Type` and `Last-Modified` headers, and requests for a
+ * directory get its `index.html`. Paths with `..` segments are rejected.
+ */
+void CTTP_add_static_route(CTTP_Server *cs, const char *p, const char *dir);
+
+/**
+ * Add a route to server `cs` with method `m` and path `p` that always answers with status `STATUS`, the `headers`
+ * given as a `NULL`-terminated list of key and value pairs, and body `b` of `bsize` bytes. The response is serialized
+ * once, so serving it costs a single write. E.g.:
+ * >    const char *headers[] = {"Content-Type", "application/json", NULL};
+ * >    CTTP_add_constant_route(&cs, "GET", "/health", CTTP_STATUS_OK, headers, "{\"ok\": true}", 12);
+ */
+void CTTP_add_constant_route(CTTP_Server *cs, char *m, char *p, const char *STATUS, const char *const *headers, const char *b, size_t bsize);
+
+/**
+ * Retrieve a route from server `cs` using path `p` and method `m`. Returns `CTTP_ERROR_ROUTE_NOT_FOUND` if
+ * no route matches the path and `CTTP_ERROR_METHOD_NOT_ALLOWED` if it has no handler for the method,
+ * in which case `r` is still set to the route.
+ */
+int CTTP_read_route(CTTP_Server *cs, CTTP_RouteNode **r, const char *p, const char *m);
+
+/**
+ * Serve the metrics of server `cs` under path `p` in the Prometheus text format, as in `CTTP_add_metrics_route(&cs, "/metrics")`.
+ * Also sets `cs->metrics`.
  */
-int CTTP_read_route(CTTP_Server *cs, CTTP_RouteNode **r, char *p, char *m);
+void CTTP_add_metrics_route(CTTP_Server *cs, const char *p);
 
 /**
  * Start the CTTP server. This enters an infinite loop to process requests.
@@ -221,4 +682,74 @@ int CTTP_read_route(CTTP_Server *cs, CTTP_RouteNode **r, char *p, char *m);
 int CTTP_start_server(CTTP_Server *cs);
 
 
+// <------------------------>
+//       CTTP_Metrics
+// <------------------------>
+
+/* Buckets of a latency histogram: 8 per power of two microseconds, up to 2^27 us (about 134s) */
+#define CTTP_HISTOGRAM_BUCKETS 200
+
+/**
+ * Latency histogram in microseconds. As in HDR histograms, buckets double in width every 8 buckets, so every
+ * latency is known within 12.5%: bucket `i < 8` counts latencies of `i` us, and bucket `8 + 8 * e + s` those
+ * from `(8 + s) << e` us up to `(9 + s) << e` us. Longer latencies are counted in the last bucket.
+ */
+typedef struct
+{
+    unsigned long long count;
+    unsigned long long sum; /* Sum of the latencies, in microseconds */
+    unsigned long long buckets[CTTP_HISTOGRAM_BUCKETS];
+}
+CTTP_Histogram;
+
+/**
+ * Metrics of a single route.
+ */
+typedef struct
+{
+    const char        *path;        /* Route as added, such as `/users/:id`. Empty for requests matching no route */
+    unsigned long long requests[5]; /* Requests answered, by status class: `requests[0]` counts 1xx responses, up to 5xx */
+    CTTP_Histogram     latency;     /* Time from the first byte of a request to the last byte of its response */
+}
+CTTP_RouteMetrics;
+
+/**
+ * Snapshot of the metrics of a running server, summed over its workers.
+ */
+typedef struct
+{
+    unsigned long long requests;      /* Requests answered */
+    unsigned long long bytes_in;      /* Bytes received */
+    unsigned long long bytes_out;     /* Bytes sent */
+    unsigned long long connections;   /* Connections accepted */
+    unsigned long long active;        /* Connections open */
+    unsigned long long accept_errors; /* Failures to accept or set up a connection */
+    unsigned long long log_dropped;   /* Access log records dropped because the log thread fell behind */
+    unsigned long long cache_hits;    /* Requests of cached routes answered from the cache */
+    unsigned long long cache_misses;  /* Requests of cached routes that ran the handler */
+    CTTP_Histogram     parse;         /* Time spent parsing each request */
+    CTTP_Histogram     handler;       /* Time spent in route handlers, streamed bodies included */
+    CTTP_Histogram     send;          /* Time from a response being ready to it being fully sent */
+    CTTP_RouteMetrics *routes;        /* Metrics of each route, requests matching no route first */
+    size_t             nroutes;       /* Number of `routes` */
+}
+CTTP_Metrics;
+
+/**
+ * Takes a snapshot of the metrics of server `cs`, which must be running with `cs->metrics` set.
+ * Route paths stay valid while the server runs. Returns `NULL` if an error occurs; free it with `CTTP_free_metrics`.
+ */
+CTTP_Metrics *CTTP_read_metrics(CTTP_Server *cs);
+
+/**
+ * Frees snapshot `m` taken by `CTTP_read_metrics`.
+ */
+void CTTP_free_metrics(CTTP_Metrics *m);
+
+/**
+ * Returns the latency below which fraction `q` (from 0 to 1) of the latencies of histogram `h` fall, in microseconds.
+ * The value is the upper bound of the bucket holding it, so it overestimates by at most 12.5%. Returns 0 if `h` is empty.
+ */
+double CTTP_histogram_percentile(const CTTP_Histogram *h, double q);
+
 #endif
@@ -0,0 +1,344 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+__thread INCTTP_LogRing *INCTTP_worker_log = NULL;
+
+/* Longest line a record formats to: every field escaped to 6 bytes per byte (`\u00HH` in JSON), plus the fixed parts */
+#define LINE_MAX_SIZE (6 * (INCTTP_LOG_TARGET_SIZE + 2 * INCTTP_LOG_FIELD_SIZE + sizeof(((INCTTP_LogRecord *)0)->method)) + 512)
+
+static const char *const MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// <------------------------>
+//          Workers
+// <------------------------>
+
+/**
+ * Copies up to `cap` bytes of `s` to `dst` and returns how many were copied.
+ */
+static unsigned short copy_field(char *dst, size_t cap, const char *s, size_t len)
+{
+    if (s == NULL) return 0;
+    if (len > cap) len = cap;
+
+    memcpy(dst, s, len);
+    return (unsigned short)len;
+}
+
+void INCTTP_fill_log_record(INCTTP_LogRecord *rec, const CTTP_Request *r, const struct sockaddr_in *peer)
+{
+    rec->addr = peer != NULL ? peer->sin_addr.s_addr : 0;
+    rec->version = -1;
+    rec->method[0] = '\0';
+    rec->target_len = rec->referer_len = rec->agent_len = 0;
+    if (r == NULL) return;
+
+    rec->version = r->version;
+    size_t mlen = copy_field(rec->method, sizeof(rec->method) - 1, r->method_name.ptr, r->method_name.len);
+    rec->method[mlen] = '\0';
+
+    rec->target_len = copy_field(rec->target, INCTTP_LOG_TARGET_SIZE, r->uri.ptr, r->uri.len);
+    if (r->query.len > 0 && rec->target_len < INCTTP_LOG_TARGET_SIZE)
+    {
+        rec->target[rec->target_len++] = '?';
+        size_t from = rec->target_len;
+        rec->target_len += copy_field(rec->target + from, INCTTP_LOG_TARGET_SIZE - from, r->query.ptr, r->query.len);
+
+        // Parsing split the parameters in place, so their `&` separators are put back.
+        for (size_t i = from; i < rec->target_len; i++)
+        {
+            if (rec->target[i] == '\0') rec->target[i] = '&';
+        }
+    }
+
+    const char *referer = CTTP_read_request_header_id((CTTP_Request *)r, CTTP_HEADER_REFERER);
+    if (referer != NULL) rec->referer_len = copy_field(rec->referer, INCTTP_LOG_FIELD_SIZE, referer, strlen(referer));
+
+    const char *agent = CTTP_read_request_header_id((CTTP_Request *)r, CTTP_HEADER_USER_AGENT);
+    if (agent != NULL) rec->agent_len = copy_field(rec->agent, INCTTP_LOG_FIELD_SIZE, agent, strlen(agent));
+}
+
+void INCTTP_log_request(CTTP_Server *cs, INCTTP_LogRecord *rec, const INCTTP_Response *res, long long started)
+{
+    INCTTP_LogRing *ring = INCTTP_worker_log;
+    if (ring == NULL || cs->logger->level < 1) return;
+    if (cs->logger->level < 2 && res->status < 400) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    rec->duration = started > 0 ? (INCTTP_now_ns() - started) / 1000 : 0;
+    rec->status = res->status;
+    rec->bytes = res->bytes;
+
+    // Only this thread writes `head`; the log thread frees slots by advancing `tail`.
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == INCTTP_LOG_RING_SIZE)
+    {
+        INCTTP_count(&ring->dropped, 1);
+        return;
+    }
+
+    ring->records[head & (INCTTP_LOG_RING_SIZE - 1)] = *rec;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// <------------------------>
+//        Log thread
+// <------------------------>
+
+/**
+ * Appends the `len` bytes of `s` to `out`, escaping quotes, backslashes and bytes that are not printable ASCII as
+ * `\xHH`. For JSON, they are escaped as `\uHHHH` instead, and bytes above 0x7f too so that the line stays valid UTF-8.
+ * Returns the number of bytes appended.
+ */
+static size_t escape(char *out, const char *s, size_t len, int json)
+{
+    static const char HEX[] = "0123456789abcdef";
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char ch = (unsigned char)s[i];
+        if (ch >= 0x20 && ch < 0x7f && ch != '"' && ch != '\\')
+        {
+            out[n++] = (char)ch;
+        }
+        else if (json && (ch == '"' || ch == '\\'))
+        {
+            out[n++] = '\\';
+            out[n++] = (char)ch;
+        }
+        else if (json)
+        {
+            memcpy(out + n, "\\u00", 4);
+            out[n + 4] = HEX[ch >> 4];
+            out[n + 5] = HEX[ch & 15];
+            n += 6;
+        }
+        else
+        {
+            out[n++] = '\\';
+            out[n++] = 'x';
+            out[n++] = HEX[ch >> 4];
+            out[n++] = HEX[ch & 15];
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Appends `s`, quoted and escaped, or `-` if it is empty, as the Common Log Format does.
+ */
+static size_t quoted(char *out, const char *s, size_t len)
+{
+    if (len == 0) return (size_t)sprintf(out, "\"-\"");
+
+    out[0] = '"';
+    size_t n = 1 + escape(out + 1, s, len, 0);
+    out[n++] = '"';
+    return n;
+}
+
+/**
+ * Formats record `rec` as a line of `format` into `out`, which holds at least `LINE_MAX_SIZE` bytes.
+ * Returns the length of the line.
+ */
+static size_t format_record(char *out, const INCTTP_LogRecord *rec, int format)
+{
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in = {.s_addr = rec->addr};
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+    time_t sec = (time_t)(rec->time / 1000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+
+    const char *version = rec->version == CTTP_VERSION_1_0 ? "HTTP/1.0" : "HTTP/1.1";
+    size_t n;
+
+    if (format == CTTP_LOG_JSON)
+    {
+        n = (size_t)sprintf(out, "{\"time\": \"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\", \"remote_addr\": \"%s\", \"method\": \"",
+                            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                            (int)(rec->time % 1000), addr);
+        n += escape(out + n, rec->method, strlen(rec->method), 1);
+        n += (size_t)sprintf(out + n, "\", \"target\": \"");
+        n += escape(out + n, rec->target, rec->target_len, 1);
+        n += (size_t)sprintf(out + n, "\", \"protocol\": \"%s\", \"status\": %d, \"bytes\": %zu, \"duration_us\": %lld, \"referer\": \"",
+                             rec->version < 0 ? "" : version, rec->status, rec->bytes, rec->duration);
+        n += escape(out + n, rec->referer, rec->referer_len, 1);
+        n += (size_t)sprintf(out + n, "\", \"user_agent\": \"");
+        n += escape(out + n, rec->agent, rec->agent_len, 1);
+        n += (size_t)sprintf(out + n, "\"}\n");
+        return n;
+    }
+
+    n = (size_t)sprintf(out, "%s - - [%02d/%s/%04d:%02d:%02d:%02d +0000] ", addr, tm.tm_mday, MONTHS[tm.tm_mon],
+                        tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    // Requests rejected before their request line was parsed have none to show.
+    if (rec->version < 0) n += (size_t)sprintf(out + n, "\"-\"");
+    else
+    {
+        out[n++] = '"';
+        n += escape(out + n, rec->method, strlen(rec->method), 0);
+        out[n++] = ' ';
+        n += escape(out + n, rec->target, rec->target_len, 0);
+        n += (size_t)sprintf(out + n, " %s\"", version);
+    }
+
+    if (rec->bytes > 0) n += (size_t)sprintf(out + n, " %d %zu", rec->status, rec->bytes);
+    else n += (size_t)sprintf(out + n, " %d -", rec->status);
+
+    if (format == CTTP_LOG_COMBINED)
+    {
+        out[n++] = ' ';
+        n += quoted(out + n, rec->referer, rec->referer_len);
+        out[n++] = ' ';
+        n += quoted(out + n, rec->agent, rec->agent_len);
+    }
+
+    out[n++] = '\n';
+    return n;
+}
+
+/**
+ * Writes the `len` bytes of `buf` to `fd`. Lines that cannot be written are lost: the log never blocks the server.
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * Body of the log thread: formats the records of every ring into a buffer written with a single `write` whenever it
+ * fills up or the rings are drained, then sleeps for `INCTTP_LOG_INTERVAL` once there is nothing left.
+ */
+static void *run_logger(void *arg)
+{
+    INCTTP_Logger *lg = (INCTTP_Logger *)arg;
+
+    char *out = (char *)malloc(INCTTP_LOG_BUFFER_SIZE);
+    if (out == NULL) return NULL;
+    size_t len = 0;
+
+    while (1)
+    {
+        // Read before draining, so that records pushed before the stop request are still written.
+        int stop = __atomic_load_n(&lg->stop, __ATOMIC_ACQUIRE);
+        size_t formatted = 0;
+
+        for (size_t i = 0; i < lg->nrings; i++)
+        {
+            INCTTP_LogRing *ring = lg->rings[i];
+            size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            size_t tail = ring->tail;
+
+            for (; tail != head; tail++)
+            {
+                if (len + LINE_MAX_SIZE > INCTTP_LOG_BUFFER_SIZE)
+                {
+                    write_all(lg->fd, out, len);
+                    len = 0;
+                }
+
+                len += format_record(out + len, &ring->records[tail & (INCTTP_LOG_RING_SIZE - 1)], lg->format);
+                formatted++;
+            }
+
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        if (len > 0)
+        {
+            write_all(lg->fd, out, len);
+            len = 0;
+        }
+
+        if (formatted > 0) continue;
+        if (stop) break;
+
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = INCTTP_LOG_INTERVAL * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+
+    free(out);
+    return NULL;
+}
+
+int INCTTP_start_logger(CTTP_Server *cs, size_t workers)
+{
+    INCTTP_Logger *lg = (INCTTP_Logger *)calloc(1, sizeof(INCTTP_Logger));
+    if (lg == NULL) return 0;
+
+    lg->fd = cs->access_log;
+    lg->format = cs->log_format;
+    lg->level = cs->log_level;
+
+    lg->rings = (INCTTP_LogRing **)calloc(workers, sizeof(INCTTP_LogRing *));
+    if (lg->rings == NULL)
+    {
+        free(lg);
+        return 0;
+    }
+
+    for (; lg->nrings < workers; lg->nrings++)
+    {
+        // Rings are cache-line aligned so that `tail` does not share a line with another ring's `head`.
+        void *ring = NULL;
+        if (posix_memalign(&ring, 64, sizeof(INCTTP_LogRing)) != 0) break;
+
+        memset(ring, 0, offsetof(INCTTP_LogRing, records));
+        lg->rings[lg->nrings] = (INCTTP_LogRing *)ring;
+    }
+
+    if (lg->nrings < workers || pthread_create(&lg->thread, NULL, run_logger, lg) != 0)
+    {
+        for (size_t i = 0; i < lg->nrings; i++)
+        {
+            free(lg->rings[i]);
+        }
+        free(lg->rings);
+        free(lg);
+        return 0;
+    }
+
+    cs->logger = lg;
+    return 1;
+}
+
+void INCTTP_stop_logger(CTTP_Server *cs)
+{
+    INCTTP_Logger *lg = cs->logger;
+    if (lg == NULL) return;
+
+    __atomic_store_n(&lg->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(lg->thread, NULL);
+
+    for (size_t i = 0; i < lg->nrings; i++)
+    {
+        free(lg->rings[i]);
+    }
+
+    free(lg->rings);
+    free(lg);
+    cs->logger = NULL;
+}
@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+/**
+ * State of a single worker's event loop.
+ */
+typedef struct
+{
+    CTTP_Server       *cs;
+    int                epfd;
+    int                server_fd;
+    INCTTP_TimerWheel  timeouts; /* Timeouts of the connections */
+    INCTTP_TimerWheel  waits;    /* Timeouts of the waits of suspended handlers */
+}
+EventLoop;
+
+void INCTTP_time_connection(CTTP_Server *cs, INCTTP_TimerWheel *w, INCTTP_Connection *c, int progress)
+{
+    int timeout = INCTTP_TIMEOUT_NONE;
+    if (c->state == INCTTP_CONNECTION_WRITING) timeout = INCTTP_TIMEOUT_WRITE;
+    else if (c->state == INCTTP_CONNECTION_READING)
+    {
+        if (c->parser.body_off > 0) timeout = INCTTP_TIMEOUT_BODY;
+        else if (c->rlen == 0 && c->requests > 0) timeout = INCTTP_TIMEOUT_IDLE;
+        else timeout = INCTTP_TIMEOUT_HEADER;
+    }
+
+    // A client trickling a head byte by byte must not push its deadline back, so only bodies and responses
+    // restart their timer as they move.
+    int restart = progress && (timeout == INCTTP_TIMEOUT_BODY || timeout == INCTTP_TIMEOUT_WRITE);
+    if (timeout == c->timeout && !restart) return;
+
+    int ms = 0;
+    switch (timeout)
+    {
+    case INCTTP_TIMEOUT_IDLE:   ms = cs->keepalive_timeout; break;
+    case INCTTP_TIMEOUT_HEADER: ms = cs->header_timeout; break;
+    case INCTTP_TIMEOUT_BODY:   ms = cs->body_timeout; break;
+    case INCTTP_TIMEOUT_WRITE:  ms = cs->write_timeout; break;
+    }
+
+    c->timeout = timeout;
+    if (ms > 0) INCTTP_set_timer(w, &c->timer, w->now + ms);
+    else INCTTP_cancel_timer(w, &c->timer);
+}
+
+INCTTP_Connection *INCTTP_new_connection(int fd, const struct sockaddr_in *peer)
+{
+    INCTTP_Connection *c = (INCTTP_Connection *)calloc(1, sizeof(INCTTP_Connection));
+    if (c == NULL) return NULL;
+
+    c->rbuf = (char *)malloc(INCTTP_RBUF_INITIAL_SIZE);
+    if (c->rbuf == NULL)
+    {
+        free(c);
+        return NULL;
+    }
+
+    c->fd = fd;
+    c->peer = *peer;
+    c->state = INCTTP_CONNECTION_READING;
+    c->rcap = INCTTP_RBUF_INITIAL_SIZE;
+    INCTTP_init_parser(&c->parser);
+    INCTTP_init_arena(&c->arena);
+
+    return c;
+}
+
+void INCTTP_free_connection(INCTTP_Connection *c)
+{
+    if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->closed, 1);
+
+    INCTTP_free_response(&c->response);
+    INCTTP_free_arena(&c->arena);
+    free(c->rbuf);
+    free(c);
+}
+
+static void close_connection(EventLoop *loop, INCTTP_Connection *c)
+{
+    INCTTP_cancel_timer(&loop->timeouts, &c->timer);
+
+    // Closing the descriptor also removes it from the epoll interest list.
+    close(c->fd);
+    INCTTP_free_connection(c);
+}
+
+/**
+ * Accepts every pending connection on the listening socket. With edge-triggered notifications the
+ * accept queue must be drained until `EAGAIN`, otherwise pending clients would never be reported again.
+ */
+static void accept_connections(EventLoop *loop)
+{
+    INCTTP_WorkerMetrics *m = INCTTP_worker_metrics;
+
+    while (1)
+    {
+        struct sockaddr_in peer = {};
+        socklen_t len = sizeof(peer);
+        int connfd = accept4(loop->server_fd, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN means the queue is drained. Anything else (e.g. EMFILE) is retried on the next edge.
+            if (m != NULL && errno != EAGAIN && errno != EWOULDBLOCK) INCTTP_count(&m->accept_errors, 1);
+            return;
+        }
+
+        INCTTP_Connection *c = INCTTP_new_connection(connfd, &peer);
+        if (c == NULL)
+        {
+            if (m != NULL) INCTTP_count(&m->accept_errors, 1);
+            close(connfd);
+            continue;
+        }
+        if (m != NULL) INCTTP_count(&m->accepted, 1);
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+        {
+            close_connection(loop, c);
+            continue;
+        }
+
+        INCTTP_time_connection(loop->cs, &loop->timeouts, c, 0);
+    }
+}
+
+/**
+ * Drains the socket into the receive buffer, growing it up to `cs->rsize`.
+ * Returns 0 if the peer has stopped sending or an error occurs, 1 otherwise.
+ */
+static int receive(CTTP_Server *cs, INCTTP_Connection *c)
+{
+    while (1)
+    {
+        if (c->rlen == c->rcap)
+        {
+            // Stop reading once the request limit is hit; the request is then rejected as too large.
+            if (c->rcap >= cs->rsize) return 1;
+
+            size_t cap = c->rcap * 2 < cs->rsize ? c->rcap * 2 : cs->rsize;
+            char *rbuf = (char *)realloc(c->rbuf, cap);
+            if (rbuf == NULL) return 0;
+
+            c->rbuf = rbuf;
+            c->rcap = cap;
+        }
+
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+        if (n == 0) return 0;
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return 0;
+        }
+
+        c->rlen += (size_t)n;
+        if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->bytes_in, (unsigned long long)n);
+    }
+}
+
+int INCTTP_parse_connection(CTTP_Server *cs, INCTTP_Connection *c)
+{
+    // The parser resumes where it stopped, so buffered bytes are only scanned once.
+    long long start = INCTTP_worker_metrics != NULL || INCTTP_worker_log != NULL ? INCTTP_now_ns() : 0;
+    int result = INCTTP_parse_request(&c->parser, c->rbuf, c->rlen, cs);
+    if (c->rlen > 0)
+    {
+        // A request starts with the first parse of its bytes, not when the connection becomes idle.
+        if (c->started == 0) c->started = start;
+        if (INCTTP_worker_metrics != NULL) c->parse_ns += INCTTP_now_ns() - start;
+    }
+
+    // A request that does not fit in `cs->rsize` is rejected.
+    if (result == INCTTP_PARSE_INCOMPLETE && c->rlen >= cs->rsize) return CTTP_ERROR_CONTENT_TOO_LARGE;
+    return result;
+}
+
+/**
+ * Answers the request of connection `c`, or rejects its input, as `INCTTP_serve_connection` does. Runs on the
+ * connection's coroutine when the handler may wait, so the request and its body reader live on that stack.
+ */
+static int serve(CTTP_Server *cs, INCTTP_Connection *c, int result)
+{
+    if (result == INCTTP_PARSE_COMPLETE)
+    {
+        CTTP_Request request;
+        memset(&request, 0, sizeof(CTTP_Request));
+
+        long long start = INCTTP_worker_metrics != NULL ? INCTTP_now_ns() : 0;
+        result = INCTTP_fill_request(&c->parser, c->rbuf, &request, &c->arena, cs);
+        if (INCTTP_worker_metrics != NULL) c->parse_ns += INCTTP_now_ns() - start;
+        if (result > 0)
+        {
+            INCTTP_BodyReader reader;
+            if (c->parser.stream_body)
+            {
+                INCTTP_init_body_reader(&reader, &c->parser, &request, c->fd, c->rbuf, c->rlen, c->rcap, cs->body_timeout);
+            }
+
+            c->keep_alive = cs->keepalive_timeout > 0 && !c->eof
+                            && (cs->keepalive_requests == 0 || c->requests + 1 < cs->keepalive_requests);
+            int served = INCTTP_serve_request(cs, c->fd, &request, &c->arena, &c->response, &c->keep_alive);
+            c->consumed = c->parser.pos;
+
+            // The handler read its body through the receive buffer, refilling it past the head.
+            if (request.reader != NULL)
+            {
+                c->rlen = reader.len;
+                c->consumed = reader.pos;
+            }
+            if (INCTTP_worker_log != NULL) INCTTP_fill_log_record(&c->log, &request, &c->peer);
+            if (served == 0) return 0;
+        }
+    }
+
+    if (result < 1)
+    {
+        // The rest of the input cannot be trusted once a request is rejected, so the connection is closed.
+        // Whatever the failed attempt allocated is dropped before writing the error response.
+        INCTTP_arena_reset(&c->arena);
+        if (INCTTP_serve_error(result, &c->arena, &c->response) == 0) return 0;
+        if (INCTTP_worker_log != NULL) INCTTP_fill_log_record(&c->log, NULL, &c->peer);
+        c->keep_alive = 0;
+        c->consumed = c->rlen;
+    }
+
+    c->state = INCTTP_CONNECTION_WRITING;
+    if (INCTTP_worker_metrics != NULL) c->sending = INCTTP_now_ns();
+    return 1;
+}
+
+static int run_handler(CTTP_Server *cs, INCTTP_Connection *c)
+{
+    return serve(cs, c, INCTTP_PARSE_COMPLETE);
+}
+
+/**
+ * Picks up after the coroutine of connection `c` stopped: leaves the connection suspended while its handler waits,
+ * otherwise returns the coroutine to the pool and what the handler's `serve` returned.
+ */
+static int settle(INCTTP_Connection *c, int done)
+{
+    if (!done)
+    {
+        c->state = INCTTP_CONNECTION_SUSPENDED;
+        return 1;
+    }
+
+    int served = c->co->result;
+    INCTTP_free_coroutine(c->co);
+    c->co = NULL;
+    return served;
+}
+
+int INCTTP_serve_connection(CTTP_Server *cs, INCTTP_Connection *c, int result)
+{
+    // Handlers that may wait run on a coroutine, so that the loop serves other connections while they do. Other
+    // handlers keep running on the loop's stack. Routes streaming their body are async, so a body the parser left
+    // to the handler needs no second lookup.
+    if (result == INCTTP_PARSE_COMPLETE && cs->async
+        && (c->parser.stream_body
+            || INCTTP_route_suspends(cs, INCTTP_parse_method(c->rbuf + c->parser.start, c->parser.method_len),
+                                     c->rbuf + c->parser.uri_off, c->parser.path_len)))
+    {
+        // Without a stack to spare, the handler runs on the loop's stack and its waits block the worker.
+        c->co = INCTTP_new_coroutine(cs->stack_size, run_handler, cs, c);
+        if (c->co == NULL) return serve(cs, c, result);
+
+        return settle(c, INCTTP_resume_coroutine(c->co, 0));
+    }
+
+    return serve(cs, c, result);
+}
+
+int INCTTP_resume_connection(INCTTP_Connection *c, int revents)
+{
+    return settle(c, INCTTP_resume_coroutine(c->co, revents));
+}
+
+void INCTTP_complete_response(CTTP_Server *cs, INCTTP_Connection *c)
+{
+    if (INCTTP_worker_metrics != NULL) INCTTP_record_request(INCTTP_worker_metrics, &c->response, c->started, c->parse_ns, c->sending);
+    if (INCTTP_worker_log != NULL) INCTTP_log_request(cs, &c->log, &c->response, c->started);
+}
+
+void INCTTP_finish_request(INCTTP_Connection *c)
+{
+    memmove(c->rbuf, c->rbuf + c->consumed, c->rlen - c->consumed);
+    c->rlen -= c->consumed;
+    c->consumed = 0;
+    INCTTP_init_parser(&c->parser);
+    INCTTP_free_response(&c->response);
+    INCTTP_arena_reset(&c->arena);
+
+    c->requests++;
+    c->started = 0;
+    c->parse_ns = 0;
+    c->state = INCTTP_CONNECTION_READING;
+}
+
+/**
+ * Registers the wait of the handler of suspended connection `c`. Returns 1 once the loop watches it, or 0 if it is
+ * over already, with its outcome stored in `revents`.
+ */
+static int arm_wait(EventLoop *loop, INCTTP_Connection *c, int *revents)
+{
+    INCTTP_Coroutine *co = c->co;
+    if (co->deadline >= 0) INCTTP_set_timer(&loop->waits, &co->timer, co->deadline);
+
+    // The connection's own events already come through its registration; other descriptors are tagged by setting
+    // the lowest bit of the connection pointer, which alignment leaves clear.
+    if (co->fd < 0 || co->fd == c->fd) return 1;
+
+    struct epoll_event ev = {};
+    ev.events = (unsigned int)co->events;
+    ev.data.ptr = (char *)c + 1;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, co->fd, &ev) == 0) return 1;
+
+    // Regular files cannot be watched, and are always ready.
+    INCTTP_cancel_timer(&loop->waits, &co->timer);
+    *revents = errno == EPERM ? co->events : -1;
+    return 0;
+}
+
+/**
+ * Returns the bytes of response `res` left to send.
+ */
+static size_t unsent(const INCTTP_Response *res)
+{
+    size_t left = res->fleft;
+    for (size_t i = res->first; i < res->count; i++) left += res->iov[i].iov_len;
+    return left;
+}
+
+/**
+ * Moves connection `c` forward as far as possible without blocking: flushes the pending response,
+ * then answers buffered (possibly pipelined) requests in order, reading more input when needed.
+ * Once it has to wait, arms its timeout for what it waits for. Returns 0 if the connection must be closed,
+ * 1 otherwise.
+ */
+static int drive(EventLoop *loop, INCTTP_Connection *c)
+{
+    CTTP_Server *cs = loop->cs;
+    int progress = 0;
+
+    while (1)
+    {
+        if (c->state == INCTTP_CONNECTION_SUSPENDED)
+        {
+            int revents;
+            if (arm_wait(loop, c, &revents)) break;
+            if (INCTTP_resume_connection(c, revents) == 0) return 0;
+            continue;
+        }
+
+        if (c->state == INCTTP_CONNECTION_WRITING)
+        {
+            size_t before = unsent(&c->response);
+            int flushed = INCTTP_send_response(c->fd, &c->response);
+            if (flushed < 0) return 0;
+            if (flushed == 0)
+            {
+                progress |= unsent(&c->response) < before;
+                break;
+            }
+
+            INCTTP_complete_response(cs, c);
+            if (!c->keep_alive) return 0;
+
+            INCTTP_finish_request(c);
+            progress = 1;
+        }
+
+        int result = INCTTP_parse_connection(cs, c);
+        if (result == INCTTP_PARSE_INCOMPLETE)
+        {
+            if (c->eof) return 0;
+
+            size_t before = c->rlen;
+            if (receive(cs, c) == 0) c->eof = 1;
+
+            // Nothing new arrived: wait for the next edge (or close if the peer is gone).
+            if (c->rlen == before)
+            {
+                if (c->eof) return 0;
+                break;
+            }
+            progress = 1;
+            continue;
+        }
+
+        if (INCTTP_serve_connection(cs, c, result) == 0) return 0;
+    }
+
+    INCTTP_time_connection(cs, &loop->timeouts, c, progress);
+    return 1;
+}
+
+/**
+ * Ends the wait of the handler of suspended connection `c` with outcome `revents`, and carries on with the
+ * connection. Returns 0 if the connection must be closed, 1 otherwise.
+ */
+static int wake(EventLoop *loop, INCTTP_Connection *c, int revents)
+{
+    INCTTP_Coroutine *co = c->co;
+    if (co->fd >= 0 && co->fd != c->fd) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, co->fd, NULL);
+    INCTTP_cancel_timer(&loop->waits, &co->timer);
+
+    return INCTTP_resume_connection(c, revents) && drive(loop, c);
+}
+
+/**
+ * Closes connection `c`, just woken, and clears the events of batch `events` from `from` to `n` that point to it:
+ * while its handler waited, both its socket and the descriptor waited for could be reported.
+ */
+static void close_woken(EventLoop *loop, INCTTP_Connection *c, struct epoll_event *events, int from, int n)
+{
+    for (int i = from; i < n; i++)
+    {
+        if (events[i].data.ptr == c || events[i].data.ptr == (char *)c + 1) events[i].events = 0;
+    }
+
+    close_connection(loop, c);
+}
+
+/**
+ * Closes the connections that waited too long for their client, and resumes the handlers whose wait timed out.
+ */
+static void expire(EventLoop *loop)
+{
+    INCTTP_Timer *t;
+    while ((t = INCTTP_pop_expired(&loop->timeouts)) != NULL)
+    {
+        close_connection(loop, INCTTP_OWNER(t, INCTTP_Connection, timer));
+    }
+
+    while ((t = INCTTP_pop_expired(&loop->waits)) != NULL)
+    {
+        // The coroutine may be freed once its handler returns, so its connection is read first.
+        INCTTP_Connection *c = INCTTP_OWNER(t, INCTTP_Coroutine, timer)->conn;
+        if (wake(loop, c, 0) == 0) close_connection(loop, c);
+    }
+}
+
+int INCTTP_run_event_loop(INCTTP_Worker *wk)
+{
+    EventLoop loop = {};
+    loop.cs = wk->cs;
+    loop.server_fd = wk->server_fd;
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) return CTTP_ERROR_SERVER_EVENT_LOOP;
+
+    // The listener is identified by a NULL `data.ptr`; every other event belongs to a connection.
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.server_fd, &ev) < 0)
+    {
+        close(loop.epfd);
+        return CTTP_ERROR_SERVER_EVENT_LOOP;
+    }
+
+    INCTTP_init_wheel(&loop.timeouts, INCTTP_now_ns() / 1000000);
+    INCTTP_init_wheel(&loop.waits, loop.timeouts.now);
+
+    struct epoll_event events[INCTTP_EVENT_BATCH];
+    while (1)
+    {
+        expire(&loop);
+        int timeout = INCTTP_next_expiry(&loop.waits, INCTTP_next_expiry(&loop.timeouts, -1));
+
+        int n = epoll_wait(loop.epfd, events, INCTTP_EVENT_BATCH, timeout);
+
+        // Timeouts armed while the batch is handled count from the time it arrived.
+        long long now = INCTTP_now_ns() / 1000000;
+        INCTTP_advance_wheel(&loop.timeouts, now);
+        INCTTP_advance_wheel(&loop.waits, now);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            // Events of connections closed earlier in the batch are cleared. epoll never reports an empty event.
+            if (events[i].events == 0) continue;
+
+            INCTTP_Connection *c = (INCTTP_Connection *)events[i].data.ptr;
+            if (c == NULL)
+            {
+                accept_connections(&loop);
+                continue;
+            }
+
+            // A descriptor a handler waits for.
+            if ((uintptr_t)c & 1)
+            {
+                c = (INCTTP_Connection *)((char *)c - 1);
+                if (wake(&loop, c, (int)events[i].events) == 0) close_woken(&loop, c, events, i + 1, n);
+                continue;
+            }
+
+            // The handler of a suspended connection owns it until it returns, even if the client is gone; its own
+            // socket only matters if that is what it waits for.
+            if (c->state == INCTTP_CONNECTION_SUSPENDED)
+            {
+                int ready = (int)events[i].events & (c->co->events | EPOLLERR | EPOLLHUP);
+                if (c->co->fd == c->fd && ready && wake(&loop, c, ready) == 0) close_woken(&loop, c, events, i + 1, n);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLERR) || drive(&loop, c) == 0)
+            {
+                close_connection(&loop, c);
+            }
+        }
+    }
+
+    close(loop.epfd);
+    return CTTP_ERROR_SERVER_EVENT_LOOP;
+}
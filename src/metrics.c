@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cttp-internal.h"
+#include "cttp-status.h"
+#include "cttp.h"
+
+__thread INCTTP_WorkerMetrics *INCTTP_worker_metrics = NULL;
+
+long long INCTTP_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void INCTTP_count(unsigned long long *c, unsigned long long n)
+{
+    // A single writer needs no read-modify-write instruction: the store only has to be atomic for readers.
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the bucket of a latency of `us` microseconds, as laid out by `CTTP_Histogram`.
+ */
+static size_t bucket_of(unsigned long long us)
+{
+    if (us < 8) return (size_t)us;
+
+    // `e` is the number of low bits below the 3 bits kept after the leading one.
+    int e = 63 - __builtin_clzll(us) - 3;
+    size_t b = 8 + 8 * (size_t)e + (size_t)((us >> e) & 7);
+
+    return b < CTTP_HISTOGRAM_BUCKETS ? b : CTTP_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Returns the upper bound, in microseconds, of the latencies counted in bucket `b`.
+ */
+static unsigned long long bucket_end(size_t b)
+{
+    if (b < 8) return b + 1;
+
+    size_t e = (b - 8) / 8;
+    return (9 + (b - 8) % 8) << e;
+}
+
+void INCTTP_observe(CTTP_Histogram *h, long long ns)
+{
+    unsigned long long us = ns > 0 ? (unsigned long long)ns / 1000 : 0;
+
+    INCTTP_count(&h->count, 1);
+    INCTTP_count(&h->sum, us);
+    INCTTP_count(&h->buckets[bucket_of(us)], 1);
+}
+
+void INCTTP_record_request(INCTTP_WorkerMetrics *m, const INCTTP_Response *res, long long started, long long parse, long long sending)
+{
+    long long now = INCTTP_now_ns();
+    CTTP_RouteMetrics *route = &m->routes[res->route];
+    int status = res->status >= 100 && res->status < 600 ? res->status / 100 : 5;
+
+    INCTTP_count(&m->requests, 1);
+    INCTTP_count(&route->requests[status - 1], 1);
+    INCTTP_observe(&route->latency, now - started);
+    INCTTP_observe(&m->parse, parse);
+    INCTTP_observe(&m->send, now - sending);
+}
+
+/**
+ * Numbers the endpoints below `node`, whose route starts with the `len` bytes of `path`, storing their paths in `m`.
+ * Returns 0 if an error occurs.
+ */
+static int number_routes(INCTTP_Metrics *m, CTTP_RouteNode *node, char *path, size_t len, size_t cap)
+{
+    // Parameters are named by their node, so their marker is added back. A bare `*` is named `*` already.
+    const char *marker = node->kind == CTTP_ROUTE_PARAM ? ":" : node->kind == CTTP_ROUTE_CATCH_ALL && strcmp(node->prefix, "*") != 0 ? "*" : "";
+    size_t mlen = strlen(marker);
+    if (len + mlen + node->plen >= cap) return 0;
+
+    memcpy(path + len, marker, mlen);
+    if (node->plen > 0) memcpy(path + len + mlen, node->prefix, node->plen);
+    len += mlen + node->plen;
+
+    if (node->methods != 0)
+    {
+        char **paths = (char **)realloc(m->paths, (m->nroutes + 1) * sizeof(char *));
+        if (paths == NULL) return 0;
+        m->paths = paths;
+
+        m->paths[m->nroutes] = strndup(path, len);
+        if (m->paths[m->nroutes] == NULL) return 0;
+        node->id = m->nroutes++;
+    }
+
+    for (size_t i = 0; i < node->nchildren; i++)
+    {
+        if (number_routes(m, node->children[i], path, len, cap) == 0) return 0;
+    }
+    if (node->param != NULL && number_routes(m, node->param, path, len, cap) == 0) return 0;
+    if (node->catch_all != NULL && number_routes(m, node->catch_all, path, len, cap) == 0) return 0;
+
+    return 1;
+}
+
+int INCTTP_init_metrics(CTTP_Server *cs, size_t workers)
+{
+    INCTTP_Metrics *m = (INCTTP_Metrics *)calloc(1, sizeof(INCTTP_Metrics));
+    if (m == NULL) return 0;
+    cs->stats = m;
+
+    // Entry 0 counts the requests matching no route.
+    m->paths = (char **)malloc(sizeof(char *));
+    if (m->paths == NULL || (m->paths[0] = strdup("")) == NULL) return 0;
+    m->nroutes = 1;
+
+    char path[4096];
+    if (number_routes(m, cs->routes, path, 0, sizeof(path)) == 0) return 0;
+
+    m->workers = (INCTTP_WorkerMetrics **)calloc(workers, sizeof(INCTTP_WorkerMetrics *));
+    if (m->workers == NULL) return 0;
+
+    for (; m->nworkers < workers; m->nworkers++)
+    {
+        // Blocks are allocated one by one, so that no two workers write the same cache line.
+        INCTTP_WorkerMetrics *wm = (INCTTP_WorkerMetrics *)calloc(1, sizeof(INCTTP_WorkerMetrics));
+        if (wm == NULL) return 0;
+        m->workers[m->nworkers] = wm;
+
+        wm->routes = (CTTP_RouteMetrics *)calloc(m->nroutes, sizeof(CTTP_RouteMetrics));
+        if (wm->routes == NULL) return 0;
+    }
+
+    return 1;
+}
+
+void INCTTP_free_metrics(CTTP_Server *cs)
+{
+    INCTTP_Metrics *m = cs->stats;
+    if (m == NULL) return;
+
+    for (size_t i = 0; i < m->nworkers; i++)
+    {
+        if (m->workers[i] != NULL) free(m->workers[i]->routes);
+        free(m->workers[i]);
+    }
+
+    for (size_t i = 0; i < m->nroutes; i++)
+    {
+        free(m->paths[i]);
+    }
+
+    free(m->workers);
+    free(m->paths);
+    free(m);
+    cs->stats = NULL;
+}
+
+static unsigned long long load(const unsigned long long *c)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static void add_histogram(CTTP_Histogram *to, const CTTP_Histogram *from)
+{
+    to->count += load(&from->count);
+    to->sum += load(&from->sum);
+
+    for (size_t i = 0; i < CTTP_HISTOGRAM_BUCKETS; i++)
+    {
+        to->buckets[i] += load(&from->buckets[i]);
+    }
+}
+
+CTTP_Metrics *CTTP_read_metrics(CTTP_Server *cs)
+{
+    INCTTP_Metrics *m = cs->stats;
+    if (m == NULL) return NULL;
+
+    CTTP_Metrics *s = (CTTP_Metrics *)calloc(1, sizeof(CTTP_Metrics));
+    if (s == NULL) return NULL;
+
+    s->routes = (CTTP_RouteMetrics *)calloc(m->nroutes, sizeof(CTTP_RouteMetrics));
+    if (s->routes == NULL)
+    {
+        free(s);
+        return NULL;
+    }
+    s->nroutes = m->nroutes;
+
+    unsigned long long closed = 0;
+    for (size_t i = 0; i < m->nworkers; i++)
+    {
+        INCTTP_WorkerMetrics *wm = m->workers[i];
+
+        s->requests += load(&wm->requests);
+        s->bytes_in += load(&wm->bytes_in);
+        s->bytes_out += load(&wm->bytes_out);
+        s->connections += load(&wm->accepted);
+        s->accept_errors += load(&wm->accept_errors);
+        s->cache_hits += load(&wm->cache_hits);
+        s->cache_misses += load(&wm->cache_misses);
+        closed += load(&wm->closed);
+        add_histogram(&s->parse, &wm->parse);
+        add_histogram(&s->handler, &wm->handler);
+        add_histogram(&s->send, &wm->send);
+
+        for (size_t r = 0; r < m->nroutes; r++)
+        {
+            for (int c = 0; c < 5; c++)
+            {
+                s->routes[r].requests[c] += load(&wm->routes[r].requests[c]);
+            }
+            add_histogram(&s->routes[r].latency, &wm->routes[r].latency);
+        }
+    }
+
+    if (cs->logger != NULL)
+    {
+        for (size_t i = 0; i < cs->logger->nrings; i++)
+        {
+            s->log_dropped += load(&cs->logger->rings[i]->dropped);
+        }
+    }
+
+    // Counters of different workers are read at slightly different times, so the difference is clamped.
+    s->active = s->connections > closed ? s->connections - closed : 0;
+
+    for (size_t r = 0; r < m->nroutes; r++)
+    {
+        s->routes[r].path = m->paths[r];
+    }
+
+    return s;
+}
+
+void CTTP_free_metrics(CTTP_Metrics *m)
+{
+    if (m == NULL) return;
+
+    free(m->routes);
+    free(m);
+}
+
+double CTTP_histogram_percentile(const CTTP_Histogram *h, double q)
+{
+    if (h->count == 0) return 0;
+
+    unsigned long long rank = (unsigned long long)(q * (double)h->count);
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < CTTP_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank) return (double)bucket_end(i);
+    }
+
+    return (double)bucket_end(CTTP_HISTOGRAM_BUCKETS - 1);
+}
+
+// <------------------------>
+//    Prometheus exposition
+// <------------------------>
+
+/* Bucket bounds exported to Prometheus, as powers of two microseconds: from 64us to about 67s. They are bounds of the
+ * histogram's own buckets, so the exported counts are exact */
+#define EXPORT_FIRST 6
+#define EXPORT_LAST  26
+
+/**
+ * Writes route path `p` to `f` as a label value, escaping it as the text format requires.
+ */
+static void write_label(FILE *f, const char *p)
+{
+    for (; *p != '\0'; p++)
+    {
+        if (*p == '\\' || *p == '"') fputc('\\', f);
+        if (*p == '\n') fputs("\\n", f);
+        else fputc(*p, f);
+    }
+}
+
+/**
+ * Writes the name and labels of a sample of series `name` followed by `suffix`. The `route` and `le` labels are
+ * added when not `NULL`.
+ */
+static void write_series(FILE *f, const char *name, const char *suffix, const char *route, const char *le)
+{
+    fprintf(f, "%s%s", name, suffix);
+    if (route == NULL && le == NULL) return;
+
+    fputc('{', f);
+    if (route != NULL)
+    {
+        fputs("route=\"", f);
+        write_label(f, route);
+        fputs(le != NULL ? "\"," : "\"", f);
+    }
+    if (le != NULL) fprintf(f, "le=\"%s\"", le);
+    fputc('}', f);
+}
+
+/**
+ * Writes histogram `h` as metric `name`, labelled with `route` when not `NULL`.
+ */
+static void write_histogram(FILE *f, const char *name, const char *route, const CTTP_Histogram *h)
+{
+    unsigned long long cumulative = 0;
+    size_t b = 0;
+
+    for (int e = EXPORT_FIRST; e <= EXPORT_LAST; e++)
+    {
+        unsigned long long bound = 1ULL << e;
+        for (; b < CTTP_HISTOGRAM_BUCKETS && bucket_end(b) <= bound; b++) cumulative += h->buckets[b];
+
+        char le[32];
+        snprintf(le, sizeof(le), "%g", (double)bound / 1e6);
+        write_series(f, name, "_bucket", route, le);
+        fprintf(f, " %llu\n", cumulative);
+    }
+
+    write_series(f, name, "_bucket", route, "+Inf");
+    fprintf(f, " %llu\n", h->count);
+    write_series(f, name, "_sum", route, NULL);
+    fprintf(f, " %.6f\n", (double)h->sum / 1e6);
+    write_series(f, name, "_count", route, NULL);
+    fprintf(f, " %llu\n", h->count);
+}
+
+/**
+ * Writes the metrics of snapshot `s` to `f` in the Prometheus text format.
+ */
+static void write_metrics(FILE *f, const CTTP_Metrics *s)
+{
+    static const char *const CLASSES[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+    fputs("# HELP cttp_requests_total Requests answered, by route and status class.\n"
+          "# TYPE cttp_requests_total counter\n", f);
+    for (size_t r = 0; r < s->nroutes; r++)
+    {
+        for (int c = 0; c < 5; c++)
+        {
+            if (s->routes[r].requests[c] == 0) continue;
+
+            fputs("cttp_requests_total{route=\"", f);
+            write_label(f, s->routes[r].path);
+            fprintf(f, "\",code=\"%s\"} %llu\n", CLASSES[c], s->routes[r].requests[c]);
+        }
+    }
+
+    fputs("# HELP cttp_request_duration_seconds Time from the first byte of a request to the last byte of its response.\n"
+          "# TYPE cttp_request_duration_seconds histogram\n", f);
+    for (size_t r = 0; r < s->nroutes; r++)
+    {
+        // Routes never requested are left out, since each histogram takes a few dozen lines.
+        if (s->routes[r].latency.count == 0) continue;
+        write_histogram(f, "cttp_request_duration_seconds", s->routes[r].path, &s->routes[r].latency);
+    }
+
+    fputs("# HELP cttp_parse_duration_seconds Time spent parsing requests.\n"
+          "# TYPE cttp_parse_duration_seconds histogram\n", f);
+    write_histogram(f, "cttp_parse_duration_seconds", NULL, &s->parse);
+    fputs("# HELP cttp_handler_duration_seconds Time spent in route handlers.\n"
+          "# TYPE cttp_handler_duration_seconds histogram\n", f);
+    write_histogram(f, "cttp_handler_duration_seconds", NULL, &s->handler);
+    fputs("# HELP cttp_send_duration_seconds Time from a response being ready to it being fully sent.\n"
+          "# TYPE cttp_send_duration_seconds histogram\n", f);
+    write_histogram(f, "cttp_send_duration_seconds", NULL, &s->send);
+
+    fprintf(f, "# HELP cttp_received_bytes_total Bytes received.\n"
+               "# TYPE cttp_received_bytes_total counter\n"
+               "cttp_received_bytes_total %llu\n"
+               "# HELP cttp_sent_bytes_total Bytes sent.\n"
+               "# TYPE cttp_sent_bytes_total counter\n"
+               "cttp_sent_bytes_total %llu\n"
+               "# HELP cttp_connections_accepted_total Connections accepted.\n"
+               "# TYPE cttp_connections_accepted_total counter\n"
+               "cttp_connections_accepted_total %llu\n"
+               "# HELP cttp_connections_active Connections open.\n"
+               "# TYPE cttp_connections_active gauge\n"
+               "cttp_connections_active %llu\n"
+               "# HELP cttp_accept_errors_total Failures to accept or set up a connection.\n"
+               "# TYPE cttp_accept_errors_total counter\n"
+               "cttp_accept_errors_total %llu\n"
+               "# HELP cttp_access_log_dropped_total Access log records dropped because the log thread fell behind.\n"
+               "# TYPE cttp_access_log_dropped_total counter\n"
+               "cttp_access_log_dropped_total %llu\n"
+               "# HELP cttp_cache_hits_total Requests of cached routes answered from the cache.\n"
+               "# TYPE cttp_cache_hits_total counter\n"
+               "cttp_cache_hits_total %llu\n"
+               "# HELP cttp_cache_misses_total Requests of cached routes that ran the handler.\n"
+               "# TYPE cttp_cache_misses_total counter\n"
+               "cttp_cache_misses_total %llu\n",
+            s->bytes_in, s->bytes_out, s->connections, s->active, s->accept_errors, s->log_dropped,
+            s->cache_hits, s->cache_misses);
+}
+
+/**
+ * Handler of metrics routes. The route's data holds the server whose metrics are served.
+ */
+static int serve_metrics(CTTP_Writer *w, CTTP_Request *r)
+{
+    CTTP_Server *cs = *(CTTP_Server **)r->route->data;
+
+    CTTP_Metrics *s = CTTP_read_metrics(cs);
+    if (s == NULL) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (f == NULL)
+    {
+        CTTP_free_metrics(s);
+        return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+    }
+
+    write_metrics(f, s);
+    fclose(f);
+    CTTP_free_metrics(s);
+
+    CTTP_write_status(w, CTTP_STATUS_OK);
+    CTTP_write_header(w, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+    CTTP_write_header(w, "Cache-Control", "no-store");
+    int written = CTTP_write_body(w, text, len);
+    free(text);
+
+    return written ? CTTP_ERROR_NIL : CTTP_ERROR_INTERNAL_SERVER_ERROR;
+}
+
+void CTTP_add_metrics_route(CTTP_Server *cs, const char *p)
+{
+    CTTP_Server **data = (CTTP_Server **)malloc(sizeof(CTTP_Server *));
+    if (data == NULL) return;
+    *data = cs;
+
+    CTTP_RouteNode *node = INCTTP_insert_route(cs, "GET", p, serve_metrics);
+    if (node == NULL)
+    {
+        free(data);
+        return;
+    }
+
+    free(node->data);
+    node->data = data;
+    cs->metrics = 1;
+}
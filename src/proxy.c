@@ -0,0 +1,764 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp-status.h"
+#include "cttp.h"
+
+/* Methods whose requests may be sent twice, having the effect of one (RFC 9110, section 9.2.2) */
+#define IDEMPOTENT ((1u << CTTP_METHOD_GET) | (1u << CTTP_METHOD_HEAD) | (1u << CTTP_METHOD_PUT) \
+                    | (1u << CTTP_METHOD_DELETE) | (1u << CTTP_METHOD_OPTIONS) | (1u << CTTP_METHOD_TRACE))
+
+/**
+ * An upstream server, resolved when its route is added.
+ */
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+}
+Upstream;
+
+/**
+ * Data of a proxy route: its upstreams and how requests are spread across them.
+ */
+typedef struct
+{
+    size_t   id; /* Index of the route's state in each worker's `states` */
+    int      balance; /* `CTTP_BALANCE` of the route */
+    size_t   count; /* Number of `upstreams` */
+    Upstream upstreams[];
+}
+Proxy;
+
+/**
+ * Connections of a worker to an upstream.
+ */
+typedef struct
+{
+    int       idle[INCTTP_PROXY_IDLE]; /* Kept-alive connections waiting for a request, the most recently used last */
+    size_t    nidle;
+    size_t    active; /* Requests in flight */
+    long long failed_until; /* Monotonic time (ms) until which the upstream is skipped, after it could not be reached */
+}
+UpstreamPool;
+
+/**
+ * State of a proxy route in a worker.
+ */
+typedef struct
+{
+    size_t       next; /* Round-robin cursor */
+    UpstreamPool pools[]; /* Pool of each upstream, in the order of `Proxy.upstreams` */
+}
+ProxyState;
+
+static __thread ProxyState **states;
+static __thread size_t       nstates;
+
+/* Proxy routes added so far, numbering their states. Routes are added before the workers start */
+static size_t proxies;
+
+/**
+ * Connection to an upstream while it serves a request, with the part of the response received but not forwarded yet.
+ */
+typedef struct
+{
+    int    fd;
+    int    reused; /* Whether the connection was kept alive from an earlier request */
+    int    keep_alive; /* Whether the connection can serve another request once the response is read */
+    int    eof; /* Whether the upstream closed the connection */
+    int    reset; /* Whether the upstream reset the connection */
+    char  *buf; /* `INCTTP_PROXY_BUFFER` bytes */
+    size_t len; /* Bytes received in `buf` */
+    size_t pos; /* Bytes of `buf` already handled */
+}
+UpstreamConn;
+
+/**
+ * Framings of an upstream response body, besides a `Content-Length`.
+ */
+enum
+{
+    BODY_NONE        = -3, /* The response ends with its head */
+    BODY_CHUNKED     = -2,
+    BODY_UNTIL_CLOSE = -1,
+};
+
+/**
+ * Resolves the `host:port` address `spec` into `up`. IPv6 hosts are written in brackets. Returns 0 if an error occurs.
+ */
+static int resolve(const char *spec, Upstream *up)
+{
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0') return 0;
+
+    const char *host = spec;
+    size_t len = (size_t)(colon - spec);
+    if (len >= 2 && host[0] == '[' && host[len - 1] == ']')
+    {
+        host++;
+        len -= 2;
+    }
+
+    char name[NI_MAXHOST];
+    if (len >= sizeof(name)) return 0;
+    memcpy(name, host, len);
+    name[len] = '\0';
+
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *found;
+    if (getaddrinfo(name, colon + 1, &hints, &found) != 0) return 0;
+
+    memcpy(&up->addr, found->ai_addr, found->ai_addrlen);
+    up->addrlen = found->ai_addrlen;
+    freeaddrinfo(found);
+    return 1;
+}
+
+/**
+ * Returns the state of route `proxy` in the calling worker, allocated on its first request. Returns `NULL` if an
+ * error occurs.
+ */
+static ProxyState *route_state(const Proxy *proxy)
+{
+    if (proxy->id >= nstates)
+    {
+        ProxyState **grown = (ProxyState **)realloc(states, (proxy->id + 1) * sizeof(ProxyState *));
+        if (grown == NULL) return NULL;
+
+        memset(grown + nstates, 0, (proxy->id + 1 - nstates) * sizeof(ProxyState *));
+        states = grown;
+        nstates = proxy->id + 1;
+    }
+
+    if (states[proxy->id] == NULL)
+    {
+        states[proxy->id] = (ProxyState *)calloc(1, sizeof(ProxyState) + proxy->count * sizeof(UpstreamPool));
+    }
+
+    return states[proxy->id];
+}
+
+/**
+ * Picks the upstream of route `proxy` to send the next request to. Upstreams that recently failed are skipped,
+ * unless they all did.
+ */
+static size_t pick(const Proxy *proxy, ProxyState *state, long long now)
+{
+    size_t start = state->next++ % proxy->count;
+    size_t best = proxy->count;
+
+    // Least connections starts its scan at the round-robin cursor too, so that ties are spread evenly.
+    for (size_t k = 0; k < proxy->count; k++)
+    {
+        size_t i = (start + k) % proxy->count;
+        if (state->pools[i].failed_until > now) continue;
+        if (proxy->balance != CTTP_BALANCE_LEAST_CONNECTIONS) return i;
+
+        if (best == proxy->count || state->pools[i].active < state->pools[best].active) best = i;
+    }
+
+    return best < proxy->count ? best : start;
+}
+
+/**
+ * Waits up to `timeout` ms for upstream socket `fd` to be ready for `events`. Returns `CTTP_ERROR_NIL` once it is.
+ */
+static int wait_upstream(int fd, int events, int timeout)
+{
+    int ready = CTTP_wait_fd(fd, events, timeout);
+    if (ready > 0) return CTTP_ERROR_NIL;
+
+    return ready == 0 ? CTTP_ERROR_GATEWAY_TIMEOUT : CTTP_ERROR_BAD_GATEWAY;
+}
+
+/**
+ * Opens a new connection to upstream `up` and stores its socket in `fd`. Returns `CTTP_ERROR_NIL` once connected.
+ */
+static int connect_upstream(const Upstream *up, int *fd)
+{
+    *fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (*fd < 0) return CTTP_ERROR_BAD_GATEWAY;
+
+    // Requests and their responses are written at once, so there is nothing for Nagle's algorithm to merge.
+    int one = 1;
+    setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int result = CTTP_ERROR_NIL;
+    if (connect(*fd, (const struct sockaddr *)&up->addr, up->addrlen) < 0)
+    {
+        if (errno != EINPROGRESS) result = CTTP_ERROR_BAD_GATEWAY;
+        else result = wait_upstream(*fd, POLLOUT, INCTTP_PROXY_CONNECT_TIMEOUT);
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (result == CTTP_ERROR_NIL && (getsockopt(*fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0))
+        {
+            result = CTTP_ERROR_BAD_GATEWAY;
+        }
+    }
+
+    if (result != CTTP_ERROR_NIL)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+
+    return result;
+}
+
+/**
+ * Takes a kept-alive connection of `pool`. Returns its socket, or -1 if there is none.
+ */
+static int take_idle(UpstreamPool *pool)
+{
+    while (pool->nidle > 0)
+    {
+        int fd = pool->idle[--pool->nidle];
+
+        // An idle connection has nothing to read, unless the upstream closed it or broke the protocol.
+        char byte;
+        if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return fd;
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+/**
+ * Hands connection `u` back to `pool` once its request is over, keeping it for the next one when possible.
+ */
+static void release(UpstreamPool *pool, UpstreamConn *u)
+{
+    pool->active--;
+    if (u->fd < 0) return;
+
+    // Bytes past the end of the response would be taken for the start of the next one.
+    if (u->keep_alive && u->pos == u->len && pool->nidle < INCTTP_PROXY_IDLE) pool->idle[pool->nidle++] = u->fd;
+    else close(u->fd);
+
+    u->fd = -1;
+}
+
+/**
+ * Returns whether header `key` (`CTTP_HEADER_ID` `id`) only concerns a single connection (RFC 9110, section 7.6.1),
+ * or frames the message, which the proxy does itself. Such headers are not forwarded.
+ */
+static int hop_by_hop(const char *key, int id)
+{
+    switch (id)
+    {
+    case CTTP_HEADER_CONNECTION:
+    case CTTP_HEADER_CONTENT_LENGTH:
+    case CTTP_HEADER_EXPECT:
+    case CTTP_HEADER_TE:
+    case CTTP_HEADER_TRANSFER_ENCODING:
+    case CTTP_HEADER_UPGRADE:
+        return 1;
+    case CTTP_HEADER_OTHER:
+        return strcasecmp(key, "Keep-Alive") == 0 || strcasecmp(key, "Proxy-Connection") == 0 || strcasecmp(key, "Trailer") == 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Serializes the request line and headers of request `r` for an upstream, in arena `a`, and stores their length in
+ * `len`. Returns `NULL` if an error occurs.
+ */
+static char *request_head(INCTTP_Arena *a, CTTP_Request *r, size_t *len)
+{
+    size_t size = r->method_name.len + 1 + r->uri.len + 1 + r->query.len + sizeof(" HTTP/1.1\r\n") +
+                  sizeof("Content-Length: \r\n") + 20 + 2;
+    for (size_t i = 0; i < r->hsize; i++) size += r->headers[i].klen + 2 + r->headers[i].vlen + 2;
+
+    char *head = (char *)INCTTP_arena_alloc(a, size);
+    if (head == NULL) return NULL;
+
+    size_t n = 0;
+    memcpy(head + n, r->method_name.ptr, r->method_name.len);
+    n += r->method_name.len;
+    head[n++] = ' ';
+    memcpy(head + n, r->uri.ptr, r->uri.len);
+    n += r->uri.len;
+
+    // The query string is forwarded as received, with the `&` separators the parser replaced.
+    if (r->query.len > 0)
+    {
+        head[n++] = '?';
+        for (size_t i = 0; i < r->query.len; i++) head[n++] = r->query.ptr[i] != '\0' ? r->query.ptr[i] : '&';
+    }
+
+    memcpy(head + n, " HTTP/1.1\r\n", 11);
+    n += 11;
+
+    for (size_t i = 0; i < r->hsize; i++)
+    {
+        CTTP_Header *h = &r->headers[i];
+        if (hop_by_hop(h->key, h->id)) continue;
+
+        memcpy(head + n, h->key, h->klen);
+        n += h->klen;
+        head[n++] = ':';
+        head[n++] = ' ';
+        memcpy(head + n, h->val, h->vlen);
+        n += h->vlen;
+        head[n++] = '\r';
+        head[n++] = '\n';
+    }
+
+    // A chunked body has been decoded, so every body is sent with its length.
+    if (r->body.len > 0 || r->known[CTTP_HEADER_CONTENT_LENGTH] != NULL || r->known[CTTP_HEADER_TRANSFER_ENCODING] != NULL)
+    {
+        n += (size_t)snprintf(head + n, size - n, "Content-Length: %zu\r\n", r->body.len);
+    }
+
+    head[n++] = '\r';
+    head[n++] = '\n';
+    *len = n;
+    return head;
+}
+
+/**
+ * Sends the `len` bytes of `head`, followed by `body`, to upstream socket `fd`. Returns `CTTP_ERROR_NIL` once sent.
+ */
+static int send_request(int fd, char *head, size_t len, CTTP_Slice body)
+{
+    struct iovec iov[2] = {{head, len}, {(void *)body.ptr, body.len}};
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = body.len > 0 ? 2 : 1;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return CTTP_ERROR_BAD_GATEWAY;
+
+            int result = wait_upstream(fd, POLLOUT, INCTTP_PROXY_TIMEOUT);
+            if (result != CTTP_ERROR_NIL) return result;
+            continue;
+        }
+
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= (size_t)n;
+        }
+    }
+
+    return CTTP_ERROR_NIL;
+}
+
+/**
+ * Receives more of the response of connection `u`, after the bytes it has not handled yet. Returns `CTTP_ERROR_NIL`
+ * once at least one byte arrived, and `CTTP_ERROR_BAD_GATEWAY` if the connection is closed (setting `u->eof`),
+ * reset (setting `u->reset`), fails or its buffer is full.
+ */
+static int receive(UpstreamConn *u)
+{
+    if (u->pos > 0)
+    {
+        memmove(u->buf, u->buf + u->pos, u->len - u->pos);
+        u->len -= u->pos;
+        u->pos = 0;
+    }
+    if (u->len == INCTTP_PROXY_BUFFER) return CTTP_ERROR_BAD_GATEWAY;
+
+    while (1)
+    {
+        ssize_t n = recv(u->fd, u->buf + u->len, INCTTP_PROXY_BUFFER - u->len, 0);
+        if (n > 0)
+        {
+            u->len += (size_t)n;
+            return CTTP_ERROR_NIL;
+        }
+
+        if (n == 0)
+        {
+            u->eof = 1;
+            return CTTP_ERROR_BAD_GATEWAY;
+        }
+        if (errno == EINTR) continue;
+        if (errno == ECONNRESET || errno == EPIPE) u->reset = 1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return CTTP_ERROR_BAD_GATEWAY;
+
+        int result = wait_upstream(u->fd, POLLIN, INCTTP_PROXY_TIMEOUT);
+        if (result != CTTP_ERROR_NIL) return result;
+    }
+}
+
+/**
+ * Sends the request serialized in `head`, followed by `body`, to an upstream of `proxy` and waits for the first
+ * bytes of its response, in `u`. An upstream that cannot be reached is left out for a while and the next one tried,
+ * and a kept-alive connection the upstream closed in the meantime is replaced by a new one, unless the request of
+ * method `method` may have been processed already. Stores the pool of the upstream in `pool`, with the request
+ * counted as in flight. Returns `CTTP_ERROR_NIL` once the response starts.
+ */
+static int start_exchange(const Proxy *proxy, ProxyState *state, UpstreamConn *u, UpstreamPool **pool, int method,
+                          char *head, size_t len, CTTP_Slice body)
+{
+    int result = CTTP_ERROR_BAD_GATEWAY;
+    for (size_t tries = 0; tries < proxy->count;)
+    {
+        long long now = INCTTP_now_ns() / 1000000;
+        *pool = &state->pools[pick(proxy, state, now)];
+
+        // The request counts as in flight while it connects, so that concurrent ones are balanced right away.
+        (*pool)->active++;
+        u->fd = take_idle(*pool);
+        u->reused = u->fd >= 0;
+        u->keep_alive = 0;
+        u->eof = 0;
+        u->reset = 0;
+        u->len = 0;
+        u->pos = 0;
+
+        result = u->reused ? CTTP_ERROR_NIL : connect_upstream(&proxy->upstreams[*pool - state->pools], &u->fd);
+        if (result != CTTP_ERROR_NIL)
+        {
+            (*pool)->failed_until = now + INCTTP_PROXY_FAIL_TIMEOUT;
+            release(*pool, u);
+            tries++;
+            continue;
+        }
+
+        int sent = send_request(u->fd, head, len, body);
+        result = sent == CTTP_ERROR_NIL ? receive(u) : sent;
+        if (result == CTTP_ERROR_NIL) return result;
+
+        // A kept-alive connection the upstream closed before the request could be sent processed nothing. Closed
+        // or reset before the response instead, which is how an idle connection closed after `take_idle` looked at
+        // it usually fails, it may have been closed right after the upstream processed the request, so only requests
+        // that may be processed twice are sent again.
+        int stale = u->reused && result == CTTP_ERROR_BAD_GATEWAY
+                    && (sent != CTTP_ERROR_NIL || ((u->eof || u->reset) && (IDEMPOTENT & (1u << method))));
+        release(*pool, u);
+        if (!stale) return result;
+    }
+
+    return result;
+}
+
+/**
+ * Returns the value of the hexadecimal chunk size at the start of the `len` bytes of `s`, or -1 if there is none.
+ */
+static long long chunk_size(const char *s, size_t len)
+{
+    long long size = 0;
+    size_t i = 0;
+    for (; i < len && i < 15; i++)
+    {
+        char c = s[i];
+        int digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+        if (digit < 0) break;
+
+        size = size * 16 + digit;
+    }
+
+    // Chunk extensions may follow the size, but nothing else.
+    if (i == 0 || (i < len && s[i] != ';' && s[i] != ' ' && s[i] != '\t')) return -1;
+    return size;
+}
+
+/**
+ * Receives the status line and headers of the response of connection `u`, skipping interim 1xx responses, and
+ * writes them to writer `w`. Stores how its body is framed in `length`: a `Content-Length` or one of `BODY_NONE`,
+ * `BODY_CHUNKED` and `BODY_UNTIL_CLOSE`. Returns `CTTP_ERROR_NIL` on success.
+ */
+static int read_head(UpstreamConn *u, CTTP_Writer *w, long long *length)
+{
+    char *line, *end;
+    int code;
+    while (1)
+    {
+        while ((end = (char *)memmem(u->buf + u->pos, u->len - u->pos, "\r\n\r\n", 4)) == NULL)
+        {
+            int result = receive(u);
+            if (result != CTTP_ERROR_NIL) return result;
+        }
+
+        line = u->buf + u->pos;
+        u->pos = (size_t)(end + 4 - u->buf);
+
+        if (end - line < 12 || strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') return CTTP_ERROR_BAD_GATEWAY;
+        if (line[9] < '1' || line[9] > '5' || line[10] < '0' || line[10] > '9' || line[11] < '0' || line[11] > '9') return CTTP_ERROR_BAD_GATEWAY;
+
+        // Interim responses are not forwarded: the client only ever waits for the final one.
+        code = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+        if (code >= 200 || code == 101) break;
+    }
+
+    // Upgrades are not forwarded, since the connection is not handed over.
+    if (code == 101) return CTTP_ERROR_BAD_GATEWAY;
+
+    u->keep_alive = line[7] != '0';
+    *length = BODY_UNTIL_CLOSE;
+
+    char *eol = (char *)memchr(line, '\r', (size_t)(end + 2 - line));
+    *eol = '\0';
+    const char *status = line + 9;
+
+    size_t hsize = w->hsize;
+    for (line = eol + 2; line < end + 2; line = eol + 2)
+    {
+        eol = (char *)memchr(line, '\r', (size_t)(end + 2 - line));
+        *eol = '\0';
+
+        char *colon = strchr(line, ':');
+        if (colon == NULL || colon == line) break;
+        *colon = '\0';
+
+        char *val = colon + 1;
+        while (*val == ' ' || *val == '\t') val++;
+        for (char *q = eol; q > val && (q[-1] == ' ' || q[-1] == '\t'); q--) q[-1] = '\0';
+
+        int id = INCTTP_header_id(line, (size_t)(colon - line));
+        if (id == CTTP_HEADER_CONNECTION)
+        {
+            if (strcasestr(val, "close") != NULL) u->keep_alive = 0;
+            else if (strcasestr(val, "keep-alive") != NULL) u->keep_alive = 1;
+        }
+        else if (id == CTTP_HEADER_TRANSFER_ENCODING)
+        {
+            if (strcasestr(val, "chunked") != NULL) *length = BODY_CHUNKED;
+        }
+        else if (id == CTTP_HEADER_CONTENT_LENGTH && *length != BODY_CHUNKED)
+        {
+            char *rest;
+            *length = strtoll(val, &rest, 10);
+            if (rest == val || *rest != '\0' || *length < 0) break;
+        }
+
+        // Every response carries CTTP's own `Server` and `Date` headers.
+        if (hop_by_hop(line, id) || strcasecmp(line, "Server") == 0 || strcasecmp(line, "Date") == 0) continue;
+        if (CTTP_write_header(w, line, val) == 0) break;
+    }
+
+    // A malformed head leaves the writer as it was, for the error response.
+    if (line < end + 2)
+    {
+        w->hsize = hsize;
+        return CTTP_ERROR_BAD_GATEWAY;
+    }
+
+    // Whatever the framing, responses to HEAD and bodiless statuses end with their head (RFC 9112, section 6.3).
+    if (w->request->method == CTTP_METHOD_HEAD || code == 204 || code == 304)
+    {
+        if (*length >= 0 && code != 204 && code != 304)
+        {
+            char value[32];
+            snprintf(value, sizeof(value), "%lld", *length);
+            if (CTTP_write_header(w, "Content-Length", value) == 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+        }
+        *length = BODY_NONE;
+    }
+
+    return CTTP_write_status(w, status) ? CTTP_ERROR_NIL : CTTP_ERROR_INTERNAL_SERVER_ERROR;
+}
+
+/**
+ * Forwards the next `left` bytes of the response of connection `u` to writer `w`. Returns `CTTP_ERROR_NIL` on success.
+ */
+static int forward_bytes(UpstreamConn *u, CTTP_Writer *w, long long left)
+{
+    while (left > 0)
+    {
+        if (u->pos == u->len)
+        {
+            int result = receive(u);
+            if (result != CTTP_ERROR_NIL) return result;
+        }
+
+        size_t n = u->len - u->pos;
+        if ((long long)n > left) n = (size_t)left;
+        if (CTTP_write_chunk(w, u->buf + u->pos, n) == 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+        u->pos += n;
+        left -= (long long)n;
+    }
+
+    return CTTP_ERROR_NIL;
+}
+
+/**
+ * Reads the next line of the response of connection `u`, storing where it starts and its length without CRLF.
+ * Returns `CTTP_ERROR_NIL` on success.
+ */
+static int read_line(UpstreamConn *u, char **line, size_t *len)
+{
+    char *end;
+    while ((end = (char *)memmem(u->buf + u->pos, u->len - u->pos, "\r\n", 2)) == NULL)
+    {
+        int result = receive(u);
+        if (result != CTTP_ERROR_NIL) return result;
+    }
+
+    *line = u->buf + u->pos;
+    *len = (size_t)(end - *line);
+    u->pos += *len + 2;
+    return CTTP_ERROR_NIL;
+}
+
+/**
+ * Forwards the chunked body of the response of connection `u` to writer `w`, decoded: the writer frames it again as
+ * the client needs. Returns `CTTP_ERROR_NIL` on success.
+ */
+static int forward_chunked(UpstreamConn *u, CTTP_Writer *w)
+{
+    char *line;
+    size_t len;
+    while (1)
+    {
+        int result = read_line(u, &line, &len);
+        if (result != CTTP_ERROR_NIL) return result;
+
+        long long size = chunk_size(line, len);
+        if (size < 0) return CTTP_ERROR_BAD_GATEWAY;
+        if (size == 0) break;
+
+        if ((result = forward_bytes(u, w, size)) != CTTP_ERROR_NIL) return result;
+        if ((result = read_line(u, &line, &len)) != CTTP_ERROR_NIL) return result;
+        if (len != 0) return CTTP_ERROR_BAD_GATEWAY;
+    }
+
+    // Trailer fields are dropped, up to the empty line ending the body.
+    do
+    {
+        int result = read_line(u, &line, &len);
+        if (result != CTTP_ERROR_NIL) return result;
+    }
+    while (len > 0);
+
+    return CTTP_ERROR_NIL;
+}
+
+/**
+ * Forwards the body of the response of connection `u`, framed as `length` says, to writer `w`. Returns
+ * `CTTP_ERROR_NIL` on success.
+ */
+static int forward_body(UpstreamConn *u, CTTP_Writer *w, long long length)
+{
+    if (length == BODY_NONE) return CTTP_ERROR_NIL;
+
+    // A body received whole along with the head is sent with it, in a single write.
+    if (length >= 0 && (long long)(u->len - u->pos) >= length)
+    {
+        if (CTTP_write_body(w, u->buf + u->pos, (size_t)length) == 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+        u->pos += (size_t)length;
+        return CTTP_ERROR_NIL;
+    }
+
+    // Otherwise the head goes out now and the body follows as it arrives.
+    if (length >= 0)
+    {
+        char value[32];
+        snprintf(value, sizeof(value), "%lld", length);
+        if (CTTP_write_header(w, "Content-Length", value) == 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+    }
+    if (CTTP_writer_flush(w) == 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    if (length >= 0) return forward_bytes(u, w, length);
+    if (length == BODY_CHUNKED) return forward_chunked(u, w);
+
+    // The body ends when the upstream closes the connection.
+    u->keep_alive = 0;
+    int result;
+    while ((result = forward_bytes(u, w, (long long)(u->len - u->pos))) == CTTP_ERROR_NIL)
+    {
+        if ((result = receive(u)) != CTTP_ERROR_NIL) break;
+    }
+
+    return u->eof ? CTTP_ERROR_NIL : result;
+}
+
+/**
+ * Handler of proxy routes.
+ */
+static int proxy_request(CTTP_Writer *w, CTTP_Request *r)
+{
+    const Proxy *proxy = (const Proxy *)r->route->data;
+    ProxyState *state = route_state(proxy);
+
+    size_t len;
+    char *head = request_head(w->arena, r, &len);
+
+    UpstreamConn u = {};
+    u.fd = -1;
+    u.buf = (char *)INCTTP_arena_alloc(w->arena, INCTTP_PROXY_BUFFER);
+    if (state == NULL || head == NULL || u.buf == NULL) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    UpstreamPool *pool = NULL;
+    int result = start_exchange(proxy, state, &u, &pool, r->method, head, len, r->body);
+    if (result != CTTP_ERROR_NIL) return result;
+
+    long long length;
+    result = read_head(&u, w, &length);
+    if (result == CTTP_ERROR_NIL) result = forward_body(&u, w, length);
+
+    if (result != CTTP_ERROR_NIL) u.keep_alive = 0;
+    release(pool, &u);
+
+    // Once the head is sent, an error leaves the body unterminated and closes the connection.
+    return result;
+}
+
+void CTTP_add_proxy_route(CTTP_Server *cs, char *m, char *p, const char *const *upstreams, int balance)
+{
+    size_t count = 0;
+    while (upstreams != NULL && upstreams[count] != NULL) count++;
+    if (count == 0) return;
+
+    Proxy *proxy = (Proxy *)calloc(1, sizeof(Proxy) + count * sizeof(Upstream));
+    if (proxy == NULL) return;
+
+    proxy->id = proxies;
+    proxy->balance = balance;
+    proxy->count = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (resolve(upstreams[i], &proxy->upstreams[i]) == 0)
+        {
+            free(proxy);
+            return;
+        }
+    }
+
+    // Waiting on upstreams suspends the handler, as async routes do.
+    CTTP_RouteNode *node = INCTTP_insert_async_route(cs, m, p, proxy_request);
+    if (node == NULL)
+    {
+        free(proxy);
+        return;
+    }
+
+    proxies++;
+    free(node->data);
+    node->data = proxy;
+}
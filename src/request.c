@@ -1,190 +1,651 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "cttp-internal.h"
 #include "cttp.h"
 
+/**
+ * States of the request parser. Every state before `PARSE_BODY` belongs to the request head.
+ */
+enum PARSE_STATE
+{
+    PARSE_START,          /* Skipping empty lines before the request line */
+    PARSE_METHOD,
+    PARSE_URI,
+    PARSE_VERSION,
+    PARSE_REQUEST_LINE_LF,
+    PARSE_HEADER_START,   /* Start of a header line, or of the empty line ending the head */
+    PARSE_HEADER_KEY,
+    PARSE_HEADER_VALUE_START,
+    PARSE_HEADER_VALUE,
+    PARSE_HEADER_LF,
+    PARSE_HEAD_END_LF,
+    PARSE_BODY,
+    PARSE_DONE,
+};
+
+/**
+ * FNV-1a hash of the `len` bytes of header key `k`, folded to lowercase.
+ */
+static size_t hash_key(const char *k, size_t len)
+{
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char ch = (unsigned char)k[i];
+        h ^= ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
 char *CTTP_read_request_header(CTTP_Request *r, char *k)
 {
-    for (int i = 0; i < r->hsize; i++)
+    size_t klen = strlen(k);
+
+    int id = INCTTP_header_id(k, klen);
+    if (id != CTTP_HEADER_OTHER) return CTTP_read_request_header_id(r, id);
+    if (r->others == NULL) return NULL;
+
+    // Linear probing: the first header of a key is met before its repetitions.
+    size_t mask = r->others_size - 1;
+    for (size_t i = hash_key(k, klen) & mask; r->others[i] != NULL; i = (i + 1) & mask)
     {
-        if (strcmp(r->headers[i].key, k) == 0)
-        {
-            return r->headers[i].val;
-        }
+        CTTP_Header *h = r->others[i];
+        if (h->klen == klen && strncasecmp(h->key, k, klen) == 0) return h->val;
     }
 
     return NULL;
 }
 
+char *CTTP_read_request_header_id(CTTP_Request *r, int id)
+{
+    if (id <= CTTP_HEADER_OTHER || id >= CTTP_HEADER_COUNT || r->known[id] == NULL) return NULL;
+    return r->known[id]->val;
+}
+
 char *CTTP_read_request_param(CTTP_Request *r, char *k)
 {
-    for (int i = 0; i < r->params_count; i++)
+    size_t klen = strlen(k);
+
+    // Parameters are stored back to back in the query, each one NUL-terminated as `key=value`.
+    const char *end = r->query.ptr + r->query.len;
+    for (const char *q = r->query.ptr; q < end; q += strlen(q) + 1)
     {
-        if (strcmp(r->params[i].key, k) == 0)
-        {
-            return r->params[i].val;
-        }
+        if (strncmp(q, k, klen) != 0) continue;
+
+        if (q[klen] == '=') return (char *)q + klen + 1;
+        if (q[klen] == '\0') return (char *)q + klen;
     }
 
     return NULL;
 }
 
+CTTP_Slice CTTP_read_request_path_param(CTTP_Request *r, const char *k)
+{
+    for (size_t i = 0; i < r->path_params_count; i++)
+    {
+        if (strcmp(r->path_params[i].name, k) == 0) return r->path_params[i].val;
+    }
+
+    CTTP_Slice none = {NULL, 0};
+    return none;
+}
+
 /**
  * For debugging only
  */
 static void print_request(CTTP_Request *r)
 {
     printf("\n\n");
-    printf("method: %s\n", r->method);
-    printf("uri: %s\n", r->uri);
-    printf("http_version: %s\n", r->http_version);
+    printf("method: %s\n", r->method_name.ptr);
+    printf("uri: %s\n", r->uri.ptr);
+    printf("http_version: %s\n", r->version == CTTP_VERSION_1_0 ? "HTTP/1.0" : "HTTP/1.1");
 
     printf("headers:\n");
-    for (int i = 0; i < r->hsize; i++)
+    for (size_t i = 0; i < r->hsize; i++)
     {
         printf("\tkey: %s | val: %s\n", r->headers[i].key, r->headers[i].val);
     }
 
     printf("parameters:\n");
-    for (int i = 0; i < r->params_count; i++)
+    const char *end = r->query.ptr + r->query.len;
+    for (const char *q = r->query.ptr; q < end; q += strlen(q) + 1)
     {
-        printf("\tkey: %s | val: %s\n", r->params[i].key, r->params[i].val);
+        if (*q) printf("\t%s\n", q);
     }
 
-    printf("body:\n%s\n", r->body);
+    printf("body:\n%.*s\n", (int)r->body.len, r->body.ptr);
     printf("\n\n");
 }
 
-static int set_raw_request_header(CTTP_Request *r, char *k, char *v)
+void INCTTP_init_parser(INCTTP_Parser *p)
 {
-    if (r->hsize > CTTP_HEADER_LIMIT) {
-        return 0;
-    }
-
-    CTTP_Header *header = &r->headers[r->hsize];
-    header->key = strdup(k);
-    header->val = strdup(v);
-    r->hsize++;
-
-    return 1;
+    p->state = PARSE_START;
+    p->pos = 0;
+    p->mark = 0;
+    p->start = 0;
+    p->hcount = 0;
+    p->body_off = 0;
+    p->content_length = 0;
+    p->has_content_length = 0;
+    p->chunked = 0;
+    INCTTP_init_chunked(&p->chunk);
+    p->body_len = 0;
+    p->stream_body = 0;
 }
 
-static int parse_raw_headers(CTTP_Server *cs, CTTP_Request *r, const char *raw_r)
+/**
+ * Records the header that just ended and picks up the framing headers.
+ */
+static int end_header(INCTTP_Parser *p, const char *buf)
 {
-    // Move to headers section. Headers begin on the second line.
-    const char *restrict raw_h = strchr(raw_r, '\n');
-    // Headers are required. If none are provided, return an error.
-    if (raw_h == NULL) return CTTP_ERROR_RAW_REQUEST_HEADERS;
+    INCTTP_HeaderSpan *h = &p->headers[p->hcount++];
+    h->voff = (unsigned int)p->mark;
+    h->vlen = (unsigned int)(p->vend - p->mark);
+    h->id = (unsigned int)INCTTP_header_id(buf + h->koff, h->klen);
 
-    // Check the length of headers for security reasons (e.g., potential DoS attacks). 
-    if (strlen(raw_h) >= cs->hsize)
+    if (h->id == CTTP_HEADER_CONTENT_LENGTH)
     {
-        return CTTP_ERROR_HEADER_FIELDS_TOO_LARGE;
-    }
+        // Content-Length = 1*DIGIT. Repeated fields must agree, as otherwise the framing is ambiguous.
+        if (h->vlen == 0) return CTTP_ERROR_RAW_REQUEST_HEADERS;
 
-    char k[512], v[512];
-    for (raw_h++; raw_h && strncmp(raw_h, "\r\n", 2) != 0; raw_h++)
-    {
-        if (sscanf(raw_h, "%511[^:]: %511[^\r\n]", k, v) == 2)
+        size_t length = 0;
+        for (unsigned int i = 0; i < h->vlen; i++)
         {
-            set_raw_request_header(r, k, v);
+            char ch = buf[h->voff + i];
+            if (ch < '0' || ch > '9' || length > (((size_t)-1) - 9) / 10) return CTTP_ERROR_RAW_REQUEST_HEADERS;
+            length = length * 10 + (size_t)(ch - '0');
         }
 
-        if ((raw_h = strchr(raw_h, '\n')) == NULL) break;
+        if (p->has_content_length && p->content_length != length) return CTTP_ERROR_RAW_REQUEST_HEADERS;
+
+        p->content_length = length;
+        p->has_content_length = 1;
+    }
+    else if (h->id == CTTP_HEADER_TRANSFER_ENCODING)
+    {
+        // Chunked is the only coding understood, and it must be applied once.
+        if (p->chunked || h->vlen != 7 || strncasecmp(buf + h->voff, "chunked", 7) != 0) return CTTP_ERROR_RAW_REQUEST_HEADERS;
+        p->chunked = 1;
     }
 
     return 1;
 }
 
-static int set_raw_request_param(CTTP_Request *r, char *k, char *v)
+/**
+ * Called once the empty line ending the head has been consumed, with `body_off` pointing right after it.
+ */
+static int end_head(INCTTP_Parser *p, const char *buf, CTTP_Server *cs, size_t body_off)
 {
-    if (r->params_count > CTTP_PARAM_LIMIT)
+    // Both framings at once are read differently by different servers, so the message is rejected (RFC 9112, section 6.3).
+    if (p->chunked && p->has_content_length) return CTTP_ERROR_RAW_REQUEST_HEADERS;
+
+    p->body_off = body_off;
+    p->state = PARSE_BODY;
+
+    int method = INCTTP_parse_method(buf + p->start, p->method_len);
+    if ((p->chunked || p->content_length > 0) && cs->streams
+        && INCTTP_route_streams_body(cs, method, buf + p->uri_off, p->path_len))
     {
-        return 0;
+        p->stream_body = 1;
+        return 1;
     }
 
-    CTTP_Parameter *parameter = &r->params[r->params_count];
-    parameter->key = strdup(k);
-    parameter->val = strdup(v);
-    r->params_count++;
-
+    if (p->content_length >= cs->bsize) return CTTP_ERROR_CONTENT_TOO_LARGE;
     return 1;
 }
 
-static int parse_raw_params(CTTP_Server *cs, CTTP_Request *r, char *uri)
+/**
+ * Skips the run of header value bytes starting at `i`, extending the value up to the last visible byte of the run.
+ * Returns the offset of the control character ending the run, or `end`.
+ */
+static size_t skip_value(INCTTP_Parser *p, const char *buf, size_t i, size_t end)
+{
+    size_t stop = INCTTP_scan_value(buf, i, end);
+
+    // Trailing whitespace is not part of the value.
+    size_t last = stop;
+    while (last > i && (buf[last - 1] == ' ' || buf[last - 1] == '\t')) last--;
+    if (last > i) p->vend = last;
+
+    return stop;
+}
+
+int INCTTP_parse_request(INCTTP_Parser *p, const char *buf, size_t len, CTTP_Server *cs)
 {
-    // Parse query parameters.
-    // Unlike headers, it's not an error if no parameters are found.
-    char *restrict raw_p = strchr(uri, '?');
-    if (raw_p != NULL)
+    // The head may not grow past `cs->hsize`, so never scan further than that.
+    size_t i = p->pos;
+    size_t end = p->start + cs->hsize < len ? p->start + cs->hsize : len;
+
+    for (; i < end && p->state < PARSE_BODY; i++)
     {
-        // For security, limit the length of parameters to prevent potential attacks, such as SQL injection.
-        if (strlen(raw_p) >= cs->psize)
-        {
-            return CTTP_ERROR_CONTENT_TOO_LARGE;
-        }
+        // Inside the URI, a header name or a header value, the scanning kernels skip the bytes that need no decision.
+        if (p->state == PARSE_URI) i = INCTTP_scan_uri(buf, i, end);
+        else if (p->state == PARSE_HEADER_KEY) i = INCTTP_scan_token(buf, i, end);
+        else if (p->state == PARSE_HEADER_VALUE) i = skip_value(p, buf, i, end);
+        if (i == end) break;
 
-        *raw_p = '\0'; // Set termination character at the '?' position, truncating r->uri here.
-                       // This cleans up the uri and let us to match patterns later
-        raw_p++;
+        unsigned char ch = (unsigned char)buf[i];
+        int result;
 
-        char k[512], v[512];
-        for (int i = 0; raw_p[i]; i++, raw_p++)
+        switch (p->state)
         {
-            if (sscanf(raw_p, "%511[^=]=%511[^&]", k, v) == 2)
+        case PARSE_START:
+            if (ch == '\r' || ch == '\n')
             {
-                set_raw_request_param(r, k, v);
+                // RFC 9112 (section 2.2): empty lines received before the request line are ignored.
+                p->start = i + 1;
+                break;
             }
-            
-            if ((raw_p = strchr(raw_p, '&')) == NULL)
+            p->state = PARSE_METHOD;
+            /* fallthrough */
+        case PARSE_METHOD:
+            if (ch == ' ')
             {
-                break;
+                p->method_len = i - p->start;
+                if (p->method_len == 0) return CTTP_ERROR_RAW_INITIAL_LINE;
+
+                p->uri_off = i + 1;
+                p->path_len = (size_t)-1;
+                p->state = PARSE_URI;
+            }
+            else if (!INCTTP_TOKEN[ch])
+            {
+                return CTTP_ERROR_RAW_INITIAL_LINE;
+            }
+            break;
+        case PARSE_URI:
+            if (ch == ' ')
+            {
+                p->uri_len = i - p->uri_off;
+                if (p->uri_len == 0) return CTTP_ERROR_RAW_INITIAL_LINE;
+                if (p->path_len == (size_t)-1) p->path_len = p->uri_len;
+
+                p->version_off = i + 1;
+                p->state = PARSE_VERSION;
+            }
+            else if (ch == '?' && p->path_len == (size_t)-1)
+            {
+                p->path_len = i - p->uri_off;
+            }
+            else if (ch <= ' ' || ch == 0x7f)
+            {
+                return CTTP_ERROR_RAW_INITIAL_LINE;
+            }
+            break;
+        case PARSE_VERSION:
+            if (ch == '\r' || ch == '\n')
+            {
+                // HTTP-version = "HTTP/" DIGIT "." DIGIT
+                p->version_len = i - p->version_off;
+                const char *v = buf + p->version_off;
+                if (p->version_len != 8 || memcmp(v, "HTTP/", 5) != 0 || v[5] < '0' || v[5] > '9' || v[6] != '.' || v[7] < '0' || v[7] > '9')
+                {
+                    return CTTP_ERROR_RAW_INITIAL_LINE;
+                }
+                if (v[5] != '1') return CTTP_ERROR_VERSION_NOT_SUPPORTED;
+
+                p->state = ch == '\r' ? PARSE_REQUEST_LINE_LF : PARSE_HEADER_START;
+            }
+            break;
+        case PARSE_REQUEST_LINE_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_INITIAL_LINE;
+            p->state = PARSE_HEADER_START;
+            break;
+        case PARSE_HEADER_START:
+            if (ch == '\r')
+            {
+                p->state = PARSE_HEAD_END_LF;
+            }
+            else if (ch == '\n')
+            {
+                if ((result = end_head(p, buf, cs, i + 1)) < 1) return result;
+            }
+            else if (INCTTP_TOKEN[ch])
+            {
+                if (p->hcount == CTTP_HEADER_LIMIT) return CTTP_ERROR_HEADER_FIELDS_TOO_LARGE;
+
+                p->mark = i;
+                p->state = PARSE_HEADER_KEY;
+            }
+            else
+            {
+                // Includes obsolete line folding, which RFC 9112 (section 5.2) allows rejecting.
+                return CTTP_ERROR_RAW_REQUEST_HEADERS;
             }
+            break;
+        case PARSE_HEADER_KEY:
+            if (ch == ':')
+            {
+                p->headers[p->hcount].koff = (unsigned int)p->mark;
+                p->headers[p->hcount].klen = (unsigned int)(i - p->mark);
+                p->state = PARSE_HEADER_VALUE_START;
+            }
+            else if (!INCTTP_TOKEN[ch])
+            {
+                return CTTP_ERROR_RAW_REQUEST_HEADERS;
+            }
+            break;
+        case PARSE_HEADER_VALUE_START:
+            // Leading whitespace is not part of the value.
+            if (ch == ' ' || ch == '\t') break;
+
+            p->mark = i;
+            p->vend = i;
+            p->state = PARSE_HEADER_VALUE;
+            /* fallthrough */
+        case PARSE_HEADER_VALUE:
+            if (ch == '\r' || ch == '\n')
+            {
+                if ((result = end_header(p, buf)) < 1) return result;
+                p->state = ch == '\r' ? PARSE_HEADER_LF : PARSE_HEADER_START;
+            }
+            else if (ch != ' ' && ch != '\t')
+            {
+                if (ch < ' ' || ch == 0x7f) return CTTP_ERROR_RAW_REQUEST_HEADERS;
+                // Trailing whitespace is not part of the value either: only extend it on visible characters.
+                p->vend = i + 1;
+            }
+            break;
+        case PARSE_HEADER_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_REQUEST_HEADERS;
+            p->state = PARSE_HEADER_START;
+            break;
+        case PARSE_HEAD_END_LF:
+            if (ch != '\n') return CTTP_ERROR_RAW_REQUEST_HEADERS;
+            if ((result = end_head(p, buf, cs, i + 1)) < 1) return result;
+            break;
         }
     }
-    return 1;
+
+    if (p->state < PARSE_BODY)
+    {
+        if (i - p->start >= cs->hsize)
+        {
+            return p->state <= PARSE_URI ? CTTP_ERROR_URI_TOO_LONG : CTTP_ERROR_HEADER_FIELDS_TOO_LARGE;
+        }
+
+        p->pos = i;
+        return INCTTP_PARSE_INCOMPLETE;
+    }
+
+    // The route reads the body from the connection itself, once the head is handled.
+    if (p->stream_body)
+    {
+        p->pos = p->body_off;
+        p->state = PARSE_DONE;
+        return INCTTP_PARSE_COMPLETE;
+    }
+
+    // A chunked body is validated as it arrives, and decoded in place once complete.
+    if (p->chunked)
+    {
+        size_t at = p->pos > p->body_off ? p->pos : p->body_off;
+        while (1)
+        {
+            size_t off, n = (size_t)-1;
+            int decoded = INCTTP_decode_chunked(&p->chunk, buf, &at, len, &off, &n);
+            if (decoded < 1) return decoded;
+
+            p->body_len += n;
+            if (p->body_len >= cs->bsize) return CTTP_ERROR_CONTENT_TOO_LARGE;
+            if (decoded == INCTTP_PARSE_COMPLETE) break;
+            if (at == len)
+            {
+                p->pos = len;
+                return INCTTP_PARSE_INCOMPLETE;
+            }
+        }
+
+        p->pos = at;
+        p->state = PARSE_DONE;
+        return INCTTP_PARSE_COMPLETE;
+    }
+
+    // The body is framed by `Content-Length` and is not scanned.
+    if (len - p->body_off < p->content_length)
+    {
+        p->pos = len;
+        return INCTTP_PARSE_INCOMPLETE;
+    }
+
+    p->pos = p->body_off + p->content_length;
+    p->state = PARSE_DONE;
+    return INCTTP_PARSE_COMPLETE;
 }
 
-static int parse_raw_body(CTTP_Server *cs, CTTP_Request *r, const char *restrict raw_r)
+int INCTTP_parse_method(const char *m, size_t len)
 {
-    const char *body_start = strstr(raw_r, "\r\n\r\n");
-    if (!body_start)
+    switch (len)
     {
-        r->body[0] = '\0';
-        return 1;
+    case 3:
+        if (memcmp(m, "GET", 3) == 0) return CTTP_METHOD_GET;
+        if (memcmp(m, "PUT", 3) == 0) return CTTP_METHOD_PUT;
+        break;
+    case 4:
+        if (memcmp(m, "POST", 4) == 0) return CTTP_METHOD_POST;
+        if (memcmp(m, "HEAD", 4) == 0) return CTTP_METHOD_HEAD;
+        break;
+    case 5:
+        if (memcmp(m, "PATCH", 5) == 0) return CTTP_METHOD_PATCH;
+        if (memcmp(m, "TRACE", 5) == 0) return CTTP_METHOD_TRACE;
+        break;
+    case 6:
+        if (memcmp(m, "DELETE", 6) == 0) return CTTP_METHOD_DELETE;
+        break;
+    case 7:
+        if (memcmp(m, "OPTIONS", 7) == 0) return CTTP_METHOD_OPTIONS;
+        if (memcmp(m, "CONNECT", 7) == 0) return CTTP_METHOD_CONNECT;
+        break;
     }
-    
-    body_start += 4;
 
-    size_t body_len = strlen(body_start);
-    if (body_len >= cs->bsize)
+    return CTTP_METHOD_OTHER;
+}
+
+int INCTTP_header_id(const char *k, size_t len)
+{
+#define IS(name, id) if (strncasecmp(k, name, len) == 0) return id
+
+    switch (len)
     {
-        return CTTP_ERROR_CONTENT_TOO_LARGE;
+    case 2:
+        IS("TE", CTTP_HEADER_TE);
+        break;
+    case 4:
+        IS("Host", CTTP_HEADER_HOST);
+        IS("Vary", CTTP_HEADER_VARY);
+        break;
+    case 5:
+        IS("Range", CTTP_HEADER_RANGE);
+        break;
+    case 6:
+        IS("Accept", CTTP_HEADER_ACCEPT);
+        IS("Cookie", CTTP_HEADER_COOKIE);
+        IS("Expect", CTTP_HEADER_EXPECT);
+        IS("Origin", CTTP_HEADER_ORIGIN);
+        break;
+    case 7:
+        IS("Referer", CTTP_HEADER_REFERER);
+        IS("Upgrade", CTTP_HEADER_UPGRADE);
+        break;
+    case 10:
+        IS("Connection", CTTP_HEADER_CONNECTION);
+        IS("User-Agent", CTTP_HEADER_USER_AGENT);
+        break;
+    case 12:
+        IS("Content-Type", CTTP_HEADER_CONTENT_TYPE);
+        IS("X-Request-Id", CTTP_HEADER_X_REQUEST_ID);
+        break;
+    case 13:
+        IS("Authorization", CTTP_HEADER_AUTHORIZATION);
+        IS("Cache-Control", CTTP_HEADER_CACHE_CONTROL);
+        IS("If-None-Match", CTTP_HEADER_IF_NONE_MATCH);
+        break;
+    case 14:
+        IS("Content-Length", CTTP_HEADER_CONTENT_LENGTH);
+        break;
+    case 15:
+        IS("Accept-Encoding", CTTP_HEADER_ACCEPT_ENCODING);
+        IS("Accept-Language", CTTP_HEADER_ACCEPT_LANGUAGE);
+        IS("X-Forwarded-For", CTTP_HEADER_X_FORWARDED_FOR);
+        break;
+    case 16:
+        IS("Content-Encoding", CTTP_HEADER_CONTENT_ENCODING);
+        break;
+    case 17:
+        IS("Transfer-Encoding", CTTP_HEADER_TRANSFER_ENCODING);
+        IS("If-Modified-Since", CTTP_HEADER_IF_MODIFIED_SINCE);
+        break;
     }
 
-    strcpy(r->body, body_start);
-    return 1;
+#undef IS
+    return CTTP_HEADER_OTHER;
+}
+
+/**
+ * Terminates every parameter of the query string `q` of `len` bytes in place, replacing the `&` separators
+ * with NUL bytes, and returns the number of parameters.
+ */
+static size_t split_raw_params(char *q, size_t len)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (q[i] != '&') continue;
+
+        // Empty pairs (e.g. `&&`) are not parameters.
+        if (i > 0 && q[i - 1] != '\0') count++;
+        q[i] = '\0';
+    }
+
+    if (len > 0 && q[len - 1] != '\0') count++;
+    return count;
+}
+
+/**
+ * Decodes in place the chunked body of `buf` between `start` and `end`, already validated by the parser, moving its
+ * data to `start`. Returns the decoded size.
+ */
+static size_t dechunk(char *buf, size_t start, size_t end)
+{
+    INCTTP_Chunked d;
+    INCTTP_init_chunked(&d);
+
+    size_t at = start;
+    size_t dst = start;
+    int decoded = INCTTP_PARSE_INCOMPLETE;
+    while (decoded == INCTTP_PARSE_INCOMPLETE && at < end)
+    {
+        size_t off, n = (size_t)-1;
+        decoded = INCTTP_decode_chunked(&d, buf, &at, end, &off, &n);
+        if (n == 0) continue;
+
+        memmove(buf + dst, buf + off, n);
+        dst += n;
+    }
+
+    return dst - start;
 }
 
-int INCTTP_parse_raw_request(const char *restrict raw_r, CTTP_Request *r, CTTP_Server *cs)
+int INCTTP_fill_request(INCTTP_Parser *p, char *buf, CTTP_Request *r, INCTTP_Arena *a, CTTP_Server *cs)
 {
-    // Parse initial request line
-    if (sscanf(raw_r, "%244s %511s %244s", r->method, r->uri, r->http_version) != 3)
+    // Views are NUL-terminated in place by overwriting the delimiter right after them (a space, `?`, `:`,
+    // `&`, whitespace or a line break), none of which belong to any view.
+    r->method = INCTTP_parse_method(buf + p->start, p->method_len);
+    r->method_name.ptr = buf + p->start;
+    r->method_name.len = p->method_len;
+    buf[p->start + p->method_len] = '\0';
+
+    r->version = buf[p->version_off + 7] == '0' ? CTTP_VERSION_1_0 : CTTP_VERSION_1_1;
+
+    r->uri.ptr = buf + p->uri_off;
+    r->uri.len = p->path_len;
+    buf[p->uri_off + p->path_len] = '\0';
+
+    r->query.ptr = buf + p->uri_off + p->path_len;
+    r->query.len = 0;
+    r->params_count = 0;
+    r->path_params_count = 0;
+    if (p->path_len < p->uri_len)
     {
-        return CTTP_ERROR_RAW_INITIAL_LINE;
+        // For security, limit the length of parameters to prevent potential attacks, such as SQL injection.
+        r->query.ptr++;
+        r->query.len = p->uri_len - p->path_len - 1;
+        if (r->query.len >= cs->psize) return CTTP_ERROR_CONTENT_TOO_LARGE;
+
+        buf[p->uri_off + p->uri_len] = '\0';
+        r->params_count = split_raw_params((char *)r->query.ptr, r->query.len);
+        if (r->params_count > CTTP_PARAM_LIMIT) return CTTP_ERROR_CONTENT_TOO_LARGE;
+    }
+
+    // The header table is sized to the request instead of `CTTP_HEADER_LIMIT`.
+    CTTP_Header *headers = (CTTP_Header *)INCTTP_arena_alloc(a, p->hcount * sizeof(CTTP_Header));
+    if (headers == NULL && p->hcount > 0) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    memset(r->known, 0, sizeof(r->known));
+    size_t others = 0;
+
+    for (size_t i = 0; i < p->hcount; i++)
+    {
+        INCTTP_HeaderSpan *h = &p->headers[i];
+        headers[i].key = buf + h->koff;
+        headers[i].klen = h->klen;
+        headers[i].val = buf + h->voff;
+        headers[i].vlen = h->vlen;
+        headers[i].id = (int)h->id;
+
+        buf[h->koff + h->klen] = '\0';
+        buf[h->voff + h->vlen] = '\0';
+
+        if (h->id == CTTP_HEADER_OTHER) others++;
+        else if (r->known[h->id] == NULL) r->known[h->id] = &headers[i];
     }
+    r->headers = headers;
+    r->hsize = p->hcount;
+
+    // The other headers go to a hash table at most half full, so probe sequences stay short.
+    r->others = NULL;
+    r->others_size = 0;
+    if (others > 0)
+    {
+        size_t size = 8;
+        while (size < others * 2) size *= 2;
+
+        r->others = (CTTP_Header **)INCTTP_arena_alloc(a, size * sizeof(CTTP_Header *));
+        if (r->others == NULL) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+        memset(r->others, 0, size * sizeof(CTTP_Header *));
+        r->others_size = size;
 
-    int headers = parse_raw_headers(cs, r, raw_r);
-    if (headers < 1) return headers;
+        for (size_t i = 0; i < p->hcount; i++)
+        {
+            if (headers[i].id != CTTP_HEADER_OTHER) continue;
 
-    int parameters = parse_raw_params(cs, r, r->uri);
-    if (parameters< 1) return parameters;
+            size_t slot = hash_key(headers[i].key, headers[i].klen) & (size - 1);
+            while (r->others[slot] != NULL) slot = (slot + 1) & (size - 1);
+            r->others[slot] = &headers[i];
+        }
+    }
 
-    int body = parse_raw_body(cs, r, raw_r);
-    if (body < 1) return body;
+    // The body is binary and may be followed by a pipelined request, so it is not terminated.
+    r->reader = NULL;
+    r->body.ptr = buf + p->body_off;
+    r->body.len = p->stream_body ? 0 : p->chunked ? dechunk(buf, p->body_off, p->pos) : p->content_length;
 
     // print_request(r);
     return 1;
 }
+
+int INCTTP_parse_raw_request(char *raw_r, size_t len, CTTP_Request *r, INCTTP_Arena *a, CTTP_Server *cs)
+{
+    INCTTP_Parser p;
+    INCTTP_init_parser(&p);
+
+    int result = INCTTP_parse_request(&p, raw_r, len, cs);
+    if (result != INCTTP_PARSE_COMPLETE) return result;
+
+    return INCTTP_fill_request(&p, raw_r, r, a, cs);
+}
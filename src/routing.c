@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -6,79 +7,448 @@
 
 CTTP_RouteNode* INCTTP_new_route_node()
 {
-    CTTP_RouteNode* node = (CTTP_RouteNode *)malloc(sizeof(CTTP_RouteNode));
-    if (node == NULL) return NULL;
-    
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+    // Every field starts zeroed: no prefix, no children and no handler.
+    return (CTTP_RouteNode *)calloc(1, sizeof(CTTP_RouteNode));
+}
+
+void INCTTP_free_route_node(CTTP_RouteNode *root)
+{
+    for (size_t i = 0; i < root->nchildren; i++)
+    {
+        INCTTP_free_route_node(root->children[i]);
+    }
+
+    if (root->param != NULL) INCTTP_free_route_node(root->param);
+    if (root->catch_all != NULL) INCTTP_free_route_node(root->catch_all);
+
+    free(root->data);
+    free(root->allow);
+    free(root->indices);
+    free(root->children);
+    free(root);
+}
+
+/**
+ * Returns the child of `node` whose prefix starts with byte `c`, or `NULL`.
+ */
+static CTTP_RouteNode *find_child(CTTP_RouteNode *node, char c)
+{
+    // Fan-out is small and `indices` is contiguous, so a linear scan beats a binary search.
+    for (size_t i = 0; i < node->nchildren; i++)
     {
-        node->children[i] = NULL;
+        if (node->indices[i] == c) return node->children[i];
     }
 
-    node->handler = NULL;
-    node->method = NULL;
+    return NULL;
+}
+
+/**
+ * Inserts `child` into `node`, keeping `indices` sorted. Returns 0 if an error occurs.
+ */
+static int add_child(CTTP_RouteNode *node, CTTP_RouteNode *child)
+{
+    char *indices = (char *)realloc(node->indices, node->nchildren + 1);
+    if (indices == NULL) return 0;
+    node->indices = indices;
+
+    CTTP_RouteNode **children = (CTTP_RouteNode **)realloc(node->children, (node->nchildren + 1) * sizeof(CTTP_RouteNode *));
+    if (children == NULL) return 0;
+    node->children = children;
+
+    unsigned char c = (unsigned char)child->prefix[0];
+    size_t at = 0;
+    while (at < node->nchildren && (unsigned char)node->indices[at] < c) at++;
+
+    memmove(node->indices + at + 1, node->indices + at, node->nchildren - at);
+    memmove(node->children + at + 1, node->children + at, (node->nchildren - at) * sizeof(CTTP_RouteNode *));
+    node->indices[at] = (char)c;
+    node->children[at] = child;
+    node->nchildren++;
+
+    return 1;
+}
+
+/**
+ * Creates a node matching the first `len` bytes of `p`. Returns `NULL` if an error occurs.
+ * The prefix is stored right after the node, so matching it does not touch another cache line.
+ */
+static CTTP_RouteNode *new_prefixed_node(const char *p, size_t len)
+{
+    CTTP_RouteNode *node = (CTTP_RouteNode *)calloc(1, sizeof(CTTP_RouteNode) + len + 1);
+    if (node == NULL) return NULL;
+
+    node->prefix = (char *)(node + 1);
+    node->plen = len;
+    memcpy(node->prefix, p, len);
 
     return node;
 }
 
-void INCTTP_free_route_node(CTTP_RouteNode *root)
+/**
+ * Splits `node` after the first `at` bytes of its prefix: the remainder, along with the node's children
+ * and handlers, moves to a new single child. Returns 0 if an error occurs.
+ */
+static int split_node(CTTP_RouteNode *node, size_t at)
 {
-    for (int i = 0; i < ALPHABET_SIZE; i++)
+    CTTP_RouteNode *tail = new_prefixed_node(node->prefix + at, node->plen - at);
+    if (tail == NULL) return 0;
+
+    tail->indices = node->indices;
+    tail->children = node->children;
+    tail->nchildren = node->nchildren;
+    tail->param = node->param;
+    tail->catch_all = node->catch_all;
+    memcpy(tail->handlers, node->handlers, sizeof(node->handlers));
+    tail->methods = node->methods;
+    tail->streams = node->streams;
+    tail->suspends = node->suspends;
+    tail->allow = node->allow;
+    tail->data = node->data;
+    tail->id = node->id;
+
+    node->indices = NULL;
+    node->children = NULL;
+    node->nchildren = 0;
+    node->param = NULL;
+    node->catch_all = NULL;
+    memset(node->handlers, 0, sizeof(node->handlers));
+    node->methods = 0;
+    node->streams = 0;
+    node->suspends = 0;
+    node->allow = NULL;
+    node->data = NULL;
+    node->id = 0;
+    node->plen = at;
+    node->prefix[at] = '\0';
+
+    return add_child(node, tail);
+}
+
+/**
+ * Inserts the static path `p` of `len` bytes below `node`. Returns the node where it ends, or `NULL` if an error occurs.
+ */
+static CTTP_RouteNode *insert_static(CTTP_RouteNode *node, const char *p, size_t len)
+{
+    while (len > 0)
     {
-        if (root->children[i] != NULL)
+        CTTP_RouteNode *child = find_child(node, *p);
+        if (child == NULL)
         {
-            INCTTP_free_route_node(root->children[i]);
+            child = new_prefixed_node(p, len);
+            if (child == NULL) return NULL;
+            if (add_child(node, child) == 0)
+            {
+                INCTTP_free_route_node(child);
+                return NULL;
+            }
+
+            return child;
         }
+
+        // Length of the prefix shared by the child and the remaining path.
+        size_t common = 0;
+        while (common < child->plen && common < len && p[common] == child->prefix[common]) common++;
+
+        if (common < child->plen && split_node(child, common) == 0) return NULL;
+        p += common;
+        len -= common;
+        node = child;
     }
 
-    free(root);
+    return node;
 }
 
-void CTTP_add_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h)
+/**
+ * Returns the parameter or catch-all child (`*slot`) of a node, creating it with `name` of `len` bytes.
+ * Returns `NULL` if an error occurs or if the existing child has another name.
+ */
+static CTTP_RouteNode *insert_wildcard(CTTP_RouteNode **slot, int kind, const char *name, size_t len)
+{
+    if (*slot != NULL)
+    {
+        if ((*slot)->plen != len || memcmp((*slot)->prefix, name, len) != 0) return NULL;
+        return *slot;
+    }
+
+    CTTP_RouteNode *node = new_prefixed_node(name, len);
+    if (node == NULL) return NULL;
+
+    node->kind = kind;
+    *slot = node;
+
+    return node;
+}
+
+/* Method names, indexed by `CTTP_METHOD` */
+static const char *const METHOD_NAMES[CTTP_METHOD_COUNT] = {
+    NULL, "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH",
+};
+
+/**
+ * Returns the bitmask of the methods listed in `m`, separated by `,`. Unknown methods are skipped.
+ */
+static unsigned int parse_methods(const char *m)
+{
+    unsigned int methods = 0;
+
+    while (*m != '\0')
+    {
+        while (*m == ' ' || *m == ',') m++;
+
+        size_t len = 0;
+        while (m[len] != '\0' && m[len] != ',' && m[len] != ' ') len++;
+        if (len == 0) break;
+
+        int method = INCTTP_parse_method(m, len);
+        if (method != CTTP_METHOD_OTHER) methods |= 1u << method;
+        m += len;
+    }
+
+    return methods;
+}
+
+/**
+ * Registers handler `h` for the `methods` of `node` and rebuilds its `Allow` value. Returns 0 if an error occurs.
+ */
+static int set_handlers(CTTP_RouteNode *node, unsigned int methods, CTTP_RouteHandler h)
+{
+    for (int i = 0; i < CTTP_METHOD_COUNT; i++)
+    {
+        if (methods & (1u << i)) node->handlers[i] = h;
+    }
+    node->methods |= methods;
+    node->streams &= ~methods;
+    node->suspends &= ~methods;
+
+    // HEAD is answered by the GET handler unless it has one of its own.
+    if (!(node->methods & (1u << CTTP_METHOD_HEAD))) node->handlers[CTTP_METHOD_HEAD] = node->handlers[CTTP_METHOD_GET];
+
+    // Longest value: every method name plus a ", " separator each.
+    char allow[64];
+    size_t len = 0;
+    for (int i = 1; i < CTTP_METHOD_COUNT; i++)
+    {
+        if (node->handlers[i] == NULL) continue;
+        len += (size_t)snprintf(allow + len, sizeof(allow) - len, "%s%s", len > 0 ? ", " : "", METHOD_NAMES[i]);
+    }
+
+    char *copy = strdup(allow);
+    if (copy == NULL) return 0;
+
+    free(node->allow);
+    node->allow = copy;
+
+    return 1;
+}
+
+CTTP_RouteNode *INCTTP_insert_route(CTTP_Server *cs, const char *m, const char *p, CTTP_RouteHandler h)
 {
-    if (h == NULL) return;
+    unsigned int methods = parse_methods(m);
+    if (h == NULL || methods == 0) return NULL;
     CTTP_RouteNode *node = cs->routes;
+    size_t params = 0;
+    size_t i = 0;
 
-    for (int i = 0; p[i] != '\0'; i++)
+    while (p[i] != '\0')
     {
-        int ascii_code = (int)p[i];
-        if (node->children[ascii_code] == NULL)
+        // Static run up to the next segment starting with `:` or `*`.
+        size_t start = i;
+        while (p[i] != '\0' && !((p[i] == ':' || p[i] == '*') && i > 0 && p[i - 1] == '/')) i++;
+
+        node = insert_static(node, p + start, i - start);
+        if (node == NULL || p[i] == '\0') break;
+
+        if (++params > CTTP_PATH_PARAM_LIMIT) return NULL;
+
+        if (p[i] == ':')
+        {
+            size_t name = ++i;
+            while (p[i] != '\0' && p[i] != '/') i++;
+
+            node = insert_wildcard(&node->param, CTTP_ROUTE_PARAM, p + name, i - name);
+        }
+        else
         {
-            node->children[ascii_code] = INCTTP_new_route_node();
+            // A catch-all takes the rest of the path, so the rest of the pattern is its name. A bare `*` is named `*`.
+            size_t name = ++i;
+            i += strlen(p + i);
+            if (i == name) name--;
+
+            node = insert_wildcard(&node->catch_all, CTTP_ROUTE_CATCH_ALL, p + name, i - name);
         }
 
-        node = node->children[ascii_code];
+        if (node == NULL) return NULL;
     }
 
-    node->handler = h;
-    node->method = m;
+    if (node == NULL || set_handlers(node, methods, h) == 0) return NULL;
+
+    return node;
 }
 
-int CTTP_read_route(CTTP_Server *cs, CTTP_RouteNode **r, char *p, char *m)
+void CTTP_add_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h)
 {
-    CTTP_RouteNode *node = cs->routes;
-    
-    for (int i = 0; p[i] != '\0'; i++)
+    INCTTP_insert_route(cs, m, p, h);
+}
+
+CTTP_RouteNode *INCTTP_insert_async_route(CTTP_Server *cs, const char *m, const char *p, CTTP_RouteHandler h)
+{
+    CTTP_RouteNode *node = INCTTP_insert_route(cs, m, p, h);
+    if (node == NULL) return NULL;
+
+    unsigned int methods = parse_methods(m);
+    // HEAD requests answered by the GET handler run on a coroutine as well.
+    if ((methods & (1u << CTTP_METHOD_GET)) && !(node->methods & (1u << CTTP_METHOD_HEAD))) methods |= 1u << CTTP_METHOD_HEAD;
+
+    node->suspends |= methods;
+    cs->async = 1;
+    return node;
+}
+
+void CTTP_add_async_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h)
+{
+    INCTTP_insert_async_route(cs, m, p, h);
+}
+
+void CTTP_add_stream_route(CTTP_Server *cs, char *m, char *p, CTTP_RouteHandler h)
+{
+    // Bodies arrive at the client's pace, so the handler waits for them on a coroutine rather than holding the worker.
+    CTTP_RouteNode *node = INCTTP_insert_async_route(cs, m, p, h);
+    if (node == NULL) return;
+
+    node->streams |= parse_methods(m);
+    cs->streams = 1;
+}
+
+/**
+ * Captures the value `v` of `len` bytes of the path parameter matched by `node`.
+ */
+static void capture(CTTP_Request *r, CTTP_RouteNode *node, const char *v, size_t len)
+{
+    r->path_params[r->path_params_count].name = node->prefix;
+    r->path_params[r->path_params_count].val.ptr = v;
+    r->path_params[r->path_params_count].val.len = len;
+    r->path_params_count++;
+}
+
+/**
+ * Matches path `p` of `len` bytes against the subtree of `node`, whose own prefix has already been matched.
+ * Static children are tried first, then the parameter child, then the catch-all, so the walk only steps back
+ * when a static branch dead-ends at a position where a parameter was also registered.
+ * Captures go to `r`. Returns the endpoint node, or `NULL`.
+ */
+static CTTP_RouteNode *match(CTTP_RouteNode *node, const char *p, size_t len, CTTP_Request *r)
+{
+    CTTP_RouteNode *child;
+
+    while (1)
     {
-        int ascii_code = (int)p[i];
-        if (node->children[ascii_code] == NULL)
+        if (len == 0)
         {
-            return CTTP_ERROR_ROUTE_NOT_FOUND;
+            if (node->methods != 0) return node;
+
+            // `/files/*path` also matches `/files/`, with an empty capture.
+            if (node->catch_all != NULL && node->catch_all->methods != 0)
+            {
+                capture(r, node->catch_all, p, 0);
+                return node->catch_all;
+            }
+
+            return NULL;
         }
 
-        node = node->children[ascii_code];
+        child = find_child(node, *p);
+        if (child != NULL && (child->plen > len || memcmp(p, child->prefix, child->plen) != 0)) child = NULL;
+
+        // Wildcard children are the only alternatives to a static child, so without them the walk goes straight down.
+        if (node->param != NULL || node->catch_all != NULL) break;
+        if (child == NULL) return NULL;
+
+        node = child;
+        p += child->plen;
+        len -= child->plen;
+    }
+
+    if (child != NULL)
+    {
+        CTTP_RouteNode *found = match(child, p + child->plen, len - child->plen, r);
+        if (found != NULL) return found;
+    }
+
+    if (node->param != NULL)
+    {
+        size_t seg = 0;
+        while (seg < len && p[seg] != '/') seg++;
+
+        if (seg > 0)
+        {
+            size_t captured = r->path_params_count;
+            capture(r, node->param, p, seg);
+
+            CTTP_RouteNode *found = match(node->param, p + seg, len - seg, r);
+            if (found != NULL) return found;
+
+            r->path_params_count = captured;
+        }
+    }
+
+    if (node->catch_all != NULL && node->catch_all->methods != 0)
+    {
+        capture(r, node->catch_all, p, len);
+        return node->catch_all;
     }
 
+    return NULL;
+}
 
-    if (node == NULL || node->handler == NULL)
+int INCTTP_route_request(CTTP_Server *cs, CTTP_RouteNode **route, CTTP_Request *r)
+{
+    r->path_params_count = 0;
+
+    CTTP_RouteNode *node = match(cs->routes, r->uri.ptr, r->uri.len, r);
+    if (node == NULL)
     {
+        r->path_params_count = 0;
         return CTTP_ERROR_ROUTE_NOT_FOUND;
     }
 
-    if (node != NULL && node->handler != NULL && strcmp(node->method, m) != 0)
+    *route = node;
+    r->route = node;
+    if (node->handlers[r->method] == NULL)
     {
         return CTTP_ERROR_METHOD_NOT_ALLOWED;
     }
-    
-    *r = node;
+
     return 1;
 }
+
+int INCTTP_route_streams_body(CTTP_Server *cs, int method, const char *p, size_t len)
+{
+    CTTP_Request req;
+    req.uri.ptr = p;
+    req.uri.len = len;
+    req.method = method;
+
+    CTTP_RouteNode *node;
+    return INCTTP_route_request(cs, &node, &req) == 1 && (node->streams & (1u << method)) != 0;
+}
+
+int INCTTP_route_suspends(CTTP_Server *cs, int method, const char *p, size_t len)
+{
+    CTTP_Request req;
+    req.uri.ptr = p;
+    req.uri.len = len;
+    req.method = method;
+
+    CTTP_RouteNode *node;
+    return INCTTP_route_request(cs, &node, &req) == 1 && (node->suspends & (1u << method)) != 0;
+}
+
+int CTTP_read_route(CTTP_Server *cs, CTTP_RouteNode **r, const char *p, const char *m)
+{
+    CTTP_Request req;
+    req.uri.ptr = p;
+    req.uri.len = strlen(p);
+    req.method = INCTTP_parse_method(m, strlen(m));
+
+    return INCTTP_route_request(cs, r, &req);
+}
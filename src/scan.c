@@ -0,0 +1,213 @@
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#include "cttp-internal.h"
+
+const unsigned char INCTTP_TOKEN[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+/**
+ * Byte classes the kernels scan over. Each one is defined by the bytes that stop the scan.
+ */
+enum SCAN_KIND
+{
+    SCAN_TOKEN, /* Stops at any byte that is not a token character */
+    SCAN_VALUE, /* Stops at control characters other than HTAB, CR and LF included */
+    SCAN_URI,   /* Stops at control characters, space and `?` */
+};
+
+static inline int is_stop(int kind, unsigned char ch)
+{
+    switch (kind)
+    {
+    case SCAN_TOKEN:
+        return !INCTTP_TOKEN[ch];
+    case SCAN_VALUE:
+        return (ch < ' ' && ch != '\t') || ch == 0x7f;
+    default:
+        return ch <= ' ' || ch == '?' || ch == 0x7f;
+    }
+}
+
+static inline size_t scan_scalar(int kind, const unsigned char *buf, size_t pos, size_t end)
+{
+    while (pos < end && !is_stop(kind, buf[pos])) pos++;
+    return pos;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * SSE4.2 kernel: `pcmpestri` matches 16 bytes at once against up to 8 byte ranges. Token characters need more
+ * ranges than that, so their ranges are a superset of the stop bytes and matches are confirmed one byte at a time.
+ */
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(int kind, const unsigned char *buf, size_t pos, size_t end)
+{
+    __m128i ranges;
+    int nranges;
+
+    switch (kind)
+    {
+    case SCAN_TOKEN:
+        // Also stops at `!` and `|`, which are token characters.
+        ranges = _mm_setr_epi8(0x00, 0x22, 0x28, 0x29, 0x2c, 0x2c, 0x2f, 0x2f,
+                               0x3a, 0x40, 0x5b, 0x5d, 0x7b, 0x7d, 0x7f, (char)0xff);
+        nranges = 16;
+        break;
+    case SCAN_VALUE:
+        ranges = _mm_setr_epi8(0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        nranges = 6;
+        break;
+    default:
+        ranges = _mm_setr_epi8(0x00, 0x20, 0x3f, 0x3f, 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        nranges = 6;
+        break;
+    }
+
+    while (pos + 16 <= end)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+        int at = _mm_cmpestri(ranges, nranges, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (at == 16)
+        {
+            pos += 16;
+            continue;
+        }
+
+        pos += (size_t)at;
+        if (is_stop(kind, buf[pos])) return pos;
+        pos++;
+    }
+
+    return scan_scalar(kind, buf, pos, end);
+}
+
+/**
+ * AVX2 kernel: classifies 32 bytes at once with comparisons, or for tokens with a nibble lookup table, and returns
+ * the first stop byte found in the resulting mask.
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(int kind, const unsigned char *buf, size_t pos, size_t end)
+{
+    // Token lookup: bit `hi` of `lo_lut[lo]` is set when byte `hi << 4 | lo` is a token character,
+    // and `hi_lut[hi]` selects that bit. Bytes from 0x80 select nothing.
+    const __m256i lo_lut = _mm256_setr_epi8(
+        (char)0xe8, (char)0xfc, (char)0xf8, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc,
+        (char)0xf8, (char)0xf8, (char)0xf4, 0x54, (char)0xd0, 0x54, (char)0xf4, 0x70,
+        (char)0xe8, (char)0xfc, (char)0xf8, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc, (char)0xfc,
+        (char)0xf8, (char)0xf8, (char)0xf4, 0x54, (char)0xd0, 0x54, (char)0xf4, 0x70);
+    const __m256i hi_lut = _mm256_setr_epi8(
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (pos + 32 <= end)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + pos));
+        __m256i stop;
+
+        switch (kind)
+        {
+        case SCAN_TOKEN:
+        {
+            __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(v, nibble));
+            __m256i hi = _mm256_shuffle_epi8(hi_lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            stop = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero);
+            break;
+        }
+        case SCAN_VALUE:
+        {
+            // Comparisons are signed: bytes from 0x80 are negative and never control characters.
+            __m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-1)),
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v));
+            ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), ctl);
+            stop = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+            break;
+        }
+        default:
+        {
+            __m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-1)),
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8(' ' + 1), v));
+            stop = _mm256_or_si256(ctl, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)),
+                                                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?'))));
+            break;
+        }
+        }
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(stop);
+        if (mask != 0) return pos + (size_t)__builtin_ctz(mask);
+        pos += 32;
+    }
+
+    return scan_scalar(kind, buf, pos, end);
+}
+
+#endif
+
+/* Kernel picked for this CPU: 2 for AVX2, 1 for SSE4.2, 0 for scalar, -1 until detected */
+static int scan_level = -1;
+
+static int detect_level()
+{
+    int level = __atomic_load_n(&scan_level, __ATOMIC_RELAXED);
+    if (level >= 0) return level;
+
+    level = 0;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) level = 2;
+    else if (__builtin_cpu_supports("sse4.2")) level = 1;
+#endif
+
+    __atomic_store_n(&scan_level, level, __ATOMIC_RELAXED);
+    return level;
+}
+
+static inline size_t scan(int kind, const char *buf, size_t pos, size_t end)
+{
+    const unsigned char *b = (const unsigned char *)buf;
+
+    // Short runs are not worth a vector load.
+    if (end - pos < 16) return scan_scalar(kind, b, pos, end);
+
+#ifdef SCAN_X86
+    switch (detect_level())
+    {
+    case 2:
+        return scan_avx2(kind, b, pos, end);
+    case 1:
+        return scan_sse42(kind, b, pos, end);
+    }
+#endif
+
+    return scan_scalar(kind, b, pos, end);
+}
+
+size_t INCTTP_scan_token(const char *buf, size_t pos, size_t end)
+{
+    return scan(SCAN_TOKEN, buf, pos, end);
+}
+
+size_t INCTTP_scan_value(const char *buf, size_t pos, size_t end)
+{
+    return scan(SCAN_VALUE, buf, pos, end);
+}
+
+size_t INCTTP_scan_uri(const char *buf, size_t pos, size_t end)
+{
+    return scan(SCAN_URI, buf, pos, end);
+}
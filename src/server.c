@@ -1,6 +1,15 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -12,6 +21,8 @@ CTTP_Server CTTP_new_server(int port)
 {
     CTTP_Server cs;
     cs.log_level = 1;
+    cs.access_log = -1;
+    cs.log_format = CTTP_LOG_COMMON;
     cs.port = port;
 
     cs.routes = INCTTP_new_route_node();
@@ -21,29 +32,406 @@ CTTP_Server CTTP_new_server(int port)
     cs.psize = CTTP_MAX_PARAMS_SIZE;
     cs.rsize = CTTP_MAX_REQUEST_SIZE;
 
+    cs.blocking = 0;
+    cs.io_backend = CTTP_IO_AUTO;
+    cs.workers = 1;
+    cs.pin_workers = 0;
+
+    cs.keepalive_timeout = CTTP_KEEPALIVE_TIMEOUT;
+    cs.keepalive_requests = CTTP_KEEPALIVE_REQUESTS;
+
+    cs.header_timeout = CTTP_HEADER_TIMEOUT;
+    cs.body_timeout = CTTP_BODY_TIMEOUT;
+    cs.write_timeout = CTTP_WRITE_TIMEOUT;
+
+    cs.compress = 0;
+    cs.compress_level = CTTP_COMPRESS_LEVEL;
+    cs.compress_min_size = CTTP_COMPRESS_MIN_SIZE;
+    cs.compress_types = NULL;
+
+    cs.stack_size = CTTP_STACK_SIZE;
+    cs.async = 0;
+    cs.streams = 0;
+
+    cs.cache_size = CTTP_CACHE_SIZE;
+    cs.cached = 0;
+    cs.cache = NULL;
+
+    cs.metrics = 0;
+    cs.stats = NULL;
+    cs.logger = NULL;
+
     return cs;
 }
 
 /**
- * This function serves as a request handler for `CTTP_start_server`, reading the request and writing the response.
+ * This function serves as a request handler for `CTTP_start_server`, routing the parsed request and running its handler.
  * It simplifies error handling by consolidating various error codes into a single switch-case.
  */
-static int handle_request(CTTP_Server *server, char *raw_r, CTTP_Writer *w, CTTP_Request *r)
+static int handle_request(CTTP_Server *server, CTTP_Writer *w, CTTP_Request *r)
 {
-    // Parse raw input and populate request structure
-    int parse_result = INCTTP_parse_raw_request(raw_r, r, server);
-    if (parse_result < 1) return parse_result;
-    
     // Identify route based on parsed request's URI
     CTTP_RouteNode *route;
-    int route_result = CTTP_read_route(server, &route, r->uri, r->method);
+    int route_result = INCTTP_route_request(server, &route, r);
     if (route_result < 1) return route_result;
 
     // Execute route's handler using request and writer
-    return route->handler(w, r);
+    return route->handlers[r->method](w, r);
 }
 
-int CTTP_start_server(CTTP_Server *cs)
+/**
+ * Writes the default response for error `err` to writer `w`. Successful results are left untouched,
+ * since those responses are written directly by the route handlers.
+ */
+static void write_default_response(CTTP_Writer *w, int err)
+{
+    switch (err)
+    {
+    case CTTP_ERROR_HEADER_FIELDS_TOO_LARGE:
+        // Handle the scenario when the request header fields are too large.
+        CTTP_write_status(w, CTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+        CTTP_write_body(w, CTTP_MESSAGE_REQUEST_HEADER_FIELDS_TOO_LARGE, strlen(CTTP_MESSAGE_REQUEST_HEADER_FIELDS_TOO_LARGE));
+        break;
+    case CTTP_ERROR_CONTENT_TOO_LARGE:
+        // Handle the scenario when the content (e.g., parameters or body) is too large.
+        CTTP_write_status(w, CTTP_STATUS_CONTENT_TOO_LARGE);
+        CTTP_write_body(w, CTTP_MESSAGE_CONTENT_TOO_LARGE, strlen(CTTP_MESSAGE_CONTENT_TOO_LARGE));
+        break;
+    case CTTP_ERROR_ROUTE_NOT_FOUND:
+        // Handle the scenario when the requested route is not found.
+        CTTP_write_status(w, CTTP_STATUS_NOT_FOUND);
+        CTTP_write_body(w, CTTP_MESSAGE_NOT_FOUND, strlen(CTTP_MESSAGE_NOT_FOUND));
+        break;
+    case CTTP_ERROR_METHOD_NOT_ALLOWED:
+        // Handle the scenario when the HTTP method used is not allowed for the given route.
+        // The `Allow` header lists the methods of the route that was found.
+        if (w->request != NULL && w->request->route != NULL) CTTP_write_header(w, "Allow", w->request->route->allow);
+        CTTP_write_status(w, CTTP_STATUS_METHOD_NOT_ALLOWED);
+        CTTP_write_body(w, CTTP_MESSAGE_METHOD_NOT_ALLOWED, strlen(CTTP_MESSAGE_METHOD_NOT_ALLOWED));
+        break;
+    case CTTP_ERROR_URI_TOO_LONG:
+        // Handle the scenario when the request target is longer than the server accepts.
+        CTTP_write_status(w, CTTP_STATUS_URI_TOO_LONG);
+        CTTP_write_body(w, CTTP_MESSAGE_URI_TOO_LONG, strlen(CTTP_MESSAGE_URI_TOO_LONG));
+        break;
+    case CTTP_ERROR_VERSION_NOT_SUPPORTED:
+        // Handle requests using an HTTP major version the server does not speak.
+        CTTP_write_status(w, CTTP_STATUS_HTTP_VERSION_NOT_SUPPORTED);
+        CTTP_write_body(w, CTTP_MESSAGE_HTTP_VERSION_NOT_SUPPORTED, strlen(CTTP_MESSAGE_HTTP_VERSION_NOT_SUPPORTED));
+        break;
+    case CTTP_ERROR_RAW_INITIAL_LINE:
+    case CTTP_ERROR_RAW_REQUEST_HEADERS:
+    case CTTP_ERROR_RAW_REQUEST_BODY:
+        // Handle malformed requests.
+        CTTP_write_status(w, CTTP_STATUS_BAD_REQUEST);
+        CTTP_write_body(w, CTTP_MESSAGE_BAD_REQUEST, strlen(CTTP_MESSAGE_BAD_REQUEST));
+        break;
+    case CTTP_ERROR_BAD_GATEWAY:
+        // Handle upstreams that cannot be reached or answer with an invalid response.
+        CTTP_write_status(w, CTTP_STATUS_BAD_GATEWAY);
+        CTTP_write_body(w, CTTP_MESSAGE_BAD_GATEWAY, strlen(CTTP_MESSAGE_BAD_GATEWAY));
+        break;
+    case CTTP_ERROR_GATEWAY_TIMEOUT:
+        // Handle upstreams that do not answer in time.
+        CTTP_write_status(w, CTTP_STATUS_GATEWAY_TIMEOUT);
+        CTTP_write_body(w, CTTP_MESSAGE_GATEWAY_TIMEOUT, strlen(CTTP_MESSAGE_GATEWAY_TIMEOUT));
+        break;
+    case CTTP_ERROR_INTERNAL_SERVER_ERROR:
+        // Handle internal server errors.
+        CTTP_write_status(w, CTTP_STATUS_INTERNAL_SERVER_ERROR);
+        CTTP_write_body(w, CTTP_MESSAGE_INTERNAL_SERVER_ERROR, strlen(CTTP_MESSAGE_INTERNAL_SERVER_ERROR));
+        break;
+    default:
+        // No errors occurred during request processing.
+        // Successful responses are handled directly in the respective route handlers.
+        break;
+    }
+}
+
+/**
+ * Drops the headers, body and file written to writer `w`.
+ */
+static void discard_response(CTTP_Writer *w)
+{
+    w->hsize = 0;
+    w->body = NULL;
+    w->bsize = 0;
+    if (w->file != NULL) INCTTP_release_file(w->file);
+    w->file = NULL;
+}
+
+/**
+ * Returns whether the client wants the connection to persist after `r`, following RFC 9112 (section 9.3):
+ * HTTP/1.1 connections persist unless `Connection: close` is sent, HTTP/1.0 ones only with `Connection: keep-alive`.
+ */
+static int request_keeps_alive(CTTP_Request *r)
+{
+    int keep_alive = r->version != CTTP_VERSION_1_0;
+
+    for (size_t i = 0; i < r->hsize; i++)
+    {
+        if (r->headers[i].id != CTTP_HEADER_CONNECTION) continue;
+
+        if (strcasestr(r->headers[i].val, "close") != NULL) return 0;
+        if (strcasestr(r->headers[i].val, "keep-alive") != NULL) keep_alive = 1;
+    }
+
+    return keep_alive;
+}
+
+/**
+ * Writes the `Connection` header matching `*keep_alive` to writer `w`. A handler that already set
+ * `Connection: close` forces the connection to be closed.
+ */
+static void write_connection_header(CTTP_Writer *w, CTTP_Request *r, int *keep_alive)
+{
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        if (w->headers[i].id != CTTP_HEADER_CONNECTION) continue;
+
+        if (strcasestr(w->headers[i].val, "close") != NULL) *keep_alive = 0;
+        else if (!*keep_alive)
+        {
+            w->headers[i].val = (char *)"close";
+            w->headers[i].vlen = 5;
+        }
+        return;
+    }
+
+    if (!*keep_alive)
+    {
+        CTTP_write_header(w, "Connection", "close");
+    }
+    else if (r->version == CTTP_VERSION_1_0)
+    {
+        // HTTP/1.0 clients only keep the connection open when told so explicitly.
+        CTTP_write_header(w, "Connection", "keep-alive");
+    }
+}
+
+void INCTTP_prepare_response(CTTP_Writer *w)
+{
+    // Responses to HEAD carry the headers of the GET response, `Content-Length` included, but no body.
+    if (w->request->method == CTTP_METHOD_HEAD)
+    {
+        w->body = NULL;
+        w->bsize = 0;
+        if (w->file != NULL) INCTTP_release_file(w->file);
+        w->file = NULL;
+    }
+
+    // The unread rest of a streamed body cannot be told apart from a next request, unless it is all buffered already.
+    if (w->request->reader != NULL && !INCTTP_skip_body(w->request->reader)) *w->keep_alive = 0;
+
+    write_connection_header(w, w->request, w->keep_alive);
+}
+
+/**
+ * Returns the code of status `STATUS`, such as 200 for `200 OK`, or 200 if no status was written.
+ */
+static int status_code(const char *STATUS)
+{
+    if (STATUS == NULL) return 200;
+
+    int code = 0;
+    for (int i = 0; i < 3 && STATUS[i] >= '0' && STATUS[i] <= '9'; i++) code = code * 10 + STATUS[i] - '0';
+    return code;
+}
+
+int INCTTP_serve_request(CTTP_Server *cs, int fd, CTTP_Request *r, INCTTP_Arena *a, INCTTP_Response *res, int *keep_alive)
+{
+    CTTP_Writer writer; // writer will be sent as a pointer to the route handler
+    INCTTP_init_writer(&writer, a);
+
+    // A handler streaming its response sends the headers itself, so they must be settled before it runs.
+    *keep_alive = *keep_alive && request_keeps_alive(r);
+    writer.fd = fd;
+    writer.request = r;
+    writer.keep_alive = keep_alive;
+    writer.timeout = cs->write_timeout;
+
+    INCTTP_WorkerMetrics *m = INCTTP_worker_metrics;
+    long long start = m != NULL ? INCTTP_now_ns() : 0;
+
+    int result = handle_request(cs, &writer, r);
+    if (m != NULL) INCTTP_observe(&m->handler, INCTTP_now_ns() - start);
+
+    int served;
+    size_t bytes = writer.streamed;
+    if (writer.stream != INCTTP_STREAM_NONE) served = INCTTP_finish_stream(res, &writer, result);
+    else
+    {
+        // The error response replaces whatever a failing handler wrote, so that none of its headers, such as a
+        // `Content-Length`, frames the error body.
+        if (result < 1) discard_response(&writer);
+        write_default_response(&writer, result);
+        if (cs->compress && INCTTP_compress_response(cs, &writer) == 0) return 0;
+        INCTTP_prepare_response(&writer);
+
+        bytes = writer.file != NULL ? writer.file->size : writer.bsize;
+        served = INCTTP_write_response(res, &writer);
+    }
+
+    res->route = r->route != NULL ? r->route->id : 0;
+    res->status = status_code(writer.status);
+    res->bytes = bytes;
+    return served;
+}
+
+int INCTTP_serve_error(int err, INCTTP_Arena *a, INCTTP_Response *res)
+{
+    CTTP_Writer writer;
+    INCTTP_init_writer(&writer, a);
+
+    write_default_response(&writer, err);
+    CTTP_write_header(&writer, "Connection", "close");
+
+    int served = INCTTP_write_response(res, &writer);
+    res->route = 0;
+    res->status = status_code(writer.status);
+    res->bytes = writer.bsize;
+    return served;
+}
+
+int INCTTP_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return 0;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ? 0 : 1;
+}
+
+/**
+ * Returns the time (ms) the blocking loop waits for more bytes of the request parsed by `p`: the time left until
+ * `deadline` (ms), by which the head must be whole, or `cs->body_timeout` once it is. Returns -1 for no limit, and
+ * 0 once the deadline has passed.
+ */
+static int read_timeout(CTTP_Server *cs, INCTTP_Parser *p, long long deadline)
+{
+    if (p->body_off > 0) return cs->body_timeout > 0 ? cs->body_timeout : -1;
+    if (deadline < 0) return -1;
+
+    long long left = deadline - INCTTP_now_ns() / 1000000;
+    return left > 0 ? (int)left : 0;
+}
+
+/**
+ * Serves connections one at a time with blocking `accept` -> `read` -> `send` -> `close`.
+ * Reads and sends wait for the socket with a timeout, so a client that stalls cannot hold the worker.
+ * Only used when `CTTP_Server.blocking` is set.
+ */
+static int run_blocking_loop(INCTTP_Worker *wk)
+{
+    CTTP_Server *cs = wk->cs;
+    INCTTP_WorkerMetrics *m = INCTTP_worker_metrics;
+    int timed = m != NULL || INCTTP_worker_log != NULL;
+
+    // A single arena and receive buffer serve every connection, the arena being reset after each response.
+    INCTTP_Arena arena;
+    INCTTP_init_arena(&arena);
+
+    char *raw_request = (char *)malloc(cs->rsize);
+    if (raw_request == NULL) return CTTP_ERROR_SERVER_EVENT_LOOP;
+
+    while (1)
+    {
+        struct sockaddr_in client_addr = {};
+        socklen_t socklen = sizeof(client_addr);
+        // The socket is non-blocking so that every read and send waits for it with a timeout.
+        int connfd = accept4(wk->server_fd, (struct sockaddr *)&client_addr, &socklen, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            if (m != NULL && errno != EINTR && errno != ECONNABORTED) INCTTP_count(&m->accept_errors, 1);
+            continue;
+        }
+        if (m != NULL) INCTTP_count(&m->accepted, 1);
+
+        size_t received = 0;
+        long long started = 0, parse = 0;
+        long long deadline = cs->header_timeout > 0 ? INCTTP_now_ns() / 1000000 + cs->header_timeout : -1;
+
+        // Read until the parser has a whole request, the peer stops sending or the buffer is full.
+        INCTTP_Parser parser;
+        INCTTP_init_parser(&parser);
+
+        int result = INCTTP_PARSE_INCOMPLETE;
+        while (result == INCTTP_PARSE_INCOMPLETE && received < cs->rsize)
+        {
+            ssize_t bytes_received = read(connfd, raw_request + received, cs->rsize - received);
+            if (bytes_received < 0 && errno == EINTR) continue;
+            if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                int timeout = read_timeout(cs, &parser, deadline);
+                if (timeout != 0 && CTTP_wait_fd(connfd, POLLIN, timeout) > 0) continue;
+                break;
+            }
+            if (bytes_received < 1) break;
+
+            received += (size_t)bytes_received;
+            long long start = timed ? INCTTP_now_ns() : 0;
+            result = INCTTP_parse_request(&parser, raw_request, received, cs);
+            if (started == 0) started = start;
+
+            if (m == NULL) continue;
+            INCTTP_count(&m->bytes_in, (unsigned long long)bytes_received);
+            parse += INCTTP_now_ns() - start;
+        }
+
+        if (received == 0 || (result == INCTTP_PARSE_INCOMPLETE && received < cs->rsize))
+        {
+            if (m != NULL) INCTTP_count(&m->closed, 1);
+            close(connfd);
+            continue;
+        }
+
+        CTTP_Request request;
+        memset(&request, 0, sizeof(CTTP_Request));
+        if (result == INCTTP_PARSE_INCOMPLETE) result = CTTP_ERROR_CONTENT_TOO_LARGE;
+        if (result == INCTTP_PARSE_COMPLETE)
+        {
+            long long start = m != NULL ? INCTTP_now_ns() : 0;
+            result = INCTTP_fill_request(&parser, raw_request, &request, &arena, cs);
+            if (m != NULL) parse += INCTTP_now_ns() - start;
+        }
+
+        INCTTP_BodyReader reader;
+        if (result > 0 && parser.stream_body)
+        {
+            INCTTP_init_body_reader(&reader, &parser, &request, connfd, raw_request, received, cs->rsize, cs->body_timeout);
+        }
+
+        // The blocking loop reads a single request per connection, so connections never persist.
+        int keep_alive = 0;
+        INCTTP_Response response = {};
+        int served = result < 1
+                     ? INCTTP_serve_error(result, &arena, &response)
+                     : INCTTP_serve_request(cs, connfd, &request, &arena, &response, &keep_alive);
+
+        INCTTP_LogRecord log;
+        if (INCTTP_worker_log != NULL) INCTTP_fill_log_record(&log, result < 1 ? NULL : &request, &client_addr);
+
+        long long sending = m != NULL ? INCTTP_now_ns() : 0;
+        if (served && INCTTP_send_blocking(connfd, &response, cs->write_timeout))
+        {
+            if (m != NULL) INCTTP_record_request(m, &response, started, parse, sending);
+            if (INCTTP_worker_log != NULL) INCTTP_log_request(cs, &log, &response, started);
+        }
+        INCTTP_free_response(&response);
+
+        INCTTP_arena_reset(&arena);
+        if (m != NULL) INCTTP_count(&m->closed, 1);
+        close(connfd);
+    }
+
+    free(raw_request);
+    INCTTP_free_arena(&arena);
+    return 1;
+}
+
+/**
+ * Creates a listening socket on `cs->port` and stores it in `fd`.
+ * `SO_REUSEPORT` lets every worker bind its own socket to the same port.
+ */
+static int open_listener(CTTP_Server *cs, int *fd)
 {
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0)
@@ -54,6 +442,7 @@ int CTTP_start_server(CTTP_Server *cs)
 
     int val = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
 
     struct sockaddr_in server_addr = {};
     server_addr.sin_family = AF_INET;
@@ -63,88 +452,154 @@ int CTTP_start_server(CTTP_Server *cs)
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
         // TODO: print error when cannot bind
+        close(server_fd);
         return CTTP_ERROR_SERVER_BIND;
     }
 
-    if (listen(server_fd, 5) < 0)
+    if (listen(server_fd, SOMAXCONN) < 0)
     {
         // TODO: print error when cannot listen
+        close(server_fd);
         return CTTP_ERROR_SERVER_LISTEN;
     }
 
-    while (1)
+    // The event loop requires a non-blocking listener to drain the accept queue on each edge.
+    if (!cs->blocking && INCTTP_set_nonblocking(server_fd) == 0)
     {
-        struct sockaddr_in client_addr = {};
-        socklen_t socklen = sizeof(client_addr);
-        int connfd = accept(server_fd, (struct sockaddr *)&client_addr, &socklen);
-        if (connfd < 0) {
-            continue;
-        }
-        
-        char raw_request[cs->rsize];
-        memset(raw_request, 0, sizeof(raw_request));
+        close(server_fd);
+        return CTTP_ERROR_SERVER_SOCKET;
+    }
 
-        ssize_t bytes_received = read(connfd, raw_request, sizeof(raw_request));
-        if (bytes_received < 1)
-        {
-            close(connfd);
-            continue;
-        }
+    *fd = server_fd;
+    return 1;
+}
+
+/**
+ * Returns the `n`-th CPU (wrapping around) among the CPUs the process may run on, or -1 if unknown.
+ */
+static int nth_allowed_cpu(int n)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return -1;
 
-        CTTP_Writer writer;   // writer will be sent as a pointer to the route handler
-        CTTP_Request request; // request will be sent as a pointer to the route handler
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) return -1;
 
-        // To avoid memory access errors, we ensure that all bytes in the writer and request are filled
-        memset(&writer, 0, sizeof(CTTP_Writer));
-        memset(&request, 0, sizeof(CTTP_Request));
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) return cpu;
+    }
+
+    return -1;
+}
+
+static void *run_worker(void *arg)
+{
+    INCTTP_Worker *wk = (INCTTP_Worker *)arg;
 
-        switch (handle_request(cs, raw_request, &writer, &request))
+    if (wk->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(wk->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    INCTTP_worker_metrics = wk->cs->stats != NULL ? wk->cs->stats->workers[wk->id] : NULL;
+    INCTTP_worker_log = wk->cs->logger != NULL ? wk->cs->logger->rings[wk->id] : NULL;
+
+    if (wk->cs->blocking)
+    {
+        wk->result = run_blocking_loop(wk);
+        return NULL;
+    }
+
+    // Without io_uring support the worker falls back to epoll, unless io_uring was asked for explicitly.
+    wk->result = wk->cs->io_backend != CTTP_IO_EPOLL ? INCTTP_run_uring_loop(wk) : CTTP_ERROR_NIL;
+    if (wk->result == CTTP_ERROR_NIL)
+    {
+        wk->result = wk->cs->io_backend == CTTP_IO_URING ? CTTP_ERROR_SERVER_EVENT_LOOP : INCTTP_run_event_loop(wk);
+    }
+    return NULL;
+}
+
+int CTTP_start_server(CTTP_Server *cs)
+{
+    int count = cs->workers;
+    if (count < 1)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+    }
+
+    INCTTP_Worker *workers = (INCTTP_Worker *)calloc(count, sizeof(INCTTP_Worker));
+    if (workers == NULL) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    // Routes are numbered once every route is added, so that their metrics can be kept in flat arrays.
+    if (cs->metrics && INCTTP_init_metrics(cs, (size_t)count) == 0)
+    {
+        INCTTP_free_metrics(cs);
+        free(workers);
+        return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+    }
+
+    if (cs->access_log >= 0 && cs->log_level > 0 && INCTTP_start_logger(cs, (size_t)count) == 0)
+    {
+        INCTTP_free_metrics(cs);
+        free(workers);
+        return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+    }
+
+    if (cs->cached && INCTTP_init_cache(cs) == 0)
+    {
+        INCTTP_stop_logger(cs);
+        INCTTP_free_metrics(cs);
+        free(workers);
+        return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+    }
+
+    // Every listener is opened up front so that socket errors are reported to the caller.
+    int result = 1;
+    int opened = 0;
+    for (; opened < count; opened++)
+    {
+        INCTTP_Worker *wk = &workers[opened];
+        wk->cs = cs;
+        wk->id = opened;
+        wk->cpu = cs->pin_workers ? nth_allowed_cpu(opened) : -1;
+
+        result = open_listener(cs, &wk->server_fd);
+        if (result < 1) break;
+    }
+
+    if (opened == count)
+    {
+        // Worker 0 runs on the calling thread, the remaining ones on their own threads.
+        int started = 1;
+        for (; started < count; started++)
         {
-        case CTTP_ERROR_HEADER_FIELDS_TOO_LARGE:
-            // Handle the scenario when the request header fields are too large.
-            CTTP_write_status(&writer, CTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
-            CTTP_write_body(&writer, CTTP_MESSAGE_REQUEST_HEADER_FIELDS_TOO_LARGE, strlen(CTTP_MESSAGE_REQUEST_HEADER_FIELDS_TOO_LARGE));
-            break;
-        case CTTP_ERROR_CONTENT_TOO_LARGE:
-            // Handle the scenario when the content (e.g., parameters or body) is too large.
-            CTTP_write_status(&writer, CTTP_STATUS_CONTENT_TOO_LARGE);
-            CTTP_write_body(&writer, CTTP_MESSAGE_CONTENT_TOO_LARGE, strlen(CTTP_MESSAGE_CONTENT_TOO_LARGE));
-            break;
-        case CTTP_ERROR_ROUTE_NOT_FOUND:
-            // Handle the scenario when the requested route is not found.
-            CTTP_write_status(&writer, CTTP_STATUS_NOT_FOUND);
-            CTTP_write_body(&writer, CTTP_MESSAGE_NOT_FOUND, strlen(CTTP_MESSAGE_NOT_FOUND));
-            break;
-        case CTTP_ERROR_METHOD_NOT_ALLOWED:
-            // Handle the scenario when the HTTP method used is not allowed for the given route.
-            CTTP_write_header(&writer, "Allow", request.method);
-            CTTP_write_status(&writer, CTTP_STATUS_METHOD_NOT_ALLOWED);
-            CTTP_write_body(&writer, CTTP_MESSAGE_METHOD_NOT_ALLOWED, strlen(CTTP_MESSAGE_METHOD_NOT_ALLOWED));
-            break;
-        case CTTP_ERROR_RAW_INITIAL_LINE:
-        case CTTP_ERROR_RAW_REQUEST_HEADERS:
-        case CTTP_ERROR_INTERNAL_SERVER_ERROR:
-            // Handle internal server errors.
-            CTTP_write_status(&writer, CTTP_STATUS_INTERNAL_SERVER_ERROR);
-            CTTP_write_body(&writer, CTTP_MESSAGE_INTERNAL_SERVER_ERROR, strlen(CTTP_MESSAGE_INTERNAL_SERVER_ERROR));
-            break;
-        default:
-            // No errors occurred during request processing.
-            // Successful responses are handled directly in the respective route handlers.
-            break;
+            if (pthread_create(&workers[started].thread, NULL, run_worker, &workers[started]) != 0) break;
         }
 
-        char buf[cs->bsize];
-        INCTTP_write_response(buf, cs->bsize, &writer, cs);
+        run_worker(&workers[0]);
+        result = workers[0].result;
 
-        if (send(connfd, buf, strlen(buf), 0) == -1)
+        for (int i = 1; i < started; i++)
         {
-            // TODO
+            pthread_join(workers[i].thread, NULL);
         }
+    }
 
-        close(connfd);
+    for (int i = 0; i < opened; i++)
+    {
+        close(workers[i].server_fd);
     }
 
+    free(workers);
+    INCTTP_free_cache(cs);
+    INCTTP_stop_logger(cs);
+    INCTTP_free_metrics(cs);
     INCTTP_free_route_node(cs->routes);
-    return 1;
+    return result;
 }
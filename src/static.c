@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp-status.h"
+#include "cttp.h"
+
+/**
+ * Content types by file extension, sorted by extension for `bsearch`.
+ */
+static const struct
+{
+    const char *ext;
+    const char *type;
+}
+CONTENT_TYPES[] = {
+    {"avif",  "image/avif"},
+    {"bmp",   "image/bmp"},
+    {"css",   "text/css; charset=utf-8"},
+    {"csv",   "text/csv; charset=utf-8"},
+    {"gif",   "image/gif"},
+    {"gz",    "application/gzip"},
+    {"htm",   "text/html; charset=utf-8"},
+    {"html",  "text/html; charset=utf-8"},
+    {"ico",   "image/x-icon"},
+    {"jpeg",  "image/jpeg"},
+    {"jpg",   "image/jpeg"},
+    {"js",    "text/javascript; charset=utf-8"},
+    {"json",  "application/json"},
+    {"map",   "application/json"},
+    {"md",    "text/markdown; charset=utf-8"},
+    {"mjs",   "text/javascript; charset=utf-8"},
+    {"mp3",   "audio/mpeg"},
+    {"mp4",   "video/mp4"},
+    {"otf",   "font/otf"},
+    {"pdf",   "application/pdf"},
+    {"png",   "image/png"},
+    {"svg",   "image/svg+xml"},
+    {"tar",   "application/x-tar"},
+    {"ttf",   "font/ttf"},
+    {"txt",   "text/plain; charset=utf-8"},
+    {"wasm",  "application/wasm"},
+    {"webm",  "video/webm"},
+    {"webp",  "image/webp"},
+    {"woff",  "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xml",   "application/xml"},
+    {"zip",   "application/zip"},
+};
+
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+
+static int compare_extension(const void *key, const void *entry)
+{
+    return strcasecmp((const char *)key, *(const char *const *)entry);
+}
+
+/**
+ * Returns the content type of the file at `path`, based on its extension.
+ */
+static const char *content_type(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) return DEFAULT_CONTENT_TYPE;
+
+    const void *found = bsearch(dot + 1, CONTENT_TYPES, sizeof(CONTENT_TYPES) / sizeof(CONTENT_TYPES[0]),
+                                sizeof(CONTENT_TYPES[0]), compare_extension);
+
+    return found != NULL ? *((const char *const *)found + 1) : DEFAULT_CONTENT_TYPE;
+}
+
+/**
+ * Open files of a worker, indexed by path and kept in least recently used order.
+ */
+typedef struct
+{
+    INCTTP_File *buckets[INCTTP_FILE_CACHE_BUCKETS];
+    INCTTP_Lru   lru;
+    size_t       count;
+}
+FileCache;
+
+// Every worker runs on its own thread, so a thread-local cache needs no locking.
+static __thread FileCache cache;
+
+/**
+ * FNV-1a hash of the `len` bytes of `s`.
+ */
+static unsigned int hash_path(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/**
+ * Removes `f` from the cache and drops the cache's reference to it.
+ */
+static void evict(INCTTP_File *f)
+{
+    INCTTP_File **slot = &cache.buckets[f->hash % INCTTP_FILE_CACHE_BUCKETS];
+    while (*slot != f) slot = &(*slot)->hnext;
+    *slot = f->hnext;
+
+    INCTTP_lru_unlink(&cache.lru, &f->lru);
+    cache.count--;
+    INCTTP_release_file(f);
+}
+
+void INCTTP_release_file(INCTTP_File *f)
+{
+    if (--f->refs > 0) return;
+
+    close(f->fd);
+    free(f);
+}
+
+/**
+ * Returns a reference to the regular file at `path` of `len` bytes, opening it if it is not cached yet.
+ * Returns `NULL` if the file does not exist or cannot be opened.
+ */
+static INCTTP_File *open_file(const char *path, size_t len)
+{
+    long long now = INCTTP_now_ns() / 1000000;
+    unsigned int hash = hash_path(path, len);
+
+    INCTTP_File *f = cache.buckets[hash % INCTTP_FILE_CACHE_BUCKETS];
+    while (f != NULL && (f->hash != hash || strcmp(f->path, path) != 0)) f = f->hnext;
+
+    if (f != NULL && now - f->checked >= INCTTP_FILE_CACHE_TTL)
+    {
+        // Reopen the file if it was replaced or modified since it was cached.
+        struct stat st;
+        if (stat(path, &st) < 0 || st.st_ino != f->ino || st.st_mtime != f->mtime || (size_t)st.st_size != f->size)
+        {
+            evict(f);
+            f = NULL;
+        }
+        else
+        {
+            f->checked = now;
+        }
+    }
+
+    if (f != NULL)
+    {
+        INCTTP_lru_unlink(&cache.lru, &f->lru);
+        INCTTP_lru_push(&cache.lru, &f->lru);
+        f->refs++;
+        return f;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    f = (INCTTP_File *)calloc(1, sizeof(INCTTP_File) + len + 1);
+    if (f == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    f->fd = fd;
+    f->size = (size_t)st.st_size;
+    f->mtime = st.st_mtime;
+    f->ino = st.st_ino;
+    f->type = content_type(path);
+    INCTTP_format_date(f->modified, st.st_mtime);
+    f->checked = now;
+    f->hash = hash;
+    f->path = (char *)(f + 1);
+    memcpy(f->path, path, len);
+
+    if (cache.count >= INCTTP_FILE_CACHE_SIZE) evict(INCTTP_OWNER(cache.lru.tail, INCTTP_File, lru));
+
+    INCTTP_File **slot = &cache.buckets[hash % INCTTP_FILE_CACHE_BUCKETS];
+    f->hnext = *slot;
+    *slot = f;
+    INCTTP_lru_push(&cache.lru, &f->lru);
+    cache.count++;
+
+    // One reference for the cache and one for the caller.
+    f->refs = 2;
+    return f;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Appends the percent-decoded path `p` of `len` bytes to `out`. Returns the number of bytes written,
+ * or -1 if the path is invalid: it decodes to a NUL byte or has a `..` segment escaping the directory.
+ */
+static long decode_path(char *out, const char *p, size_t len)
+{
+    size_t n = 0;
+    size_t segment = 0; // Start of the current segment in `out`
+
+    for (size_t i = 0; i <= len; i++)
+    {
+        char c;
+        if (i == len) c = '/';
+        else if (p[i] == '%' && i + 2 < len && hex_value(p[i + 1]) >= 0 && hex_value(p[i + 2]) >= 0)
+        {
+            c = (char)(hex_value(p[i + 1]) * 16 + hex_value(p[i + 2]));
+            i += 2;
+        }
+        else c = p[i];
+
+        if (c == '\0') return -1;
+
+        if (c == '/')
+        {
+            if (n - segment == 2 && out[segment] == '.' && out[segment + 1] == '.') return -1;
+            if (i == len) break;
+            segment = n + 1;
+        }
+
+        out[n++] = c;
+    }
+
+    return (long)n;
+}
+
+/**
+ * Handler of static routes. The file path is the catch-all captured by the route, relative to the route's directory.
+ */
+static int serve_file(CTTP_Writer *w, CTTP_Request *r)
+{
+    const char *dir = (const char *)r->route->data;
+    CTTP_Slice rel = r->path_params[r->path_params_count - 1].val;
+
+    size_t dlen = strlen(dir);
+    char *path = (char *)INCTTP_arena_alloc(w->arena, dlen + 1 + rel.len + sizeof("index.html"));
+    if (path == NULL) return CTTP_ERROR_INTERNAL_SERVER_ERROR;
+
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+
+    long n = decode_path(path + dlen + 1, rel.ptr, rel.len);
+    if (n < 0) return CTTP_ERROR_ROUTE_NOT_FOUND;
+
+    size_t len = dlen + 1 + (size_t)n;
+    if (path[len - 1] == '/')
+    {
+        memcpy(path + len, "index.html", sizeof("index.html") - 1);
+        len += sizeof("index.html") - 1;
+    }
+    path[len] = '\0';
+
+    INCTTP_File *f = open_file(path, len);
+    if (f == NULL) return CTTP_ERROR_ROUTE_NOT_FOUND;
+
+    CTTP_write_header(w, "Last-Modified", f->modified);
+
+    // A client holding the current version gets an empty 304 response.
+    char *since = CTTP_read_request_header_id(r, CTTP_HEADER_IF_MODIFIED_SINCE);
+    if (since != NULL && strcmp(since, f->modified) == 0)
+    {
+        INCTTP_release_file(f);
+        CTTP_write_status(w, CTTP_STATUS_NOT_MODIFIED);
+        return CTTP_ERROR_NIL;
+    }
+
+    char length[32];
+    snprintf(length, sizeof(length), "%zu", f->size);
+
+    CTTP_write_status(w, CTTP_STATUS_OK);
+    CTTP_write_header(w, "Content-Type", (char *)f->type);
+    CTTP_write_header(w, "Content-Length", length);
+    w->file = f;
+
+    return CTTP_ERROR_NIL;
+}
+
+void CTTP_add_static_route(CTTP_Server *cs, const char *p, const char *dir)
+{
+    // The route is the prefix followed by a catch-all segment for the file path.
+    size_t plen = strlen(p);
+    int slash = plen == 0 || p[plen - 1] != '/';
+
+    char *route = (char *)malloc(plen + slash + sizeof("*path"));
+    if (route == NULL) return;
+
+    memcpy(route, p, plen);
+    if (slash) route[plen] = '/';
+    memcpy(route + plen + slash, "*path", sizeof("*path"));
+
+    char *data = strdup(dir);
+    CTTP_RouteNode *node = data != NULL ? INCTTP_insert_route(cs, "GET", route, serve_file) : NULL;
+    free(route);
+
+    if (node == NULL)
+    {
+        free(data);
+        return;
+    }
+
+    free(node->data);
+    node->data = data;
+}
@@ -0,0 +1,161 @@
+#include <stddef.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+/* Time (ms) covered by the whole wheel */
+#define SPAN (1LL << (INCTTP_WHEEL_BITS * INCTTP_WHEEL_LEVELS))
+
+static void link_timer(INCTTP_Timer *head, INCTTP_Timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_timer(INCTTP_Timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+/**
+ * Links timer `t` into the slot of its deadline: at the lowest level whose slots span its distance from `w->now`,
+ * or into the expired timers if its deadline has passed. A deadline beyond the wheel goes in the last slot it
+ * reaches, to be placed again from there.
+ */
+static void place(INCTTP_TimerWheel *w, INCTTP_Timer *t)
+{
+    long long delta = t->deadline - w->now;
+    if (delta <= 0)
+    {
+        t->slot = -1;
+        link_timer(&w->expired, t);
+        return;
+    }
+
+    if (delta >= SPAN) delta = SPAN - 1;
+    long long at = w->now + delta;
+
+    int level = 0;
+    while (level < INCTTP_WHEEL_LEVELS - 1 && delta >> (INCTTP_WHEEL_BITS * (level + 1)) != 0) level++;
+
+    int i = (int)((at >> (INCTTP_WHEEL_BITS * level)) & (INCTTP_WHEEL_SLOTS - 1));
+    t->slot = level * INCTTP_WHEEL_SLOTS + i;
+    link_timer(&w->slots[t->slot], t);
+    w->occupied[level] |= 1ULL << i;
+}
+
+/**
+ * Returns the time (ms) at which the next occupied slot of `w` comes up, or -1 if `w` has no armed timer.
+ * Every slot comes up in the 64 periods of its level that follow `w->now`, in order from the slot after the
+ * current one, which comes up last.
+ */
+static long long next_event(INCTTP_TimerWheel *w)
+{
+    long long next = -1;
+    for (int level = 0; level < INCTTP_WHEEL_LEVELS; level++)
+    {
+        unsigned long long occupied = w->occupied[level];
+        if (occupied == 0) continue;
+
+        int shift = INCTTP_WHEEL_BITS * level;
+        int r = (int)(((w->now >> shift) + 1) & (INCTTP_WHEEL_SLOTS - 1));
+        if (r > 0) occupied = (occupied >> r) | (occupied << (INCTTP_WHEEL_SLOTS - r));
+
+        long long at = ((w->now >> shift) + __builtin_ctzll(occupied) + 1) << shift;
+        if (next < 0 || at < next) next = at;
+    }
+    return next;
+}
+
+/**
+ * Empties slot `i` of `level`, placing its timers again: on lower levels, or among the expired ones once due.
+ */
+static void cascade(INCTTP_TimerWheel *w, int level, int i)
+{
+    INCTTP_Timer *head = &w->slots[level * INCTTP_WHEEL_SLOTS + i];
+    w->occupied[level] &= ~(1ULL << i);
+
+    while (head->next != head)
+    {
+        INCTTP_Timer *t = head->next;
+        unlink_timer(t);
+        place(w, t);
+    }
+}
+
+void INCTTP_init_wheel(INCTTP_TimerWheel *w, long long now)
+{
+    w->now = now;
+    for (int level = 0; level < INCTTP_WHEEL_LEVELS; level++) w->occupied[level] = 0;
+    for (int i = 0; i < INCTTP_WHEEL_LEVELS * INCTTP_WHEEL_SLOTS; i++)
+    {
+        w->slots[i].prev = &w->slots[i];
+        w->slots[i].next = &w->slots[i];
+    }
+    w->expired.prev = &w->expired;
+    w->expired.next = &w->expired;
+}
+
+void INCTTP_set_timer(INCTTP_TimerWheel *w, INCTTP_Timer *t, long long deadline)
+{
+    INCTTP_cancel_timer(w, t);
+    t->deadline = deadline;
+    place(w, t);
+}
+
+void INCTTP_cancel_timer(INCTTP_TimerWheel *w, INCTTP_Timer *t)
+{
+    if (t->prev == NULL) return;
+
+    INCTTP_Timer *head = t->slot >= 0 ? &w->slots[t->slot] : NULL;
+    unlink_timer(t);
+    if (head != NULL && head->next == head)
+    {
+        w->occupied[t->slot / INCTTP_WHEEL_SLOTS] &= ~(1ULL << (t->slot % INCTTP_WHEEL_SLOTS));
+    }
+}
+
+void INCTTP_advance_wheel(INCTTP_TimerWheel *w, long long now)
+{
+    // Only the times at which occupied slots come up are visited, however long the wheel was left alone. The
+    // upper levels go first, so that the timers they pass down are placed before the lower slots are emptied.
+    long long next;
+    while ((next = next_event(w)) >= 0 && next <= now)
+    {
+        w->now = next;
+        for (int level = INCTTP_WHEEL_LEVELS - 1; level >= 0; level--)
+        {
+            int shift = INCTTP_WHEEL_BITS * level;
+            if ((next & ((1LL << shift) - 1)) != 0) continue;
+
+            cascade(w, level, (int)((next >> shift) & (INCTTP_WHEEL_SLOTS - 1)));
+        }
+    }
+
+    if (now > w->now) w->now = now;
+}
+
+INCTTP_Timer *INCTTP_pop_expired(INCTTP_TimerWheel *w)
+{
+    INCTTP_Timer *t = w->expired.next;
+    if (t == &w->expired) return NULL;
+
+    unlink_timer(t);
+    return t;
+}
+
+int INCTTP_next_expiry(INCTTP_TimerWheel *w, int timeout)
+{
+    if (w->expired.next != &w->expired) return 0;
+
+    long long next = next_event(w);
+    if (next < 0) return timeout;
+
+    long long left = next - w->now;
+    return timeout >= 0 && timeout < left ? timeout : (int)left;
+}
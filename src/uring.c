@@ -0,0 +1,617 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cttp-internal.h"
+#include "cttp.h"
+
+/**
+ * Kinds of operations. The kind is kept in the low bits of an operation's `user_data`, next to the connection it
+ * belongs to; the listener's accept has no connection.
+ */
+enum
+{
+    OP_ACCEPT = 0,
+    OP_RECV   = 1,
+    OP_SEND   = 2,
+    OP_CLOSE  = 3,
+    OP_POLL   = 4,
+    OP_WAIT   = 5, /* Poll of the descriptor a suspended handler waits for */
+    OP_CANCEL = 6, /* Removal of such a poll once its wait timed out */
+};
+
+#define OP_MASK 7
+
+/* Group of the provided receive buffers */
+#define BUFFER_GROUP 0
+
+/**
+ * State of a single worker's io_uring loop. The rings are shared with the kernel, which reads submissions up to
+ * `sq_tail` and writes completions up to `cq_tail`.
+ */
+typedef struct
+{
+    CTTP_Server         *cs;
+    int                  server_fd;
+    int                  fd; /* io_uring instance */
+
+    void                *rings; /* Submission and completion rings, mapped together */
+    size_t               rings_size;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned             sq_mask;
+    unsigned             sq_entries;
+    unsigned             sq_local; /* Tail including the entries not handed to the kernel yet */
+
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring; /* Ring the receive buffers are provided through */
+    char                     *buffers;
+    unsigned short            buf_tail;
+
+    INCTTP_TimerWheel    timeouts; /* Timeouts of the connections */
+    INCTTP_TimerWheel    waits;    /* Timeouts of the waits of suspended handlers */
+}
+UringLoop;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/**
+ * Hands every queued entry to the kernel and, if `wait` is set, waits up to `timeout` ms (forever if negative) for a
+ * completion. Returns 0 if an error occurs.
+ */
+static int enter(UringLoop *loop, int wait, int timeout)
+{
+    unsigned submit = loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(loop->sq_tail, loop->sq_local, __ATOMIC_RELEASE);
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (wait && timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    while (1)
+    {
+        int n = (int)syscall(__NR_io_uring_enter, loop->fd, submit, wait ? 1 : 0, flags,
+                             flags & IORING_ENTER_EXT_ARG ? &arg : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+        if (n >= 0) return 1;
+        if (errno == EINTR) continue;
+
+        // The wait timed out, or completions are backed up until the ring is reaped: neither is an error.
+        return errno == ETIME || errno == EBUSY;
+    }
+}
+
+/**
+ * Makes room for `n` submission entries, submitting the queued ones if the ring is full. Returns 0 if an error occurs.
+ */
+static int reserve(UringLoop *loop, unsigned n)
+{
+    if (loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) + n <= loop->sq_entries) return 1;
+    if (enter(loop, 0, -1) == 0) return 0;
+
+    return loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) + n <= loop->sq_entries;
+}
+
+/**
+ * Returns a cleared submission entry for operation `op` of connection `c`, which must have been reserved.
+ */
+static struct io_uring_sqe *next_sqe(UringLoop *loop, INCTTP_Connection *c, int op)
+{
+    struct io_uring_sqe *sqe = &loop->sqes[loop->sq_local++ & loop->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (unsigned long long)(uintptr_t)c | (unsigned long long)op;
+    if (c != NULL) c->ops++;
+
+    return sqe;
+}
+
+/**
+ * Returns receive buffer `bid` to the kernel.
+ */
+static void provide_buffer(UringLoop *loop, unsigned short bid)
+{
+    struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (INCTTP_URING_BUFFERS - 1)];
+    buf->addr = (unsigned long long)(uintptr_t)(loop->buffers + (size_t)bid * INCTTP_URING_BUFFER_SIZE);
+    buf->len = INCTTP_URING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void free_loop(UringLoop *loop)
+{
+    if (loop->fd >= 0) close(loop->fd);
+    if (loop->rings != NULL) munmap(loop->rings, loop->rings_size);
+    if (loop->sqes != NULL) munmap(loop->sqes, loop->sqes_size);
+    if (loop->buf_ring != NULL) munmap(loop->buf_ring, INCTTP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(loop->buffers);
+}
+
+/**
+ * Creates the io_uring of `loop`, maps its rings and registers its receive buffers. Returns 0 if the kernel does not
+ * support everything the loop needs.
+ */
+static int init_loop(UringLoop *loop)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN
+              | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = INCTTP_URING_ENTRIES * 4;
+
+    loop->fd = uring_setup(INCTTP_URING_ENTRIES, &p);
+    if (loop->fd < 0 && errno == EINVAL)
+    {
+        // Kernels before 6.1 lack the flags that defer completion work to the worker, which only save interrupts.
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = INCTTP_URING_ENTRIES * 4;
+        loop->fd = uring_setup(INCTTP_URING_ENTRIES, &p);
+    }
+    if (loop->fd < 0) return 0;
+
+    // Both rings in a single mapping (Linux 5.4) and waits with a timeout (Linux 5.11) are assumed below.
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) return 0;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    loop->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    loop->rings = mmap(NULL, loop->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQ_RING);
+    if (loop->rings == MAP_FAILED)
+    {
+        loop->rings = NULL;
+        return 0;
+    }
+
+    loop->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = (struct io_uring_sqe *)mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->fd, IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED)
+    {
+        loop->sqes = NULL;
+        return 0;
+    }
+
+    char *rings = (char *)loop->rings;
+    loop->sq_head = (unsigned *)(rings + p.sq_off.head);
+    loop->sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    loop->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    loop->sq_entries = p.sq_entries;
+    loop->sq_local = *loop->sq_tail;
+    loop->cq_head = (unsigned *)(rings + p.cq_off.head);
+    loop->cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    loop->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+    // Entry `i` of the submission ring always refers to entry `i` of the entries array.
+    unsigned *array = (unsigned *)(rings + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+
+    // The buffer ring must be page aligned, which an anonymous mapping is.
+    void *buf_ring = mmap(NULL, INCTTP_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) return 0;
+    loop->buf_ring = (struct io_uring_buf_ring *)buf_ring;
+
+    loop->buffers = (char *)malloc((size_t)INCTTP_URING_BUFFERS * INCTTP_URING_BUFFER_SIZE);
+    if (loop->buffers == NULL) return 0;
+
+    // Buffer rings and multishot accepts arrived together (Linux 5.19), so this also tells whether the latter work.
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)buf_ring;
+    reg.ring_entries = INCTTP_URING_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    if (uring_register(loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return 0;
+
+    for (unsigned i = 0; i < INCTTP_URING_BUFFERS; i++)
+    {
+        provide_buffer(loop, (unsigned short)i);
+    }
+
+    return 1;
+}
+
+/**
+ * Starts accepting connections with a single multishot accept, which completes once per connection.
+ * Returns 0 if an error occurs.
+ */
+static int submit_accept(UringLoop *loop)
+{
+    if (reserve(loop, 1) == 0) return 0;
+
+    struct io_uring_sqe *sqe = next_sqe(loop, NULL, OP_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->server_fd;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return 1;
+}
+
+/**
+ * Waits for connection `c` to send more bytes. The kernel picks the buffer they are received into, so idle connections
+ * hold none. Returns 0 if an error occurs.
+ */
+static int submit_recv(UringLoop *loop, INCTTP_Connection *c)
+{
+    if (reserve(loop, 1) == 0) return 0;
+
+    struct io_uring_sqe *sqe = next_sqe(loop, c, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    return 1;
+}
+
+/**
+ * Sends the response of connection `c`. Iovecs go out with a single `sendmsg` operation, followed by a linked close
+ * when the connection does not persist; files are sent with `sendfile` as in the epoll loop, which io_uring has no
+ * operation for, polling the socket whenever it is full.
+ * Returns 1 once the response is fully sent, 0 if an operation is in flight and -1 if an error occurs.
+ */
+static int send_response(UringLoop *loop, INCTTP_Connection *c)
+{
+    INCTTP_Response *res = &c->response;
+    if (res->fleft > 0)
+    {
+        int flushed = INCTTP_send_response(c->fd, res);
+        if (flushed != 0) return flushed;
+        if (reserve(loop, 1) == 0) return -1;
+
+        struct io_uring_sqe *sqe = next_sqe(loop, c, OP_POLL);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = c->fd;
+        sqe->poll32_events = POLLOUT;
+        return 0;
+    }
+
+    if (res->first == res->count) return 1;
+
+    // The message must outlive this call, so it lives with the response, in the arena.
+    struct msghdr *msg = (struct msghdr *)INCTTP_arena_alloc(&c->arena, sizeof(struct msghdr));
+    if (msg == NULL || reserve(loop, 2) == 0) return -1;
+
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = res->iov + res->first;
+    msg->msg_iovlen = res->count - res->first;
+
+    // `MSG_WAITALL` makes the kernel retry partial sends itself, and makes them break the link to the close.
+    struct io_uring_sqe *sqe = next_sqe(loop, c, OP_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if (c->keep_alive) return 0;
+
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = next_sqe(loop, c, OP_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    c->closing = 1;
+    return 0;
+}
+
+/**
+ * Registers the wait of the handler of suspended connection `c`: a poll of its descriptor, if any, and its timeout.
+ * Returns 1 once the wait is registered, or 0 if it failed, with -1 stored in `revents`.
+ */
+static int arm_wait(UringLoop *loop, INCTTP_Connection *c, int *revents)
+{
+    INCTTP_Coroutine *co = c->co;
+    *revents = -1;
+
+    if (co->fd >= 0 && reserve(loop, 1) == 0) return 0;
+    if (co->deadline >= 0) INCTTP_set_timer(&loop->waits, &co->timer, co->deadline);
+    if (co->fd < 0) return 1;
+
+    struct io_uring_sqe *sqe = next_sqe(loop, c, OP_WAIT);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = co->fd;
+    sqe->poll32_events = (unsigned int)co->events;
+    return 1;
+}
+
+/**
+ * Moves connection `c` forward after an operation completed: answers buffered (possibly pipelined) requests in order
+ * and submits the next operation, a send or a receive, then arms its timeout for what it waits for.
+ * Returns 0 if the connection must be closed, 1 otherwise.
+ */
+static int advance(UringLoop *loop, INCTTP_Connection *c)
+{
+    CTTP_Server *cs = loop->cs;
+
+    while (1)
+    {
+        if (c->state == INCTTP_CONNECTION_SUSPENDED)
+        {
+            int revents;
+            if (arm_wait(loop, c, &revents)) break;
+            if (INCTTP_resume_connection(c, revents) == 0) return 0;
+            continue;
+        }
+
+        if (c->state == INCTTP_CONNECTION_WRITING)
+        {
+            int sent = send_response(loop, c);
+            if (sent < 0) return 0;
+            if (sent == 0) break;
+
+            INCTTP_complete_response(cs, c);
+            if (!c->keep_alive) return 0;
+
+            INCTTP_finish_request(c);
+        }
+
+        int result = INCTTP_parse_connection(cs, c);
+        if (result == INCTTP_PARSE_INCOMPLETE)
+        {
+            // Only one operation is in flight per connection, so a handler reading its body never races a receive.
+            if (c->eof || submit_recv(loop, c) == 0) return 0;
+            break;
+        }
+
+        if (INCTTP_serve_connection(cs, c, result) == 0) return 0;
+    }
+
+    // Every call follows a completion, so the connection has moved since the last one.
+    INCTTP_time_connection(cs, &loop->timeouts, c, 1);
+    return 1;
+}
+
+/**
+ * Closes connection `c`, or marks it to be freed once its operations in flight complete.
+ */
+static void drop(UringLoop *loop, INCTTP_Connection *c)
+{
+    INCTTP_cancel_timer(&loop->timeouts, &c->timer);
+    c->closing = 1;
+    if (c->ops > 0) return;
+
+    if (c->fd >= 0) close(c->fd);
+    INCTTP_free_connection(c);
+}
+
+static void on_accept(UringLoop *loop, int res, unsigned flags)
+{
+    INCTTP_WorkerMetrics *m = INCTTP_worker_metrics;
+
+    // A multishot accept stops after an error; it is submitted again so that new clients are still served.
+    if (!(flags & IORING_CQE_F_MORE)) submit_accept(loop);
+    if (res < 0)
+    {
+        if (m != NULL && res != -EINTR && res != -ECONNABORTED) INCTTP_count(&m->accept_errors, 1);
+        return;
+    }
+
+    // Every completion of a multishot accept would share one address buffer, so the address is only asked for when
+    // the access log needs it.
+    struct sockaddr_in peer = {};
+    socklen_t len = sizeof(peer);
+    if (INCTTP_worker_log != NULL) getpeername(res, (struct sockaddr *)&peer, &len);
+
+    INCTTP_Connection *c = INCTTP_new_connection(res, &peer);
+    if (c == NULL)
+    {
+        if (m != NULL) INCTTP_count(&m->accept_errors, 1);
+        close(res);
+        return;
+    }
+    if (m != NULL) INCTTP_count(&m->accepted, 1);
+
+    if (advance(loop, c) == 0) drop(loop, c);
+}
+
+/**
+ * Appends the bytes received in a provided buffer to the receive buffer of connection `c`, returning the buffer.
+ * Returns 0 if the connection must be closed, 1 otherwise.
+ */
+static int on_recv(UringLoop *loop, INCTTP_Connection *c, int res, unsigned flags)
+{
+    // Every buffer is taken: try again once this batch of completions has returned theirs.
+    if (res == -ENOBUFS) return submit_recv(loop, c);
+    if (res < 0) return 0;
+
+    // The peer has stopped sending; requests it completed before are still answered.
+    if (res == 0)
+    {
+        c->eof = 1;
+        return advance(loop, c);
+    }
+
+    unsigned short bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+    size_t n = (size_t)res;
+    if (c->rlen + n > c->rcap)
+    {
+        // The buffer may outgrow `cs->rsize` by less than a receive, since the parser rejects the request anyway.
+        size_t cap = c->rcap * 2 > c->rlen + n ? c->rcap * 2 : c->rlen + n;
+        char *rbuf = (char *)realloc(c->rbuf, cap);
+        if (rbuf == NULL)
+        {
+            provide_buffer(loop, bid);
+            return 0;
+        }
+
+        c->rbuf = rbuf;
+        c->rcap = cap;
+    }
+
+    memcpy(c->rbuf + c->rlen, loop->buffers + (size_t)bid * INCTTP_URING_BUFFER_SIZE, n);
+    c->rlen += n;
+    provide_buffer(loop, bid);
+    if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->bytes_in, n);
+
+    return advance(loop, c);
+}
+
+/**
+ * Drops the bytes a `sendmsg` operation of connection `c` sent and carries on with the rest of the response, or with
+ * the next request. Returns 0 if the connection must be closed, 1 otherwise.
+ */
+static int on_send(UringLoop *loop, INCTTP_Connection *c, int res)
+{
+    if (res < 0) return 0;
+
+    if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->bytes_out, (unsigned long long)res);
+    INCTTP_consume_response(&c->response, (size_t)res);
+
+    // The linked close is on its way, unless a partial send cancelled it.
+    if (c->closing)
+    {
+        if (c->response.first == c->response.count) INCTTP_complete_response(loop->cs, c);
+        return 1;
+    }
+
+    return advance(loop, c);
+}
+
+/**
+ * Dispatches completion `cqe`.
+ */
+static void complete(UringLoop *loop, const struct io_uring_cqe *cqe)
+{
+    int op = (int)(cqe->user_data & OP_MASK);
+    INCTTP_Connection *c = (INCTTP_Connection *)(uintptr_t)(cqe->user_data & ~(unsigned long long)OP_MASK);
+
+    if (op == OP_ACCEPT)
+    {
+        on_accept(loop, cqe->res, cqe->flags);
+        return;
+    }
+    if (op == OP_CANCEL) return;
+
+    c->ops--;
+    int alive = 1;
+    switch (op)
+    {
+    case OP_RECV:
+        alive = on_recv(loop, c, cqe->res, cqe->flags);
+        break;
+    case OP_SEND:
+        alive = on_send(loop, c, cqe->res);
+        break;
+    case OP_CLOSE:
+        // A cancelled close leaves the socket to `drop`.
+        if (cqe->res >= 0) c->fd = -1;
+        break;
+    case OP_POLL:
+        alive = cqe->res >= 0 && advance(loop, c);
+        break;
+    case OP_WAIT:
+        // A poll cancelled because the wait timed out ends it like the timeout would have.
+        INCTTP_cancel_timer(&loop->waits, &c->co->timer);
+        alive = INCTTP_resume_connection(c, cqe->res >= 0 ? cqe->res : c->co->expired ? 0 : -1) && advance(loop, c);
+        break;
+    }
+
+    if (!alive || c->closing) drop(loop, c);
+}
+
+/**
+ * Ends the connections that waited too long for their client, and the waits of suspended handlers whose timeout
+ * passed. A wait for a descriptor ends once its poll is cancelled.
+ */
+static void expire(UringLoop *loop)
+{
+    INCTTP_Timer *t;
+    while ((t = INCTTP_pop_expired(&loop->timeouts)) != NULL)
+    {
+        // The pending operation completes with end of file or an error, and the connection is closed like any other.
+        shutdown(INCTTP_OWNER(t, INCTTP_Connection, timer)->fd, SHUT_RDWR);
+    }
+
+    while ((t = INCTTP_pop_expired(&loop->waits)) != NULL)
+    {
+        INCTTP_Coroutine *co = INCTTP_OWNER(t, INCTTP_Coroutine, timer);
+        INCTTP_Connection *c = co->conn;
+        if (co->fd < 0)
+        {
+            if (INCTTP_resume_connection(c, 0) == 0 || advance(loop, c) == 0) drop(loop, c);
+            continue;
+        }
+
+        co->expired = 1;
+        if (reserve(loop, 1) == 0) continue;
+
+        struct io_uring_sqe *sqe = next_sqe(loop, NULL, OP_CANCEL);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = (unsigned long long)(uintptr_t)c | OP_WAIT;
+    }
+}
+
+int INCTTP_run_uring_loop(INCTTP_Worker *wk)
+{
+    UringLoop loop;
+    memset(&loop, 0, sizeof(UringLoop));
+    loop.cs = wk->cs;
+    loop.server_fd = wk->server_fd;
+
+    if (init_loop(&loop) == 0 || submit_accept(&loop) == 0)
+    {
+        free_loop(&loop);
+        return CTTP_ERROR_NIL;
+    }
+
+    INCTTP_init_wheel(&loop.timeouts, INCTTP_now_ns() / 1000000);
+    INCTTP_init_wheel(&loop.waits, loop.timeouts.now);
+
+    while (1)
+    {
+        expire(&loop);
+        int timeout = INCTTP_next_expiry(&loop.waits, INCTTP_next_expiry(&loop.timeouts, -1));
+
+        // Operations queued while handling the last batch are submitted with the same call that waits for the next.
+        if (enter(&loop, 1, timeout) == 0) break;
+
+        // Timeouts armed while the batch is handled count from the time it arrived.
+        long long now = INCTTP_now_ns() / 1000000;
+        INCTTP_advance_wheel(&loop.timeouts, now);
+        INCTTP_advance_wheel(&loop.waits, now);
+
+        unsigned head = *loop.cq_head;
+        while (head != __atomic_load_n(loop.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = loop.cqes[head & loop.cq_mask];
+
+            // The entry is released before it is handled, since handling may submit (and so complete) more.
+            __atomic_store_n(loop.cq_head, ++head, __ATOMIC_RELEASE);
+            complete(&loop, &cqe);
+        }
+    }
+
+    free_loop(&loop);
+    return CTTP_ERROR_SERVER_EVENT_LOOP;
+}
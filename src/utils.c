@@ -1,25 +1,79 @@
-#include <arpa/inet.h>
-#include <netinet/in.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "cttp-internal.h"
 
+void INCTTP_lru_push(INCTTP_Lru *l, INCTTP_LruLink *e)
+{
+    e->prev = NULL;
+    e->next = l->head;
+    if (l->head) l->head->prev = e;
+    else l->tail = e;
+    l->head = e;
+}
+
+void INCTTP_lru_unlink(INCTTP_Lru *l, INCTTP_LruLink *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else l->head = e->next;
+
+    if (e->next) e->next->prev = e->prev;
+    else l->tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
 static const char *DAYS[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
 static const char *MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
+/**
+ * `Date` header line of the second `sec`, formatted by the thread the first time it needed it.
+ */
+static __thread struct
+{
+    time_t sec;
+    size_t len;
+    char   line[sizeof("Date: \r\n") + DATE_LEN];
+}
+date_cache;
+
+const char *INCTTP_date_header(size_t *len)
+{
+    time_t now = time(NULL);
+    if (now != date_cache.sec || date_cache.len == 0)
+    {
+        char date[DATE_LEN];
+        INCTTP_format_date(date, now);
+
+        date_cache.sec = now;
+        date_cache.len = (size_t)snprintf(date_cache.line, sizeof(date_cache.line), "Date: %s\r\n", date);
+    }
+
+    *len = date_cache.len;
+    return date_cache.line;
+}
+
 void INCTTP_current_date(char *buf) {
-    time_t timestamp;
-    struct tm *tm_info;
-    time(&timestamp);
-    tm_info = gmtime(&timestamp);
+    size_t len;
+    const char *line = INCTTP_date_header(&len);
+
+    // Strip `Date: ` and the trailing `CRLF`.
+    memcpy(buf, line + 6, len - 8);
+    buf[len - 8] = '\0';
+}
+
+void INCTTP_format_date(char *buf, time_t t) {
+    struct tm tm;
+    // `gmtime_r` keeps the conversion thread-safe across workers.
+    struct tm *tm_info = gmtime_r(&t, &tm);
 
     snprintf(
             buf,
             DATE_LEN,
             "%s, %02d %s %d %02d:%02d:%02d GMT",
             DAYS[tm_info->tm_wday],
-            tm_info->tm_wday,
+            tm_info->tm_mday,
             MONTHS[tm_info->tm_mon],
             tm_info->tm_year + 1900,
             tm_info->tm_hour,
@@ -27,34 +81,3 @@ void INCTTP_current_date(char *buf) {
             tm_info->tm_sec
             );
 }
-
-void INCTTP_print_start(struct sockaddr_in client_addr, size_t request_count)
-{
-    char date[DATE_LEN];
-    INCTTP_current_date(date);
-
-    printf(
-            "\033[0;32mRequest \033[1;33m#%lu\033[0;32m from %s:%d started at %s\033[0m\n",
-            request_count,
-            inet_ntoa(client_addr.sin_addr), // client's IP
-            ntohs(client_addr.sin_port), // client's port
-            date
-          );
-}
-
-
-// 35 31 error
-
-void INCTTP_print_end(struct sockaddr_in client_addr, size_t request_count)
-{
-    char date[DATE_LEN];
-    INCTTP_current_date(date);
-
-    printf(
-            "\033[0;32mRequest \033[1;33m#%lu\033[0;32m from %s:%d finished at %s\033[0m\n",
-            request_count,
-            inet_ntoa(client_addr.sin_addr), // client's IP
-            ntohs(client_addr.sin_port), // client's port
-            date
-          );
-}
@@ -1,78 +1,648 @@
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
 #include "cttp-internal.h"
 #include "cttp-status.h"
 #include "cttp.h"
 
+/* Bytes sent after the status line of every response */
+#define SERVER_HEADER "Server: 0.0.0.0\r\n"
+
+/**
+ * Serialized response prefixes (status line and `Server` header) of every `CTTP_STATUS_*`, indexed by status code - 100.
+ */
+typedef struct
+{
+    const char *status;
+    const char *prefix;
+    size_t      len;
+}
+StatusPrefix;
+
+#define STATUS_PREFIX(code, STATUS) \
+    [code - 100] = {STATUS, "HTTP/1.1 " STATUS "\r\n" SERVER_HEADER, sizeof("HTTP/1.1 " STATUS "\r\n" SERVER_HEADER) - 1}
+
+static const StatusPrefix STATUS_PREFIXES[500] = {
+    STATUS_PREFIX(100, CTTP_STATUS_CONTINUE),
+    STATUS_PREFIX(101, CTTP_STATUS_SWITCHING_PROTOCOLS),
+    STATUS_PREFIX(102, CTTP_STATUS_PROCESSING),
+    STATUS_PREFIX(103, CTTP_STATUS_HEARLY_HINTS),
+    STATUS_PREFIX(200, CTTP_STATUS_OK),
+    STATUS_PREFIX(201, CTTP_STATUS_CREATED),
+    STATUS_PREFIX(202, CTTP_STATUS_ACCEPTED),
+    STATUS_PREFIX(203, CTTP_STATUS_NON_AUTHORITATIVE),
+    STATUS_PREFIX(204, CTTP_STATUS_NO_CONTENT),
+    STATUS_PREFIX(205, CTTP_STATUS_RESET_CONTENT),
+    STATUS_PREFIX(206, CTTP_STATUS_PARTIAL_CONTENT),
+    STATUS_PREFIX(207, CTTP_STATUS_MULTI_STATUS),
+    STATUS_PREFIX(208, CTTP_STATUS_ALREADY_REPORTED),
+    STATUS_PREFIX(226, CTTP_STATUS_IM_USED),
+    STATUS_PREFIX(300, CTTP_STATUS_MULTIPLE_CHOICES),
+    STATUS_PREFIX(301, CTTP_STATUS_MOVED_PERMANENTLY),
+    STATUS_PREFIX(302, CTTP_STATUS_FOUND),
+    STATUS_PREFIX(303, CTTP_STATUS_SEE_OTHER),
+    STATUS_PREFIX(304, CTTP_STATUS_NOT_MODIFIED),
+    STATUS_PREFIX(305, CTTP_STATUS_USE_PROXY),
+    STATUS_PREFIX(307, CTTP_STATUS_TEMPORARY_REDIRECT),
+    STATUS_PREFIX(308, CTTP_STATUS_PERMANENT_REDIRECT),
+    STATUS_PREFIX(400, CTTP_STATUS_BAD_REQUEST),
+    STATUS_PREFIX(401, CTTP_STATUS_UNAUTHORIZED),
+    STATUS_PREFIX(402, CTTP_STATUS_PAYMENT_REQUIRED),
+    STATUS_PREFIX(403, CTTP_STATUS_FORBIDDEN),
+    STATUS_PREFIX(404, CTTP_STATUS_NOT_FOUND),
+    STATUS_PREFIX(405, CTTP_STATUS_METHOD_NOT_ALLOWED),
+    STATUS_PREFIX(406, CTTP_STATUS_NOT_ACCEPTABLE),
+    STATUS_PREFIX(407, CTTP_STATUS_PROXY_AUTH_REQUIRED),
+    STATUS_PREFIX(408, CTTP_STATUS_REQUEST_TIMEOUT),
+    STATUS_PREFIX(409, CTTP_STATUS_CONFLICT),
+    STATUS_PREFIX(410, CTTP_STATUS_GONE),
+    STATUS_PREFIX(411, CTTP_STATUS_LENGTH_REQUIRED),
+    STATUS_PREFIX(412, CTTP_STATUS_PRECONDITION_FAILED),
+    STATUS_PREFIX(413, CTTP_STATUS_CONTENT_TOO_LARGE),
+    STATUS_PREFIX(414, CTTP_STATUS_URI_TOO_LONG),
+    STATUS_PREFIX(415, CTTP_STATUS_UNSUPPORTED_MEDIA),
+    STATUS_PREFIX(416, CTTP_STATUS_RANGE_NOT_SATISFY),
+    STATUS_PREFIX(417, CTTP_STATUS_EXPECTATION_FAILED),
+    STATUS_PREFIX(418, CTTP_STATUS_IM_A_TEAPOT),
+    STATUS_PREFIX(421, CTTP_STATUS_MISDIRECTED_REQUEST),
+    STATUS_PREFIX(422, CTTP_STATUS_UNPROCESSABLE_ENTITY),
+    STATUS_PREFIX(423, CTTP_STATUS_LOCKED),
+    STATUS_PREFIX(424, CTTP_STATUS_FAILED_DEPENDENCY),
+    STATUS_PREFIX(425, CTTP_STATUS_TOO_EARLY),
+    STATUS_PREFIX(426, CTTP_STATUS_UPGRADE_REQUIRED),
+    STATUS_PREFIX(428, CTTP_STATUS_PRECONDITION_REQUIRED),
+    STATUS_PREFIX(429, CTTP_STATUS_TOO_MANY_REQUESTS),
+    STATUS_PREFIX(431, CTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE),
+    STATUS_PREFIX(451, CTTP_STATUS_UNAVAILABLE_FOR_LEGAL_REASONS),
+    STATUS_PREFIX(500, CTTP_STATUS_INTERNAL_SERVER_ERROR),
+    STATUS_PREFIX(501, CTTP_STATUS_NOT_IMPLEMENTED),
+    STATUS_PREFIX(502, CTTP_STATUS_BAD_GATEWAY),
+    STATUS_PREFIX(503, CTTP_STATUS_SERVICE_UNAVAILABLE),
+    STATUS_PREFIX(504, CTTP_STATUS_GATEWAY_TIMEOUT),
+    STATUS_PREFIX(505, CTTP_STATUS_HTTP_VERSION_NOT_SUPPORTED),
+    STATUS_PREFIX(506, CTTP_STATUS_VARIANT_ALSO_NEGOTIATES),
+    STATUS_PREFIX(507, CTTP_STATUS_INSUFFICIENT_STORAGE),
+    STATUS_PREFIX(508, CTTP_STATUS_LOOP_DETECTED),
+    STATUS_PREFIX(510, CTTP_STATUS_NOT_EXTENDED),
+    STATUS_PREFIX(511, CTTP_STATUS_NETWORK_AUTH_REQUIRED),
+};
+
 char *CTTP_read_writer_header(CTTP_Writer *w, char *k)
 {
+    size_t klen = strlen(k);
+    int id = INCTTP_header_id(k, klen);
+
     for (int i = 0; i < w->hsize; i++)
     {
-        if (strcmp(w->headers[i].key, k) == 0)
+        CTTP_Header *h = &w->headers[i];
+        if (id != CTTP_HEADER_OTHER ? h->id == id : h->klen == klen && strncasecmp(h->key, k, klen) == 0)
         {
-            return w->headers[i].val;
+            return h->val;
         }
     }
 
     return NULL;
 }
 
+void INCTTP_init_writer(CTTP_Writer *w, INCTTP_Arena *a)
+{
+    // Header slots are only read up to `hsize`, so the array is left untouched.
+    w->status = NULL;
+    w->body = NULL;
+    w->bsize = 0;
+    w->hsize = 0;
+    w->arena = a;
+    w->file = NULL;
+    w->compressed = NULL;
+    w->cached = NULL;
+    w->prefix = NULL;
+    w->prefix_len = 0;
+    w->fd = -1;
+    w->stream = INCTTP_STREAM_NONE;
+    w->request = NULL;
+    w->keep_alive = NULL;
+    w->streamed = 0;
+    w->declared = -1;
+    w->timeout = 0;
+}
+
 int CTTP_write_header(CTTP_Writer *w, char *k, char *v)
 {
+    if (w->hsize >= CTTP_HEADER_LIMIT) return 0;
+
     CTTP_Header *header = &w->headers[w->hsize];
-    header->key = strdup(k);
-    header->val = strdup(v);
-    w->hsize++;
+    header->klen = strlen(k);
+    header->vlen = strlen(v);
+    header->id = INCTTP_header_id(k, header->klen);
+    header->key = INCTTP_arena_strndup(w->arena, k, header->klen);
+    header->val = INCTTP_arena_strndup(w->arena, v, header->vlen);
+    if (header->key == NULL || header->val == NULL) return 0;
 
-    return header->key != NULL && header->val != NULL ? 1 : 0;
+    w->hsize++;
+    return 1;
 }
 
 int CTTP_write_status(CTTP_Writer *w, const char *STATUS)
 {
-    w->status = strdup(STATUS);
+    // Known statuses use their precomputed prefix and need no copy.
+    if (STATUS[0] >= '1' && STATUS[0] <= '5' && STATUS[1] >= '0' && STATUS[1] <= '9' && STATUS[2] >= '0' && STATUS[2] <= '9')
+    {
+        const StatusPrefix *known = &STATUS_PREFIXES[(STATUS[0] - '0') * 100 + (STATUS[1] - '0') * 10 + (STATUS[2] - '0') - 100];
+        if (known->status != NULL && strcmp(known->status, STATUS) == 0)
+        {
+            w->status = known->status;
+            w->prefix = known->prefix;
+            w->prefix_len = known->len;
+            return 1;
+        }
+    }
+
+    w->status = INCTTP_arena_strndup(w->arena, STATUS, strlen(STATUS));
+    w->prefix = NULL;
+    w->prefix_len = 0;
     return w->status != NULL ? 1 : 0;
 }
 
 int CTTP_write_body(CTTP_Writer *w, const char *b, size_t bsize)
 {
-    w->body = strdup(b);
+    w->body = INCTTP_arena_strndup(w->arena, b, bsize);
     w->bsize = bsize;
     if (w->body == NULL) return 0;
 
     char contentLength[1024];
     snprintf(contentLength, 1024, "%lu", bsize);
+
+    // A body written again replaces the length of the previous one, as two lengths would make the framing ambiguous.
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        CTTP_Header *h = &w->headers[i];
+        if (h->id != CTTP_HEADER_CONTENT_LENGTH) continue;
+
+        h->vlen = strlen(contentLength);
+        h->val = INCTTP_arena_strndup(w->arena, contentLength, h->vlen);
+        return h->val != NULL ? 1 : 0;
+    }
+
     if (CTTP_write_header(w, "Content-Length", contentLength) == 0) return 0;
 
     return 1;
 }
 
-void INCTTP_write_response(char *buf, size_t buf_len, CTTP_Writer *w, CTTP_Server *cs)
+int INCTTP_write_prefix(CTTP_Writer *w)
+{
+    if (w->status == NULL) CTTP_write_status(w, CTTP_STATUS_OK);
+    if (w->prefix != NULL) return 1;
+
+    // A status without a precomputed prefix, serialized in the arena.
+    size_t slen = strlen(w->status);
+    char *prefix = (char *)INCTTP_arena_alloc(w->arena, 9 + slen + 2 + sizeof(SERVER_HEADER) - 1);
+    if (prefix == NULL) return 0;
+
+    memcpy(prefix, "HTTP/1.1 ", 9);
+    memcpy(prefix + 9, w->status, slen);
+    memcpy(prefix + 9 + slen, "\r\n" SERVER_HEADER, 2 + sizeof(SERVER_HEADER) - 1);
+    w->prefix = prefix;
+    w->prefix_len = 9 + slen + 2 + sizeof(SERVER_HEADER) - 1;
+    return 1;
+}
+
+int INCTTP_write_response(INCTTP_Response *res, CTTP_Writer *w)
+{
+    // The file reference moves to the response, which releases it once sent.
+    res->file = w->file;
+    res->foff = 0;
+    res->fleft = w->file != NULL ? w->file->size : 0;
+    w->file = NULL;
+    res->compressed = w->compressed;
+    w->compressed = NULL;
+    res->cached = w->cached;
+    w->cached = NULL;
+
+    if (INCTTP_write_prefix(w) == 0) return 0;
+
+    size_t dlen;
+    const char *date = INCTTP_date_header(&dlen);
+
+    // Size the header block exactly, so it is written with a single allocation and no bounds to truncate at.
+    size_t hlen = dlen + 2;
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        hlen += w->headers[i].klen + 2 + w->headers[i].vlen + 2;
+    }
+
+    char *block = (char *)INCTTP_arena_alloc(w->arena, hlen);
+    if (block == NULL) return 0;
+
+    // The date is copied rather than referenced: the cached line may change before a slow client takes it all.
+    char *p = block;
+    memcpy(p, date, dlen);
+    p += dlen;
+
+    for (size_t i = 0; i < w->hsize; i++)
+    {
+        CTTP_Header *h = &w->headers[i];
+        memcpy(p, h->key, h->klen);
+        p += h->klen;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy(p, h->val, h->vlen);
+        p += h->vlen;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+
+    res->iov[0].iov_base = (void *)w->prefix;
+    res->iov[0].iov_len = w->prefix_len;
+    res->iov[1].iov_base = block;
+    res->iov[1].iov_len = hlen;
+    res->iov[2].iov_base = w->body;
+    res->iov[2].iov_len = w->body != NULL ? w->bsize : 0;
+    res->first = 0;
+    res->count = res->iov[2].iov_len > 0 ? 3 : 2;
+
+    return 1;
+}
+
+/**
+ * One content coding of a constant response.
+ */
+typedef struct
+{
+    const char *prefix; /* Status line, `Server` header and the route's headers, or `NULL` if the coding is not available */
+    size_t      prefix_len;
+    const char *body;
+    size_t      bsize;
+}
+ConstantVariant;
+
+/**
+ * A response serialized once, when its route is added, in every content coding it is worth compressing with.
+ * It is allocated as a single block, freed with its route node.
+ */
+typedef struct
+{
+    const char     *status;
+    unsigned int    encodings; /* Bitmask of the compressed variants (`1 << INCTTP_ENCODING`) */
+    ConstantVariant variants[INCTTP_ENCODING_COUNT];
+}
+ConstantResponse;
+
+/**
+ * Handler of constant routes, pointing the writer at the pre-serialized response in the coding the client prefers.
+ */
+static int serve_constant(CTTP_Writer *w, CTTP_Request *r)
 {
-    // When `CTTP_write_body` is not sent, `w->body` is `NULL`, to avoid a body (null)
-    // response, we ensure that `w-body` is always a string.
-    if (w->body == NULL) w->body = "";
+    const ConstantResponse *c = (const ConstantResponse *)r->route->data;
+
+    int enc = INCTTP_ENCODING_IDENTITY;
+    if (c->encodings != 0) enc = INCTTP_negotiate_encoding(CTTP_read_request_header_id(r, CTTP_HEADER_ACCEPT_ENCODING), c->encodings);
+
+    const ConstantVariant *v = &c->variants[enc];
+    w->status = c->status;
+    w->prefix = v->prefix;
+    w->prefix_len = v->prefix_len;
+    w->body = (char *)v->body;
+    w->bsize = v->bsize;
 
-    // Write the response headers
-    char hsize[cs->hsize]; // represents all key/value pairs in headers
-    char hline[400]; // represents a single key/valur header
-    hsize[0] = '\0';
-    for (size_t i = 0; i < w->hsize; i++) {
-        snprintf(hline, sizeof(hline), "%s: %s\r\n", w->headers[i].key, w->headers[i].val);
-        strncat(hsize, hline, sizeof(hsize) - strlen(hsize) - 1);
+    return CTTP_ERROR_NIL;
+}
+
+static size_t put(char *q, size_t at, const char *s, size_t len)
+{
+    if (q != NULL) memcpy(q + at, s, len);
+    return at + len;
+}
+
+/**
+ * Serializes to `q` the prefix of a constant response with status `STATUS`, the `headers` of its route and the
+ * framing headers of a body of `bsize` bytes with coding `enc`. Returns its length; nothing is written if `q` is `NULL`.
+ */
+static size_t constant_prefix(char *q, const char *STATUS, const char *const *headers, int enc, int vary, size_t bsize, int bodiless)
+{
+    size_t n = put(q, 0, "HTTP/1.1 ", 9);
+    n = put(q, n, STATUS, strlen(STATUS));
+    n = put(q, n, "\r\n" SERVER_HEADER, 2 + sizeof(SERVER_HEADER) - 1);
+
+    for (size_t i = 0; headers != NULL && headers[i] != NULL && headers[i + 1] != NULL; i += 2)
+    {
+        n = put(q, n, headers[i], strlen(headers[i]));
+        n = put(q, n, ": ", 2);
+        n = put(q, n, headers[i + 1], strlen(headers[i + 1]));
+        n = put(q, n, "\r\n", 2);
+    }
+
+    if (enc != INCTTP_ENCODING_IDENTITY)
+    {
+        n = put(q, n, "Content-Encoding: ", 18);
+        n = put(q, n, INCTTP_ENCODING_NAMES[enc], strlen(INCTTP_ENCODING_NAMES[enc]));
+        n = put(q, n, "\r\n", 2);
+    }
+    if (vary) n = put(q, n, "Vary: Accept-Encoding\r\n", 23);
+
+    // Responses that never have a body must not announce a length (RFC 9110, section 8.6).
+    if (!bodiless)
+    {
+        char length[48];
+        n = put(q, n, length, (size_t)snprintf(length, sizeof(length), "Content-Length: %zu\r\n", bsize));
     }
 
-    char date[DATE_LEN]; 
-    INCTTP_current_date(date);
-    // Write the response body
-    snprintf(
-            buf,
-            buf_len,
-            "HTTP/1.1 %s\r\nDate: %s\r\nServer: 0.0.0.0\r\n%s\r\n%s",
-            w->status,
-            date,
-            hsize,
-            w->body
-            );
+    return n;
 }
 
+void CTTP_add_constant_route(CTTP_Server *cs, char *m, char *p, const char *STATUS, const char *const *headers, const char *b, size_t bsize)
+{
+    int bodiless = STATUS[0] == '1' || strncmp(STATUS, "204", 3) == 0 || strncmp(STATUS, "304", 3) == 0;
+    if (bodiless) bsize = 0;
+
+    const char *type = NULL;
+    for (size_t i = 0; headers != NULL && headers[i] != NULL && headers[i + 1] != NULL; i += 2)
+    {
+        if (strcasecmp(headers[i], "Content-Type") == 0) type = headers[i + 1];
+    }
+
+    // The body is compressed now, once, in every coding that makes it smaller.
+    unsigned int candidates = bodiless ? 0 : INCTTP_compress_encodings(cs, type, bsize);
+    unsigned int encodings = 0;
+    char *compressed[INCTTP_ENCODING_COUNT] = {};
+    size_t csize[INCTTP_ENCODING_COUNT] = {};
+    for (int enc = INCTTP_ENCODING_IDENTITY + 1; enc < INCTTP_ENCODING_COUNT; enc++)
+    {
+        if (!(candidates & (1u << enc))) continue;
+
+        compressed[enc] = (char *)malloc(INCTTP_compress_bound(enc, bsize));
+        if (compressed[enc] != NULL) csize[enc] = INCTTP_compress(enc, INCTTP_COMPRESS_CACHED_LEVEL, b, bsize, compressed[enc]);
+        if (csize[enc] > 0 && csize[enc] < bsize) encodings |= 1u << enc;
+    }
+
+    size_t slen = strlen(STATUS);
+    size_t total = sizeof(ConstantResponse) + slen + 1;
+    for (int enc = 0; enc < INCTTP_ENCODING_COUNT; enc++)
+    {
+        if (enc == INCTTP_ENCODING_IDENTITY) total += constant_prefix(NULL, STATUS, headers, enc, candidates != 0, bsize, bodiless) + bsize;
+        else if (encodings & (1u << enc)) total += constant_prefix(NULL, STATUS, headers, enc, 1, csize[enc], 0) + csize[enc];
+    }
+
+    ConstantResponse *c = (ConstantResponse *)calloc(1, total);
+    if (c != NULL)
+    {
+        char *q = (char *)(c + 1);
+        memcpy(q, STATUS, slen + 1);
+        c->status = q;
+        c->encodings = encodings;
+        q += slen + 1;
+
+        for (int enc = 0; enc < INCTTP_ENCODING_COUNT; enc++)
+        {
+            if (enc != INCTTP_ENCODING_IDENTITY && !(encodings & (1u << enc))) continue;
+
+            const char *body = enc == INCTTP_ENCODING_IDENTITY ? b : compressed[enc];
+            size_t size = enc == INCTTP_ENCODING_IDENTITY ? bsize : csize[enc];
+
+            ConstantVariant *v = &c->variants[enc];
+            v->prefix = q;
+            v->prefix_len = constant_prefix(q, STATUS, headers, enc, candidates != 0, size, bodiless);
+            q += v->prefix_len;
+            memcpy(q, body, size);
+            v->body = q;
+            v->bsize = size;
+            q += size;
+        }
+    }
+
+    for (int enc = 0; enc < INCTTP_ENCODING_COUNT; enc++) free(compressed[enc]);
+    if (c == NULL) return;
+
+    CTTP_RouteNode *node = INCTTP_insert_route(cs, m, p, serve_constant);
+    if (node == NULL)
+    {
+        free(c);
+        return;
+    }
+
+    free(node->data);
+    node->data = c;
+}
+
+void INCTTP_free_response(INCTTP_Response *res)
+{
+    if (res->file != NULL) INCTTP_release_file(res->file);
+    res->file = NULL;
+    if (res->compressed != NULL) INCTTP_release_compressed(res->compressed);
+    res->compressed = NULL;
+    if (res->cached != NULL) INCTTP_release_cached(res->cached);
+    res->cached = NULL;
+}
+
+void INCTTP_consume_response(INCTTP_Response *res, size_t sent)
+{
+    // Whole iovecs first, then the sent part of the one the write stopped in.
+    while (res->first < res->count && sent >= res->iov[res->first].iov_len)
+    {
+        sent -= res->iov[res->first].iov_len;
+        res->first++;
+    }
+
+    if (sent > 0)
+    {
+        res->iov[res->first].iov_base = (char *)res->iov[res->first].iov_base + sent;
+        res->iov[res->first].iov_len -= sent;
+    }
+}
+
+int INCTTP_send_response(int fd, INCTTP_Response *res)
+{
+    // With a file to follow, `MSG_MORE` lets the kernel merge the headers with the first file bytes.
+    int flags = MSG_NOSIGNAL | (res->fleft > 0 ? MSG_MORE : 0);
+
+    while (res->first < res->count)
+    {
+        struct msghdr msg = {};
+        msg.msg_iov = res->iov + res->first;
+        msg.msg_iovlen = res->count - res->first;
+
+        ssize_t n = sendmsg(fd, &msg, flags);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            // The socket buffer is full, wait until it is writable again.
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->bytes_out, (unsigned long long)n);
+        INCTTP_consume_response(res, (size_t)n);
+    }
+
+    // The file goes from the page cache to the socket without passing through userspace.
+    while (res->fleft > 0)
+    {
+        ssize_t n = sendfile(fd, res->file->fd, &res->foff, res->fleft);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        // The file shrank since it was cached: the promised length can no longer be met.
+        if (n == 0) return -1;
+
+        res->fleft -= (size_t)n;
+        if (INCTTP_worker_metrics != NULL) INCTTP_count(&INCTTP_worker_metrics->bytes_out, (unsigned long long)n);
+    }
+
+    return 1;
+}
+
+int INCTTP_send_blocking(int fd, INCTTP_Response *res, int timeout)
+{
+    int sent;
+    while ((sent = INCTTP_send_response(fd, res)) == 0)
+    {
+        // Async handlers are suspended meanwhile rather than blocking the worker.
+        if (CTTP_wait_fd(fd, POLLOUT, timeout > 0 ? timeout : -1) <= 0) return 0;
+    }
+
+    return sent > 0;
+}
+
+int CTTP_writer_flush(CTTP_Writer *w)
+{
+    if (w->stream != INCTTP_STREAM_NONE) return w->stream != INCTTP_STREAM_FAILED;
+    if (w->fd < 0 || w->request == NULL) return 0;
+
+    if (w->status == NULL) CTTP_write_status(w, CTTP_STATUS_OK);
+
+    // Responses that never have a body are not framed at all (RFC 9110, section 8.6).
+    int bodiless = w->status[0] == '1' || strncmp(w->status, "204", 3) == 0 || strncmp(w->status, "304", 3) == 0;
+    int stream = INCTTP_STREAM_IDENTITY;
+    if (!bodiless && w->file == NULL && CTTP_read_writer_header(w, "Content-Length") == NULL)
+    {
+        // HTTP/1.0 has no chunked encoding: the body ends when the connection closes.
+        if (w->request->version == CTTP_VERSION_1_0) *w->keep_alive = 0;
+        else if (CTTP_write_header(w, "Transfer-Encoding", "chunked") == 0) return 0;
+        else stream = INCTTP_STREAM_CHUNKED;
+    }
+    if (bodiless || w->request->method == CTTP_METHOD_HEAD) stream = INCTTP_STREAM_DISCARD;
+
+    // A chunked body written so far goes out as the first chunk, once the headers are sent.
+    char *body = w->body;
+    size_t bsize = w->bsize;
+    if (stream != INCTTP_STREAM_IDENTITY)
+    {
+        w->body = NULL;
+        w->bsize = 0;
+    }
+
+    INCTTP_prepare_response(w);
+
+    // An identity body must end at the length it declared, or the next response on the connection would be read
+    // from the wrong offset. A length that cannot be read leaves the body to end with the connection.
+    const char *length = CTTP_read_writer_header(w, "Content-Length");
+    if (stream == INCTTP_STREAM_IDENTITY && length != NULL)
+    {
+        char *rest;
+        w->declared = strtoll(length, &rest, 10);
+        if (rest == length || *rest != '\0' || w->declared < 0)
+        {
+            w->declared = -1;
+            *w->keep_alive = 0;
+        }
+    }
+
+    size_t first = w->bsize + (w->file != NULL ? w->file->size : 0);
+    if (w->declared >= 0 && first > (size_t)w->declared)
+    {
+        w->stream = INCTTP_STREAM_FAILED;
+        return 0;
+    }
+
+    INCTTP_Response res = {};
+    int sent = INCTTP_write_response(&res, w) && INCTTP_send_blocking(w->fd, &res, w->timeout);
+    INCTTP_free_response(&res);
+
+    if (stream == INCTTP_STREAM_IDENTITY) w->streamed += first;
+    w->body = NULL;
+    w->bsize = 0;
+    w->stream = sent ? stream : INCTTP_STREAM_FAILED;
+    if (!sent) return 0;
+
+    return stream == INCTTP_STREAM_CHUNKED ? CTTP_write_chunk(w, body, bsize) : 1;
+}
+
+int CTTP_write_chunk(CTTP_Writer *w, const char *b, size_t len)
+{
+    if (w->stream == INCTTP_STREAM_NONE && CTTP_writer_flush(w) == 0) return 0;
+    if (w->stream == INCTTP_STREAM_FAILED) return 0;
+
+    // An empty chunk would end the body, so there is nothing to send.
+    if (w->stream == INCTTP_STREAM_DISCARD || len == 0) return 1;
+
+    if (w->declared >= 0 && w->streamed + len > (size_t)w->declared)
+    {
+        w->stream = INCTTP_STREAM_FAILED;
+        return 0;
+    }
+
+    INCTTP_Response res = {};
+    char size[20];
+    if (w->stream == INCTTP_STREAM_CHUNKED)
+    {
+        res.iov[0].iov_base = size;
+        res.iov[0].iov_len = (size_t)snprintf(size, sizeof(size), "%zx\r\n", len);
+        res.iov[1].iov_base = (void *)b;
+        res.iov[1].iov_len = len;
+        res.iov[2].iov_base = (void *)"\r\n";
+        res.iov[2].iov_len = 2;
+        res.count = 3;
+    }
+    else
+    {
+        res.iov[0].iov_base = (void *)b;
+        res.iov[0].iov_len = len;
+        res.count = 1;
+    }
+
+    if (INCTTP_send_blocking(w->fd, &res, w->timeout))
+    {
+        w->streamed += len;
+        return 1;
+    }
+
+    w->stream = INCTTP_STREAM_FAILED;
+    return 0;
+}
+
+int INCTTP_finish_stream(INCTTP_Response *res, CTTP_Writer *w, int result)
+{
+    memset(res, 0, sizeof(INCTTP_Response));
+    if (w->stream == INCTTP_STREAM_FAILED) return 0;
+
+    // The headers are gone already, so a failing handler cannot get its error response out. The body is left
+    // unterminated and the connection closed, for the client to see it is incomplete.
+    if (result < 1)
+    {
+        *w->keep_alive = 0;
+        return 1;
+    }
+
+    // A body shorter than its declared length leaves the client waiting for the rest.
+    if (w->declared >= 0 && w->streamed != (size_t)w->declared) *w->keep_alive = 0;
+
+    if (w->stream == INCTTP_STREAM_CHUNKED)
+    {
+        res->iov[0].iov_base = (void *)"0\r\n\r\n";
+        res->iov[0].iov_len = 5;
+        res->count = 1;
+    }
+
+    return 1;
+}